@@ -0,0 +1,119 @@
+// Compares the two ways of writing a backup: a backup thread walking an MVCC
+// snapshot, and a child process forked to walk its copy of the table. For
+// each one it reports how long the job that asked for the backup is stalled,
+// how long the backup takes to be complete, and for the fork the peak memory
+// of the children.
+//
+// Usage: backup_bench [-n num_pairs] [-v value_size] [-r rounds]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "common.h"
+#include "src/server/operations.h"
+
+// Fills the table with num_pairs pairs, MAX_WRITE_SIZE per batch.
+// @return 0 if successful, 1 otherwise.
+static int fill(size_t num_pairs, size_t value_size) {
+  char key_data[MAX_WRITE_SIZE][32];
+  char *keys[MAX_WRITE_SIZE];
+  Value values[MAX_WRITE_SIZE];
+  char *value = malloc(value_size + 1);
+  if (value == NULL) {
+    return 1;
+  }
+  memset(value, 'v', value_size);
+  value[value_size] = '\0';
+
+  for (size_t done = 0; done < num_pairs;) {
+    size_t count = 0;
+    for (; count < MAX_WRITE_SIZE && done < num_pairs; count++, done++) {
+      snprintf(key_data[count], sizeof(key_data[count]), "key%zu", done);
+      keys[count] = key_data[count];
+      values[count] = (Value){value, value_size, NULL};
+    }
+    kvs_write(count, keys, values, 0, -1);
+  }
+  free(value);
+  return 0;
+}
+
+// Runs rounds backups with the current backup mode.
+// @param fork_backups Whether the backups fork a process.
+static void run_backups(const char *mode, int fork_backups, size_t rounds,
+                        char *directory) {
+  double stall = 0, total = 0;
+  for (size_t i = 0; i < rounds; i++) {
+    char job[] = "bench.job"; // kvs_backup cuts it at the dot
+    double start = now_ms();
+    if (kvs_backup(i + 1, job, directory) != 0) {
+      fprintf(stderr, "Failed to do backup\n");
+      return;
+    }
+    stall += now_ms() - start;
+    kvs_wait_backup();
+    total += now_ms() - start;
+  }
+
+  printf("%-6s stall %8.3f ms  complete %8.3f ms", mode,
+         stall / (double)rounds, total / (double)rounds);
+  if (fork_backups) {
+    struct rusage usage;
+    getrusage(RUSAGE_CHILDREN, &usage);
+    printf("  child peak RSS %ld KB", usage.ru_maxrss);
+  }
+  printf("\n");
+}
+
+int main(int argc, char *argv[]) {
+  size_t num_pairs = 1000000, value_size = 32, rounds = 5;
+  int opt;
+  while ((opt = getopt(argc, argv, "n:v:r:")) != -1) {
+    switch (opt) {
+    case 'n':
+      num_pairs = (size_t)atol(optarg);
+      break;
+    case 'v':
+      value_size = (size_t)atol(optarg);
+      break;
+    case 'r':
+      rounds = (size_t)atol(optarg);
+      break;
+    default:
+      fprintf(stderr, "Usage: %s [-n num_pairs] [-v value_size] [-r rounds]\n",
+              argv[0]);
+      return 1;
+    }
+  }
+  if (rounds == 0 || value_size > MAX_VALUE_SIZE) {
+    fprintf(stderr, "Invalid arguments\n");
+    return 1;
+  }
+
+  char directory[] = BENCH_DIRECTORY;
+  if (bench_directory_create(directory) != 0) {
+    return 1;
+  }
+  long num_cores = sysconf(_SC_NPROCESSORS_ONLN);
+  size_t num_shards = (size_t)(num_cores > 0 ? num_cores : 1) * SHARDS_PER_CORE;
+
+  printf("%zu pairs of %zu bytes, %zu rounds\n", num_pairs, value_size,
+         rounds);
+  const char *modes[] = {"thread", "fork"};
+  for (int fork_backups = 0; fork_backups <= 1; fork_backups++) {
+    if (kvs_init(num_shards, 0, 0, 1, fork_backups) == NULL ||
+        fill(num_pairs, value_size) != 0) {
+      fprintf(stderr, "Failed to initialize KVS\n");
+      return 1;
+    }
+    run_backups(modes[fork_backups], fork_backups, rounds, directory);
+    kvs_terminate();
+  }
+
+  bench_directory_remove(directory);
+  return 0;
+}
@@ -0,0 +1,88 @@
+#include "common.h"
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "src/server/parser.h"
+
+// The table notifies the subscribers of the keys written, there are none here
+void notify_clients(const char *key, const char *value, size_t len) {
+  (void)key;
+  (void)value;
+  (void)len;
+}
+
+double now_ms(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (double)now.tv_sec * 1000.0 + (double)now.tv_nsec / 1000000.0;
+}
+
+int bench_directory_create(char *directory) {
+  strcpy(directory, BENCH_DIRECTORY);
+  if (mkdtemp(directory) == NULL) {
+    perror("Failed to create the directory of the benchmark");
+    return 1;
+  }
+  return 0;
+}
+
+void bench_directory_remove(const char *directory) {
+  DIR *dir = opendir(directory);
+  if (dir == NULL) {
+    return;
+  }
+  struct dirent *entry;
+  while ((entry = readdir(dir)) != NULL) {
+    char path[PATH_MAX];
+    if (strcmp(entry->d_name, ".") != 0 && strcmp(entry->d_name, "..") != 0 &&
+        snprintf(path, sizeof(path), "%s/%s", directory, entry->d_name) <
+            (int)sizeof(path)) {
+      unlink(path);
+    }
+  }
+  closedir(dir);
+  rmdir(directory);
+}
+
+static void *feed_pipe(void *arg) {
+  Feeder *feeder = arg;
+  int fd = open(feeder->path, O_RDONLY);
+  char buffer[JOB_BUFFER_SIZE];
+  ssize_t n;
+  while (fd >= 0 && (n = read(fd, buffer, sizeof(buffer))) > 0) {
+    if (write(feeder->fd, buffer, (size_t)n) != n) {
+      break;
+    }
+  }
+  if (fd >= 0) {
+    close(fd);
+  }
+  close(feeder->fd);
+  return NULL;
+}
+
+int feeder_start(Feeder *feeder, const char *path) {
+  int fds[2];
+  if (pipe(fds) != 0) {
+    return -1;
+  }
+  feeder->path = path;
+  feeder->fd = fds[1];
+  if (pthread_create(&feeder->thread, NULL, feed_pipe, feeder) != 0) {
+    close(fds[0]);
+    close(fds[1]);
+    return -1;
+  }
+  return fds[0];
+}
+
+void feeder_join(Feeder *feeder) {
+  pthread_join(feeder->thread, NULL);
+}
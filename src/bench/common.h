@@ -0,0 +1,45 @@
+#ifndef KVS_BENCH_COMMON_H
+#define KVS_BENCH_COMMON_H
+
+#include <pthread.h>
+
+// What the benchmarks share: the clock they are timed with, the directory
+// for their files, and a thread that feeds a job through a pipe.
+
+// Template of the directory of the files of a benchmark
+#define BENCH_DIRECTORY "/tmp/kvs-bench-XXXXXX"
+
+// Copies a job into a pipe, for a reader to read it through its buffer
+typedef struct Feeder {
+  pthread_t thread;
+  const char *path;
+  int fd; // Write end of the pipe
+} Feeder;
+
+/// Reads the monotonic clock.
+/// @return Milliseconds since some point in the past.
+double now_ms(void);
+
+/// Creates an empty directory for the files of a benchmark.
+/// @param directory Buffer of sizeof(BENCH_DIRECTORY) bytes, set to the path
+/// of the directory.
+/// @return 0 if successful, 1 otherwise.
+int bench_directory_create(char *directory);
+
+/// Removes a directory created by bench_directory_create, with the files the
+/// benchmark left in it.
+/// @param directory Path of the directory.
+void bench_directory_remove(const char *directory);
+
+/// Starts a thread copying a job into a pipe.
+/// @param feeder Set to the thread.
+/// @param path Path of the job.
+/// @return The read end of the pipe, -1 on failure.
+int feeder_start(Feeder *feeder, const char *path);
+
+/// Waits for the thread of a feeder. If the pipe was not read to its end, its
+/// read end must be closed first (SIGPIPE is to be ignored).
+/// @param feeder The feeder.
+void feeder_join(Feeder *feeder);
+
+#endif // KVS_BENCH_COMMON_H
@@ -0,0 +1,135 @@
+// Measures the start of the server from a backup: how long it takes to load
+// a full backup of num_pairs pairs into an empty table, mapped and split
+// among the workers. Each round starts from a new table and the best one is
+// kept, as the others were slowed down by noise. With -k, the keys are padded
+// to key_size bytes and written with their "$<length>:" prefix, as backups
+// hold keys longer than the unprefixed ones.
+//
+// Usage: load_bench [-n num_pairs] [-k key_size] [-v value_size]
+//                   [-w num_workers] [-r rounds]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "common.h"
+#include "src/common/constants.h"
+#include "src/server/operations.h"
+
+// Writes a full backup of num_pairs pairs, in the format of the server.
+// @return 0 if successful, 1 otherwise.
+static int write_backup(const char *path, size_t num_pairs, size_t key_size,
+                        size_t value_size) {
+  FILE *file = fopen(path, "w");
+  char *value = malloc(value_size + 1);
+  char *key = malloc(key_size + 1);
+  if (file == NULL || value == NULL || key == NULL) {
+    free(value);
+    free(key);
+    if (file != NULL) {
+      fclose(file);
+    }
+    return 1;
+  }
+  memset(value, 'v', value_size);
+  value[value_size] = '\0';
+  for (size_t i = 0; i < num_pairs; i++) {
+    if (key_size == 0) {
+      fprintf(file, "(key%zu, %s)\n", i, value);
+      continue;
+    }
+    // The number first, so the keys stay different once padded
+    int len = snprintf(key, key_size + 1, "key%zu", i);
+    memset(key + len, 'k', key_size - (size_t)len);
+    key[key_size] = '\0';
+    fprintf(file, "($%zu:%s, %s)\n", key_size, key, value);
+  }
+  free(value);
+  free(key);
+  return fclose(file) != 0;
+}
+
+int main(int argc, char *argv[]) {
+  size_t num_pairs = 1000000, key_size = 0, value_size = 32, rounds = 3;
+  long num_cores = sysconf(_SC_NPROCESSORS_ONLN);
+  size_t num_workers = num_cores > 1 ? (size_t)num_cores - 1 : 0;
+  int opt;
+  while ((opt = getopt(argc, argv, "n:k:v:w:r:")) != -1) {
+    switch (opt) {
+    case 'n':
+      num_pairs = (size_t)atol(optarg);
+      break;
+    case 'k':
+      key_size = (size_t)atol(optarg);
+      break;
+    case 'v':
+      value_size = (size_t)atol(optarg);
+      break;
+    case 'w':
+      num_workers = (size_t)atol(optarg);
+      break;
+    case 'r':
+      rounds = (size_t)atol(optarg);
+      break;
+    default:
+      fprintf(stderr,
+              "Usage: %s [-n num_pairs] [-k key_size] [-v value_size] "
+              "[-w num_workers] [-r rounds]\n",
+              argv[0]);
+      return 1;
+    }
+  }
+  // Long enough for the number of every key, the terminator left out
+  if (num_pairs == 0 || (key_size != 0 && key_size < 24) ||
+      key_size >= MAX_KEY_SIZE || value_size == 0 ||
+      value_size > MAX_VALUE_SIZE || rounds == 0) {
+    fprintf(stderr, "Invalid arguments\n");
+    return 1;
+  }
+
+  char directory[] = BENCH_DIRECTORY;
+  if (bench_directory_create(directory) != 0) {
+    return 1;
+  }
+  char path[sizeof(directory) + 16];
+  snprintf(path, sizeof(path), "%s/bench.bck", directory);
+  if (write_backup(path, num_pairs, key_size, value_size) != 0) {
+    fprintf(stderr, "Failed to write the backup\n");
+    bench_directory_remove(directory);
+    return 1;
+  }
+
+  size_t num_shards =
+      (size_t)(num_cores > 0 ? num_cores : 1) * SHARDS_PER_CORE;
+  printf("%zu pairs of %zu bytes", num_pairs, value_size);
+  if (key_size > 0) {
+    printf(", keys of %zu bytes", key_size);
+  }
+  printf(", %zu workers\n", num_workers);
+
+  double best = 0;
+  int failed = 0;
+  for (size_t round = 0; round < rounds && !failed; round++) {
+    if (kvs_init(num_shards, num_workers, 0, 1, 0) == NULL) {
+      fprintf(stderr, "Failed to initialize KVS\n");
+      failed = 1;
+      break;
+    }
+    double start = now_ms();
+    failed = kvs_load_backup(path);
+    double elapsed = now_ms() - start;
+    kvs_terminate();
+    if (!failed && (round == 0 || elapsed < best)) {
+      best = elapsed;
+    }
+  }
+  if (!failed) {
+    printf("load %10.0f ms %12.0f pairs/s\n", best,
+           (double)num_pairs / best * 1000.0);
+  }
+
+  bench_directory_remove(directory);
+  return failed;
+}
@@ -0,0 +1,285 @@
+// Measures how fast jobs are parsed, in MB/s of the text job: a generated
+// job of the usual commands is parsed the way the job threads do, without
+// running it. It is parsed from the file, which is mapped, and through a
+// pipe, which is read through the buffer of the reader, and compiled by
+// kvs-jobc, decoded. Each mode is run a few rounds and the best one is kept,
+// as the others were slowed down by noise.
+//
+// Usage: parser_bench [-m megabytes] [-v value_size] [-r rounds]
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "common.h"
+#include "src/server/jobc.h"
+#include "src/server/parser.h"
+
+// Writes a job of about size bytes of WRITE, READ, DELETE and CAS commands,
+// some keys and values with a length prefix.
+// @return Bytes written, 0 on failure.
+static size_t write_job(const char *path, size_t size, size_t value_size) {
+  FILE *file = fopen(path, "w");
+  char *value = malloc(value_size + 1);
+  if (file == NULL || value == NULL) {
+    free(value);
+    if (file != NULL) {
+      fclose(file);
+    }
+    return 0;
+  }
+  memset(value, 'v', value_size);
+  value[value_size] = '\0';
+
+  size_t written = 0;
+  for (size_t i = 0; written < size; i++) {
+    int n;
+    switch (i % 8) {
+    case 0:
+    case 1:
+    case 2:
+      n = fprintf(file, "WRITE [(key%zu,%s)(key%zu,%s)(key%zu,%s)]\n", i,
+                  value, i + 1, value, i + 2, value);
+      break;
+    case 3:
+      n = fprintf(file, "WRITE [($%zu:k,%zu,$%zu:%s)]\n",
+                  2 + (size_t)snprintf(NULL, 0, "%zu", i), i, value_size,
+                  value);
+      break;
+    case 4:
+    case 5:
+      n = fprintf(file, "READ [key%zu,key%zu,key%zu,key%zu]\n", i, i - 1,
+                  i - 2, i - 3);
+      break;
+    case 6:
+      n = fprintf(file, "DELETE [key%zu,key%zu]\n", i - 4, i - 5);
+      break;
+    default:
+      n = fprintf(file, "CAS [(key%zu,%s,%s)]\n", i - 6, value, value);
+      break;
+    }
+    if (n < 0) {
+      break;
+    }
+    written += (size_t)n;
+  }
+  if (fclose(file) != 0) {
+    written = 0;
+  }
+  free(value);
+  return written;
+}
+
+// Parses every command of a job, as run_job does.
+// @return Number of commands parsed.
+static size_t parse_job(JobReader *reader, Args *args) {
+  size_t commands = 0;
+  while (1) {
+    unsigned int delay;
+    args_clear(args);
+    switch (get_next(reader)) {
+    case CMD_WRITE:
+    case CMD_INCR:
+    case CMD_APPEND:
+      parse_write(reader, args, MAX_WRITE_SIZE);
+      break;
+    case CMD_WRITE_TTL:
+      if (parse_ttl(reader, &delay) == 0) {
+        parse_write(reader, args, MAX_WRITE_SIZE);
+      }
+      break;
+    case CMD_CAS:
+      parse_cas(reader, args, MAX_WRITE_SIZE / 2);
+      break;
+    case CMD_READ:
+    case CMD_DELETE:
+    case CMD_SCAN:
+      parse_read_delete(reader, args, MAX_WRITE_SIZE);
+      break;
+    case CMD_WAIT:
+      parse_wait(reader, &delay, NULL);
+      break;
+    case CMD_SHOW:
+    case CMD_STATS:
+    case CMD_BACKUP:
+    case CMD_HELP:
+    case CMD_EMPTY:
+    case CMD_INVALID:
+      break;
+    case EOC:
+      return commands;
+    }
+    commands++;
+  }
+}
+
+// Compiles a job, as kvs-jobc does.
+// @return 0 if successful, 1 otherwise.
+static int compile_job(const char *path, const char *compiled, Args *args) {
+  int fd = open(path, O_RDONLY);
+  FILE *out = fopen(compiled, "w");
+  JobReader reader;
+  int failed = fd < 0 || out == NULL || reader_init(&reader, fd) != 0;
+  if (!failed) {
+    char *record = NULL;
+    size_t capacity = 0;
+    failed = fwrite(JOBC_MAGIC, 1, JOBC_MAGIC_SIZE, out) != JOBC_MAGIC_SIZE;
+    JobCommand command;
+    while (!failed) {
+      parse_command(&reader, args, &command);
+      if (command.command == EOC) {
+        break;
+      }
+      if (command.command == CMD_EMPTY) {
+        continue;
+      }
+      size_t size = jobc_size(&command);
+      if (size > capacity) {
+        char *grown = realloc(record, size);
+        if (grown == NULL) {
+          failed = 1;
+          break;
+        }
+        record = grown;
+        capacity = size;
+      }
+      jobc_encode(&command, record);
+      failed = fwrite(record, 1, size, out) != size;
+    }
+    free(record);
+    reader_destroy(&reader);
+  }
+  if (out != NULL && fclose(out) != 0) {
+    failed = 1;
+  }
+  if (fd >= 0) {
+    close(fd);
+  }
+  return failed;
+}
+
+// Decodes every command of a compiled job.
+// @return Milliseconds it took, a negative value on failure.
+static double decode_once(const char *compiled, size_t *commands) {
+  double start = now_ms();
+  int fd = open(compiled, O_RDONLY);
+  JobcReader *reader = malloc(sizeof(JobcReader));
+  double elapsed = -1;
+  if (fd >= 0 && reader != NULL && jobc_open(reader, fd) == 0) {
+    JobCommand command;
+    *commands = 0;
+    while (jobc_next(reader, &command) == 0 && command.command != EOC) {
+      (*commands)++;
+    }
+    elapsed = now_ms() - start;
+    jobc_close(reader);
+  }
+  free(reader);
+  if (fd >= 0) {
+    close(fd);
+  }
+  return elapsed;
+}
+
+// Parses the job once, from the file or through a pipe.
+// @return Milliseconds it took, a negative value on failure.
+static double parse_once(const char *path, int use_pipe, Args *args,
+                         size_t *commands) {
+  Feeder feeder;
+  double start = now_ms();
+  int fd = use_pipe ? feeder_start(&feeder, path) : open(path, O_RDONLY);
+  if (fd < 0) {
+    return -1;
+  }
+
+  JobReader reader;
+  double elapsed = -1;
+  if (reader_init(&reader, fd) == 0) {
+    *commands = parse_job(&reader, args);
+    elapsed = now_ms() - start;
+    reader_destroy(&reader);
+  }
+  close(fd);
+  if (use_pipe) {
+    feeder_join(&feeder);
+  }
+  return elapsed;
+}
+
+int main(int argc, char *argv[]) {
+  size_t megabytes = 64, value_size = 32, rounds = 3;
+  int opt;
+  while ((opt = getopt(argc, argv, "m:v:r:")) != -1) {
+    switch (opt) {
+    case 'm':
+      megabytes = (size_t)atol(optarg);
+      break;
+    case 'v':
+      value_size = (size_t)atol(optarg);
+      break;
+    case 'r':
+      rounds = (size_t)atol(optarg);
+      break;
+    default:
+      fprintf(stderr,
+              "Usage: %s [-m megabytes] [-v value_size] [-r rounds]\n",
+              argv[0]);
+      return 1;
+    }
+  }
+  if (megabytes == 0 || value_size == 0 || value_size > MAX_VALUE_SIZE ||
+      rounds == 0) {
+    fprintf(stderr, "Invalid arguments\n");
+    return 1;
+  }
+
+  char directory[] = BENCH_DIRECTORY;
+  if (bench_directory_create(directory) != 0) {
+    return 1;
+  }
+  char path[sizeof(directory) + 16], compiled[sizeof(directory) + 16];
+  snprintf(path, sizeof(path), "%s/bench.job", directory);
+  snprintf(compiled, sizeof(compiled), "%s/bench.jobc", directory);
+  size_t size = write_job(path, megabytes * 1024 * 1024, value_size);
+  Args args;
+  if (size == 0 || args_init(&args) != 0 ||
+      compile_job(path, compiled, &args) != 0) {
+    fprintf(stderr, "Failed to write the job\n");
+    bench_directory_remove(directory);
+    return 1;
+  }
+  printf("%.1f MB job, values of %zu bytes\n",
+         (double)size / (1024.0 * 1024.0), value_size);
+
+  const char *modes[] = {"mmap", "pipe", "jobc"};
+  int failed = 0;
+  for (int mode = 0; mode < 3 && !failed; mode++) {
+    double best = 0;
+    size_t commands = 0;
+    for (size_t round = 0; round < rounds; round++) {
+      double elapsed = mode == 2 ? decode_once(compiled, &commands)
+                                 : parse_once(path, mode, &args, &commands);
+      if (elapsed < 0) {
+        fprintf(stderr, "Failed to parse the job\n");
+        failed = 1;
+        break;
+      }
+      if (round == 0 || elapsed < best) {
+        best = elapsed;
+      }
+    }
+    if (!failed) {
+      printf("%-5s %10.1f MB/s %12.0f commands/s\n", modes[mode],
+             (double)size / (1024.0 * 1024.0) / best * 1000.0,
+             (double)commands / best * 1000.0);
+    }
+  }
+
+  args_destroy(&args);
+  bench_directory_remove(directory);
+  return failed;
+}
@@ -0,0 +1,300 @@
+// Checks that a mapped job, tokenized in place (in vectors where the
+// machine has them), is parsed exactly like the same job read through a
+// pipe, which goes through the buffer and is tokenized a byte at a time: same
+// commands, same keys and values, same errors. The jobs given are checked,
+// or else fuzzed ones: commands built from valid and broken strings, length
+// prefixes, long strings and stray delimiters.
+//
+// Usage: parser_check [-n jobs] [-l lines] [-s seed] [job...]
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "common.h"
+#include "src/server/parser.h"
+
+// A parsed command, what the job thread would run
+typedef struct Parsed {
+  enum Command command;
+  long result; // Return value of the parse function
+  size_t num_keys;
+  size_t num_values;
+  unsigned int delay;
+} Parsed;
+
+static uint64_t rng_state;
+
+static uint64_t next_random(void) {
+  // xorshift64
+  uint64_t x = rng_state;
+  x ^= x << 13;
+  x ^= x >> 7;
+  x ^= x << 17;
+  rng_state = x;
+  return x;
+}
+
+static size_t random_below(size_t n) { return (size_t)(next_random() % n); }
+
+// Writes a string made to hit the edges of the tokenizer.
+static void fuzz_string(FILE *file) {
+  static const char *const pieces[] = {
+      "a", "bb", "$3:x,y", "$2:xy", "$0:", "$1:", "$99:ab", " x", "k y",
+      "$5:(,)]", "", "$3:ab", "1\n2", "$", "$a:b", "-17", "$7:a]b)c,"};
+  size_t kind = random_below(6);
+  if (kind < 3) {
+    fputs(pieces[random_below(sizeof(pieces) / sizeof(pieces[0]))], file);
+    return;
+  }
+
+  // Around the vector width, the large values and the longest key, rarely
+  // around the longest value
+  static const size_t lengths[] = {15,  16,  17,   31,   32,  33,
+                                   255, 256, 1022, 1023, 1024};
+  size_t len = lengths[random_below(sizeof(lengths) / sizeof(lengths[0]))];
+  if (random_below(256) == 0) {
+    len = MAX_VALUE_SIZE - 1 + random_below(3);
+  }
+  if (kind == 3) {
+    fprintf(file, "$%zu:", len);
+  }
+  // Now and then a delimiter, which a prefixed string may hold
+  size_t stray = random_below(4) == 0 ? random_below(len + 1) : len;
+  for (size_t i = 0; i < len; i++) {
+    fputc(i == stray ? ",)] "[random_below(4)] : 'a' + (int)random_below(26),
+          file);
+  }
+}
+
+// Writes a job of random commands, some of them broken.
+// @return 0 if successful, 1 otherwise.
+static int fuzz_job(const char *path, size_t lines) {
+  static const char *const names[] = {"WRITE", "READ",  "DELETE", "CAS",
+                                      "INCR",  "APPEND", "SCAN",  "WRITETTL"};
+  static const char *const ends[] = {"]", "]", "]", "", ")", "]x", "]]"};
+  FILE *file = fopen(path, "w");
+  if (file == NULL) {
+    return 1;
+  }
+  for (size_t line = 0; line < lines; line++) {
+    size_t name = random_below(sizeof(names) / sizeof(names[0]));
+    fprintf(file, "%s ", names[name]);
+    if (name == 7) {
+      fprintf(file, "%zu ", random_below(1000));
+    }
+    fputc('[', file);
+    size_t count = 1 + random_below(6);
+    for (size_t i = 0; i < count; i++) {
+      if (name == 1 || name == 2 || name == 6) {
+        fuzz_string(file);
+        fputc(i + 1 < count ? ',' : ']', file);
+        continue;
+      }
+      fputc('(', file);
+      size_t width = name == 3 ? 3 : 2;
+      for (size_t j = 0; j < width; j++) {
+        fuzz_string(file);
+        if (j + 1 < width) {
+          fputc(',', file);
+        }
+      }
+      fputs(random_below(16) == 0 ? "," : ")", file);
+    }
+    fputs(ends[random_below(sizeof(ends) / sizeof(ends[0]))], file);
+    // The last line may end the job without a newline
+    if (line + 1 < lines || random_below(2) == 0) {
+      fputc('\n', file);
+    }
+  }
+  return fclose(file) != 0;
+}
+
+// Parses the next command of a job, as run_job does.
+static Parsed parse_next(JobReader *reader, Args *args) {
+  Parsed parsed = {get_next(reader), 0, 0, 0, 0};
+  args_clear(args);
+  switch (parsed.command) {
+  case CMD_WRITE:
+  case CMD_INCR:
+  case CMD_APPEND:
+    parsed.result = (long)parse_write(reader, args, MAX_WRITE_SIZE);
+    parsed.num_keys = parsed.num_values = (size_t)parsed.result;
+    break;
+  case CMD_WRITE_TTL:
+    parsed.result = parse_ttl(reader, &parsed.delay);
+    if (parsed.result == 0) {
+      parsed.result = (long)parse_write(reader, args, MAX_WRITE_SIZE);
+      parsed.num_keys = parsed.num_values = (size_t)parsed.result;
+    }
+    break;
+  case CMD_CAS:
+    parsed.result = (long)parse_cas(reader, args, MAX_WRITE_SIZE / 2);
+    parsed.num_keys = (size_t)parsed.result;
+    parsed.num_values = 2 * parsed.num_keys;
+    break;
+  case CMD_READ:
+  case CMD_DELETE:
+  case CMD_SCAN:
+    parsed.result = (long)parse_read_delete(reader, args, MAX_WRITE_SIZE);
+    parsed.num_keys = (size_t)parsed.result;
+    break;
+  case CMD_WAIT:
+    parsed.result = parse_wait(reader, &parsed.delay, NULL);
+    break;
+  case CMD_SHOW:
+  case CMD_STATS:
+  case CMD_BACKUP:
+  case CMD_HELP:
+  case CMD_EMPTY:
+  case CMD_INVALID:
+  case EOC:
+    break;
+  }
+  return parsed;
+}
+
+// Compares the commands parsed from both readers.
+// @return 0 if they are the same, 1 otherwise.
+static int compare(const Parsed *a, const Args *args_a, const Parsed *b,
+                   const Args *args_b) {
+  if (a->command != b->command || a->result != b->result ||
+      a->num_keys != b->num_keys || a->num_values != b->num_values ||
+      a->delay != b->delay) {
+    return 1;
+  }
+  for (size_t i = 0; i < a->num_keys; i++) {
+    if (strcmp(args_a->keys[i], args_b->keys[i]) != 0) {
+      return 1;
+    }
+  }
+  for (size_t i = 0; i < a->num_values; i++) {
+    const Value *x = &args_a->values[i], *y = &args_b->values[i];
+    if (x->len != y->len || memcmp(x->data, y->data, x->len) != 0 ||
+        (x->blob == NULL) != (y->blob == NULL)) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+// Parses a job mapped and through a pipe, command by command.
+// @return 0 if both were parsed the same, 1 otherwise.
+static int check_job(const char *path, Args *mapped_args, Args *piped_args,
+                     size_t *commands) {
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) {
+    perror(path);
+    return 1;
+  }
+  Feeder feeder;
+  int piped_fd = feeder_start(&feeder, path);
+  if (piped_fd < 0) {
+    close(fd);
+    return 1;
+  }
+
+  JobReader mapped, piped;
+  int failed = 1;
+  if (reader_init(&mapped, fd) == 0) {
+    if (reader_init(&piped, piped_fd) == 0) {
+      failed = 0;
+      size_t command = 1;
+      while (!failed) {
+        Parsed a = parse_next(&mapped, mapped_args);
+        Parsed b = parse_next(&piped, piped_args);
+        if (compare(&a, mapped_args, &b, piped_args) != 0) {
+          fprintf(stderr, "%s: command %zu parsed differently\n", path,
+                  command);
+          failed = 1;
+        } else if (a.command == EOC) {
+          break;
+        }
+        command++;
+        (*commands)++;
+      }
+      reader_destroy(&piped);
+    }
+    reader_destroy(&mapped);
+  }
+  close(fd);
+  // Lets the feeder finish if the parse stopped early (SIGPIPE is ignored)
+  close(piped_fd);
+  feeder_join(&feeder);
+  return failed;
+}
+
+int main(int argc, char *argv[]) {
+  size_t jobs = 200, lines = 500;
+  rng_state = 0x9E3779B97F4A7C15u;
+  signal(SIGPIPE, SIG_IGN);
+  int opt;
+  while ((opt = getopt(argc, argv, "n:l:s:")) != -1) {
+    switch (opt) {
+    case 'n':
+      jobs = (size_t)atol(optarg);
+      break;
+    case 'l':
+      lines = (size_t)atol(optarg);
+      break;
+    case 's':
+      rng_state = (uint64_t)atoll(optarg) * 0x9E3779B97F4A7C15u + 1;
+      break;
+    default:
+      fprintf(stderr, "Usage: %s [-n jobs] [-l lines] [-s seed] [job...]\n",
+              argv[0]);
+      return 1;
+    }
+  }
+
+  Args mapped_args, piped_args;
+  if (args_init(&mapped_args) != 0) {
+    fprintf(stderr, "Failed to allocate the arguments\n");
+    return 1;
+  }
+  if (args_init(&piped_args) != 0) {
+    fprintf(stderr, "Failed to allocate the arguments\n");
+    args_destroy(&mapped_args);
+    return 1;
+  }
+
+  int failed = 0;
+  size_t commands = 0, checked = 0;
+  if (optind < argc) {
+    for (int i = optind; i < argc; i++, checked++) {
+      failed |= check_job(argv[i], &mapped_args, &piped_args, &commands);
+    }
+  } else {
+    char directory[] = BENCH_DIRECTORY;
+    if (bench_directory_create(directory) != 0) {
+      args_destroy(&mapped_args);
+      args_destroy(&piped_args);
+      return 1;
+    }
+    char path[sizeof(directory) + 16];
+    snprintf(path, sizeof(path), "%s/fuzz.job", directory);
+    for (; checked < jobs && !failed; checked++) {
+      if (fuzz_job(path, lines) != 0) {
+        fprintf(stderr, "Failed to write the job\n");
+        failed = 1;
+        break;
+      }
+      failed = check_job(path, &mapped_args, &piped_args, &commands);
+    }
+    // A job that failed is kept, to look at
+    if (!failed) {
+      bench_directory_remove(directory);
+    }
+  }
+
+  printf("%zu jobs, %zu commands: %s\n", checked, commands,
+         failed ? "DIFFERENT" : "same");
+  args_destroy(&mapped_args);
+  args_destroy(&piped_args);
+  return failed;
+}
@@ -0,0 +1,158 @@
+// Measures the throughput of large values: how fast a job thread writes
+// values of a size through kvs_write, then reads them all back through
+// kvs_read, in batches like those of a job. The default sizes are all
+// larger than LARGE_VALUE_SIZE, so the table keeps them out of line in blobs,
+// and the reads format them into /dev/null the way a job writes its .out
+// file. Each
+// size is run a few rounds and the best one is kept, as the others were
+// slowed down by noise.
+//
+// Usage: value_bench [-v value_size] [-n num_pairs] [-b batch_size]
+//                    [-r rounds]
+//
+// Without -v, it runs 1 KB, 4 KB, 16 KB and 64 KB values. Without -n, each
+// size writes 256 MB of values.
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "common.h"
+#include "src/server/operations.h"
+
+// Bytes of values written by each size when the number of pairs is not given
+#define DEFAULT_BYTES (256 * 1024 * 1024)
+
+// Writes, then reads, num_pairs keys of their own in batches.
+// @param times Set to the milliseconds the writes and the reads took.
+// @return 0 if successful, 1 otherwise.
+static int run_round(size_t num_pairs, size_t batch_size, const char *value,
+                     size_t value_size, int out_fd, double times[2]) {
+  char key_data[MAX_WRITE_SIZE][32];
+  char *keys[MAX_WRITE_SIZE];
+  Value values[MAX_WRITE_SIZE];
+  for (int mode = 0; mode < 2; mode++) {
+    double start = now_ms();
+    for (size_t i = 0; i < num_pairs; i += batch_size) {
+      size_t count = num_pairs - i < batch_size ? num_pairs - i : batch_size;
+      for (size_t j = 0; j < count; j++) {
+        snprintf(key_data[j], sizeof(key_data[j]), "key%zu", i + j);
+        keys[j] = key_data[j];
+        values[j] = (Value){value, value_size, NULL};
+      }
+      int failed = mode == 0 ? kvs_write(count, keys, values, 0, -1)
+                             : kvs_read(count, keys, out_fd);
+      if (failed) {
+        fprintf(stderr, "Failed to %s pair\n", mode == 0 ? "write" : "read");
+        return 1;
+      }
+    }
+    times[mode] = now_ms() - start;
+  }
+  return 0;
+}
+
+// Runs the rounds of a value size and prints the best of each mode.
+// @return 0 if successful, 1 otherwise.
+static int run_size(size_t value_size, size_t num_pairs, size_t batch_size,
+                    size_t rounds, size_t num_shards, int out_fd) {
+  if (num_pairs == 0) {
+    num_pairs = DEFAULT_BYTES / value_size;
+  }
+  char *value = malloc(value_size);
+  if (value == NULL) {
+    return 1;
+  }
+  memset(value, 'v', value_size);
+
+  double best[2] = {0, 0};
+  for (size_t round = 0; round < rounds; round++) {
+    if (kvs_init(num_shards, 0, 0, 1, 0) == NULL) {
+      fprintf(stderr, "Failed to initialize KVS\n");
+      free(value);
+      return 1;
+    }
+    double times[2];
+    int failed = run_round(num_pairs, batch_size, value, value_size, out_fd,
+                           times);
+    kvs_terminate();
+    if (failed) {
+      free(value);
+      return 1;
+    }
+    for (int mode = 0; mode < 2; mode++) {
+      if (round == 0 || times[mode] < best[mode]) {
+        best[mode] = times[mode];
+      }
+    }
+  }
+  free(value);
+
+  const char *modes[] = {"write", "read"};
+  for (int mode = 0; mode < 2; mode++) {
+    double seconds = best[mode] / 1000.0;
+    printf("%6zu B %-5s %10.0f pairs/s %8.0f MB/s\n", value_size,
+           modes[mode], (double)num_pairs / seconds,
+           (double)(num_pairs * value_size) / seconds / (1024.0 * 1024.0));
+  }
+  return 0;
+}
+
+int main(int argc, char *argv[]) {
+  size_t value_size = 0, num_pairs = 0, batch_size = 8, rounds = 3;
+  int opt;
+  while ((opt = getopt(argc, argv, "v:n:b:r:")) != -1) {
+    switch (opt) {
+    case 'v':
+      value_size = (size_t)atol(optarg);
+      break;
+    case 'n':
+      num_pairs = (size_t)atol(optarg);
+      break;
+    case 'b':
+      batch_size = (size_t)atol(optarg);
+      break;
+    case 'r':
+      rounds = (size_t)atol(optarg);
+      break;
+    default:
+      fprintf(stderr,
+              "Usage: %s [-v value_size] [-n num_pairs] [-b batch_size] "
+              "[-r rounds]\n",
+              argv[0]);
+      return 1;
+    }
+  }
+  if (value_size > MAX_VALUE_SIZE || batch_size == 0 ||
+      batch_size > MAX_WRITE_SIZE || rounds == 0) {
+    fprintf(stderr, "Invalid arguments\n");
+    return 1;
+  }
+
+  int out_fd = open("/dev/null", O_WRONLY);
+  if (out_fd < 0) {
+    perror("Failed to open /dev/null");
+    return 1;
+  }
+
+  long num_cores = sysconf(_SC_NPROCESSORS_ONLN);
+  size_t num_shards = (size_t)(num_cores > 0 ? num_cores : 1) * SHARDS_PER_CORE;
+  printf("batches of %zu pairs\n", batch_size);
+
+  const size_t sizes[] = {1024, 4 * 1024, 16 * 1024, MAX_VALUE_SIZE};
+  int failed = 0;
+  if (value_size != 0) {
+    failed = run_size(value_size, num_pairs, batch_size, rounds, num_shards,
+                      out_fd);
+  }
+  for (size_t i = 0; i < 4 && value_size == 0 && !failed; i++) {
+    failed = run_size(sizes[i], num_pairs, batch_size, rounds, num_shards,
+                      out_fd);
+  }
+
+  close(out_fd);
+  return failed;
+}
@@ -0,0 +1,168 @@
+// Measures what the write-ahead log costs: the throughput of WRITE batches
+// run by concurrent threads (like the job threads of the server) with the
+// table only in memory, and with each sync policy of the log, and for each
+// policy its overhead over the in-memory throughput. Each mode is run a few
+// rounds and the best one is kept, as the others were slowed down by noise.
+//
+// Usage: wal_bench [-t threads] [-n batches] [-b batch_size] [-v value_size]
+//                  [-y sync_interval_ms] [-r rounds]
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "common.h"
+#include "src/server/operations.h"
+
+typedef struct Writer {
+  pthread_t thread;
+  size_t id;
+  size_t num_batches;
+  size_t batch_size;
+  const char *value;
+  size_t value_size;
+} Writer;
+
+// Writes num_batches batches of keys of its own.
+static void *run_writer(void *arg) {
+  Writer *writer = arg;
+  char key_data[MAX_WRITE_SIZE][32];
+  char *keys[MAX_WRITE_SIZE];
+  Value values[MAX_WRITE_SIZE];
+  for (size_t i = 0; i < writer->num_batches; i++) {
+    for (size_t j = 0; j < writer->batch_size; j++) {
+      snprintf(key_data[j], sizeof(key_data[j]), "t%zu-%zu", writer->id,
+               (i * writer->batch_size + j) % 100000);
+      keys[j] = key_data[j];
+      values[j] = (Value){writer->value, writer->value_size, NULL};
+    }
+    if (kvs_write(writer->batch_size, keys, values, 0, -1) != 0) {
+      fprintf(stderr, "Failed to write pair\n");
+      break;
+    }
+  }
+  return NULL;
+}
+
+// Runs the writers once.
+// @return Pairs written per second, 0 on failure.
+static double run_writers(Writer *writers, size_t num_threads) {
+  double start = now_ms();
+  for (size_t i = 0; i < num_threads; i++) {
+    if (pthread_create(&writers[i].thread, NULL, run_writer, &writers[i]) !=
+        0) {
+      fprintf(stderr, "Failed to create writer thread\n");
+      return 0;
+    }
+  }
+  for (size_t i = 0; i < num_threads; i++) {
+    pthread_join(writers[i].thread, NULL);
+  }
+  double elapsed = now_ms() - start;
+  size_t pairs = num_threads * writers[0].num_batches * writers[0].batch_size;
+  return (double)pairs / elapsed * 1000.0;
+}
+
+int main(int argc, char *argv[]) {
+  size_t num_threads = 4, num_batches = 20000, batch_size = 8;
+  size_t value_size = 32;
+  unsigned int interval_ms = WAL_INTERVAL_MS;
+  size_t rounds = 3;
+  int opt;
+  while ((opt = getopt(argc, argv, "t:n:b:v:y:r:")) != -1) {
+    switch (opt) {
+    case 't':
+      num_threads = (size_t)atol(optarg);
+      break;
+    case 'n':
+      num_batches = (size_t)atol(optarg);
+      break;
+    case 'b':
+      batch_size = (size_t)atol(optarg);
+      break;
+    case 'v':
+      value_size = (size_t)atol(optarg);
+      break;
+    case 'y':
+      interval_ms = (unsigned int)atoi(optarg);
+      break;
+    case 'r':
+      rounds = (size_t)atol(optarg);
+      break;
+    default:
+      fprintf(stderr,
+              "Usage: %s [-t threads] [-n batches] [-b batch_size] "
+              "[-v value_size] [-y sync_interval_ms] [-r rounds]\n",
+              argv[0]);
+      return 1;
+    }
+  }
+  if (num_threads == 0 || num_batches == 0 || batch_size == 0 ||
+      batch_size > MAX_WRITE_SIZE || value_size > MAX_VALUE_SIZE ||
+      interval_ms == 0 || rounds == 0) {
+    fprintf(stderr, "Invalid arguments\n");
+    return 1;
+  }
+
+  char directory[] = BENCH_DIRECTORY;
+  if (bench_directory_create(directory) != 0) {
+    return 1;
+  }
+  char log_path[sizeof(directory) + 16];
+  snprintf(log_path, sizeof(log_path), "%s/bench.log", directory);
+
+  char *value = malloc(value_size + 1);
+  Writer *writers = malloc(num_threads * sizeof(Writer));
+  if (value == NULL || writers == NULL) {
+    return 1;
+  }
+  memset(value, 'v', value_size);
+  value[value_size] = '\0';
+  for (size_t i = 0; i < num_threads; i++) {
+    writers[i] = (Writer){0, i, num_batches, batch_size, value, value_size};
+  }
+
+  long num_cores = sysconf(_SC_NPROCESSORS_ONLN);
+  size_t num_shards = (size_t)(num_cores > 0 ? num_cores : 1) * SHARDS_PER_CORE;
+  printf("%zu threads, %zu batches of %zu pairs of %zu bytes each\n",
+         num_threads, num_batches, batch_size, value_size);
+
+  // The first mode has no log, the baseline of the others
+  const char *modes[] = {"memory", "none", "periodic", "always"};
+  const WalSync syncs[] = {WAL_SYNC_NONE, WAL_SYNC_NONE, WAL_SYNC_PERIODIC,
+                           WAL_SYNC_ALWAYS};
+  double baseline = 0;
+  for (size_t mode = 0; mode < 4; mode++) {
+    double rate = 0;
+    for (size_t round = 0; round < rounds; round++) {
+      unlink(log_path);
+      if (kvs_init(num_shards, 0, 0, 1, 0) == NULL ||
+          (mode > 0 &&
+           kvs_open_log(log_path, syncs[mode], interval_ms) != 0)) {
+        fprintf(stderr, "Failed to initialize KVS\n");
+        return 1;
+      }
+      double round_rate = run_writers(writers, num_threads);
+      kvs_terminate();
+      if (round_rate > rate) {
+        rate = round_rate;
+      }
+    }
+
+    if (mode == 0) {
+      baseline = rate;
+      printf("%-8s %12.0f pairs/s\n", modes[mode], rate);
+    } else {
+      printf("%-8s %12.0f pairs/s  overhead %6.1f%%\n", modes[mode], rate,
+             (baseline - rate) / baseline * 100.0);
+    }
+  }
+
+  bench_directory_remove(directory);
+  free(writers);
+  free(value);
+  return 0;
+}
@@ -8,6 +8,7 @@
 #include <unistd.h>
 #include <sys/stat.h> 
 #include <errno.h>
+#include <stdint.h>
 
 // Variáveis globais para os caminhos dos pipes
 static char req_pipe_path[MAX_PIPE_PATH_LENGTH];
@@ -146,16 +147,36 @@ int kvs_disconnect(void) {
     return response[1];
 }
 
+// Formata um pedido sobre uma chave: o op code, o tamanho da chave (um
+// uint32_t) e os seus bytes.
+// @return Tamanho do pedido, 0 se a chave tiver mais de MAX_KEY_SIZE - 1
+// bytes (não é cortada, seria outra chave).
+static size_t key_request(char *msg, char op_code, const char *key) {
+    size_t key_len = strnlen(key, MAX_KEY_SIZE);
+    if (key_len == MAX_KEY_SIZE) {
+        fprintf(stderr, "Key longer than %d bytes\n", MAX_KEY_SIZE - 1);
+        return 0;
+    }
+    uint32_t len = (uint32_t)key_len;
+    msg[0] = op_code;
+    memcpy(msg + 1, &len, sizeof(len));
+    memcpy(msg + 1 + sizeof(len), key, len);
+    return 1 + sizeof(len) + len;
+}
+
 int kvs_subscribe(const char *key) {
+    char msg[1 + sizeof(uint32_t) + MAX_KEY_SIZE];
+    size_t msg_len = key_request(msg, OP_CODE_SUBSCRIBE, key);
+    if (msg_len == 0) {
+        return 1;
+    }
+
     int req_fd = open(req_pipe_path, O_WRONLY);
     if (req_fd == -1) {
         perror("open req_pipe");
         return 1;
     }
-
-    char msg[42];
-    snprintf(msg, sizeof(msg), "%c%-40s", OP_CODE_SUBSCRIBE, key); // Preencher com espaços se necessário
-    if (write(req_fd, msg, sizeof(msg)) == -1) {
+    if (write(req_fd, msg, msg_len) == -1) {
         perror("write req_pipe");
         close(req_fd);
         return 1;
@@ -183,15 +204,18 @@ int kvs_subscribe(const char *key) {
 }
 
 int kvs_unsubscribe(const char *key) {
+    char msg[1 + sizeof(uint32_t) + MAX_KEY_SIZE];
+    size_t msg_len = key_request(msg, OP_CODE_UNSUBSCRIBE, key);
+    if (msg_len == 0) {
+        return 1;
+    }
+
     int req_fd = open(req_pipe_path, O_WRONLY);
     if (req_fd == -1) {
         perror("open req_pipe");
         return 1;
     }
-
-    char msg[42];
-    snprintf(msg, sizeof(msg), "%c%-40s", OP_CODE_UNSUBSCRIBE, key); // Preencher com espaços se necessário
-    if (write(req_fd, msg, sizeof(msg)) == -1) {
+    if (write(req_fd, msg, msg_len) == -1) {
         perror("write req_pipe");
         close(req_fd);
         return 1;
@@ -13,13 +13,15 @@
 // Função para ler notificações do servidor
 void *notification_handler(void *arg) {
     int notif_pipe = *(int *)arg;
-    char buffer[MAX_STRING_SIZE * 2 + 3]; // Para armazenar (key,value) ou (key,DELETED)
+    // Notificações (key,value) ou (key,DELETED), lidas aos bocados: os
+    // valores podem ser grandes e ter qualquer byte
+    char buffer[4096];
 
     while (1) {
-        ssize_t bytes_read = read(notif_pipe, buffer, sizeof(buffer) - 1);
+        ssize_t bytes_read = read(notif_pipe, buffer, sizeof(buffer));
         if (bytes_read > 0) {
-            buffer[bytes_read] = '\0';
-            printf("%s", buffer);
+            fwrite(buffer, 1, (size_t)bytes_read, stdout);
+            fflush(stdout);
         }
     }
 
@@ -37,7 +39,7 @@ int main(int argc, char *argv[]) {
     char resp_pipe_path[256] = "/tmp/resp";
     char notif_pipe_path[256] = "/tmp/notif";
 
-    char keys[MAX_NUMBER_SUB][MAX_STRING_SIZE] = {0};
+    char keys[MAX_NUMBER_SUB][MAX_KEY_SIZE] = {0};
     unsigned int delay_ms;
     size_t num;
 
@@ -69,7 +71,7 @@ int main(int argc, char *argv[]) {
             return 0;
 
         case CMD_SUBSCRIBE:
-            num = parse_list(STDIN_FILENO, keys, 1, MAX_STRING_SIZE);
+            num = parse_list(STDIN_FILENO, keys, 1, MAX_KEY_SIZE - 1);
             if (num == 0) {
                 fprintf(stderr, "Invalid command. See HELP for usage\n");
                 continue;
@@ -82,7 +84,7 @@ int main(int argc, char *argv[]) {
             break;
 
         case CMD_UNSUBSCRIBE:
-            num = parse_list(STDIN_FILENO, keys, 1, MAX_STRING_SIZE);
+            num = parse_list(STDIN_FILENO, keys, 1, MAX_KEY_SIZE - 1);
             if (num == 0) {
                 fprintf(stderr, "Invalid command. See HELP for usage\n");
                 continue;
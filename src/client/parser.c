@@ -7,8 +7,65 @@
 
 #include "src/common/constants.h"
 
+// Maps a delimiter to the value read_string returns for it.
+static int delimiter(char ch) {
+  switch (ch) {
+  case ',':
+    return 0;
+  case ')':
+    return 1;
+  case ']':
+    return 2;
+  default:
+    return -1;
+  }
+}
+
+// Reads a string with a "$<length>:" prefix, after its '$', as the server
+// parser does: its bytes are taken as they are, delimiters included.
+// @param fd File to read from.
+// @param buffer To write the string in, null terminated.
+// @param max Maximum string size.
+static int read_prefixed(int fd, char *buffer, size_t max) {
+  char ch;
+  size_t len = 0;
+  size_t digits = 0;
+  while (1) {
+    if (read(fd, &ch, 1) != 1) {
+      return -1;
+    }
+    if (ch == ':' && digits > 0) {
+      break;
+    }
+    if (ch < '0' || ch > '9') {
+      return -1;
+    }
+    len = len * 10 + (size_t)(ch - '0');
+    if (len > max) {
+      return -1;
+    }
+    digits++;
+  }
+
+  size_t done = 0;
+  while (done < len) {
+    ssize_t bytes_read = read(fd, buffer + done, len - done);
+    if (bytes_read <= 0) {
+      return -1;
+    }
+    done += (size_t)bytes_read;
+  }
+  // Keys are null terminated strings
+  if (memchr(buffer, '\0', len) != NULL || read(fd, &ch, 1) != 1) {
+    return -1;
+  }
+  buffer[len] = '\0';
+  return delimiter(ch);
+}
+
 // Reads a string and indicates the position from where it was
-// extracted, based on the KVS specification.
+// extracted, based on the KVS specification. The string is either ended by
+// a delimiter or length prefixed.
 // @param fd File to read from.
 // @param buffer To write the string in.
 // @param max Maximum string size.
@@ -18,28 +75,30 @@ static int read_string(int fd, char *buffer, size_t max) {
   size_t i = 0;
   int value = -1;
 
-  while (i < max) {
+  while (1) {
     bytes_read = read(fd, &ch, 1);
 
     if (bytes_read <= 0) {
       return -1;
     }
 
+    if (ch == '$' && i == 0) {
+      return read_prefixed(fd, buffer, max);
+    }
+
     if (ch == ' ') {
       return -1;
     }
 
-    if (ch == ',') {
-      value = 0;
-      break;
-    } else if (ch == ')') {
-      value = 1;
-      break;
-    } else if (ch == ']') {
-      value = 2;
+    if ((value = delimiter(ch)) >= 0) {
       break;
     }
 
+    // A string of max bytes is followed by its delimiter, a longer one is
+    // invalid
+    if (i == max) {
+      return -1;
+    }
     buffer[i++] = ch;
   }
 
@@ -143,7 +202,7 @@ enum Command get_next(int fd) {
   }
 }
 
-size_t parse_list(int fd, char keys[][MAX_STRING_SIZE], size_t max_keys,
+size_t parse_list(int fd, char keys[][MAX_KEY_SIZE], size_t max_keys,
                   size_t max_string_size) {
   char ch;
 
@@ -154,7 +213,7 @@ size_t parse_list(int fd, char keys[][MAX_STRING_SIZE], size_t max_keys,
 
   size_t num_keys = 0;
   int output = 2;
-  char key[max_string_size];
+  char key[max_string_size + 1];
   while (num_keys < max_keys) {
     output = read_string(fd, key, max_string_size);
     if (output < 0 || output == 1) {
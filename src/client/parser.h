@@ -21,14 +21,15 @@ enum Command {
 // @return enum Command Command code.
 enum Command get_next(int fd);
 
-// Parses a list of strings
+// Parses a list of strings. A string with a delimiter or a space is given
+// with a "$<length>:" prefix, as in the jobs of the server.
 // @param fd File descriptor to read from.
 // @param keys Array to store the keys
 // @param max_pairs Maximum number of pairs it will write.
 // @param max_string_size Maximum string size allowed.
 // @return 0 if the command was not parsed successfully, otherwise return the
 //          of keys parsed
-size_t parse_list(int fd, char keys[][MAX_STRING_SIZE], size_t max_keys,
+size_t parse_list(int fd, char keys[][MAX_KEY_SIZE], size_t max_keys,
                   size_t max_string_size);
 
 // Parses a DELAY command.
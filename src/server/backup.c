@@ -0,0 +1,181 @@
+#include "backup.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+// Microseconds from one time to another.
+static uint64_t elapsed_us(const struct timespec *from,
+                           const struct timespec *to) {
+  return (uint64_t)((to->tv_sec - from->tv_sec) * 1000000LL +
+                    (to->tv_nsec - from->tv_nsec) / 1000);
+}
+
+static void *backup_thread(void *arg) {
+  BackupPool *pool = arg;
+
+  pthread_mutex_lock(&pool->lock);
+  while (1) {
+    if (pool->head != NULL) {
+      BackupTask *task = pool->head;
+      pool->head = task->next;
+      if (pool->head == NULL) {
+        pool->tail = NULL;
+      }
+      pool->stats.queued--;
+      pool->stats.running++;
+      pthread_cond_signal(&pool->room);
+
+      struct timespec start, end;
+      clock_gettime(CLOCK_MONOTONIC, &start);
+      pthread_mutex_unlock(&pool->lock);
+      int failed = task->run(task->arg);
+      clock_gettime(CLOCK_MONOTONIC, &end);
+      pthread_mutex_lock(&pool->lock);
+
+      uint64_t wait_us = elapsed_us(&task->submitted, &start);
+      uint64_t run_us = elapsed_us(&start, &end);
+      BackupStats *stats = &pool->stats;
+      stats->running--;
+      stats->completed++;
+      stats->failed += failed != 0;
+      stats->wait_us += wait_us;
+      stats->run_us += run_us;
+      if (wait_us > stats->max_wait_us) {
+        stats->max_wait_us = wait_us;
+      }
+      if (run_us > stats->max_run_us) {
+        stats->max_run_us = run_us;
+      }
+      free(task);
+      pthread_cond_broadcast(&pool->idle);
+    } else if (pool->stop) {
+      break;
+    } else {
+      pthread_cond_wait(&pool->work, &pool->lock);
+    }
+  }
+  pthread_mutex_unlock(&pool->lock);
+
+  return NULL;
+}
+
+BackupPool *backup_pool_create(size_t num_threads) {
+  if (num_threads == 0) {
+    return NULL;
+  }
+  BackupPool *pool =
+      malloc(sizeof(BackupPool) + num_threads * sizeof(pthread_t));
+  if (pool == NULL) {
+    return NULL;
+  }
+
+  pthread_mutex_init(&pool->lock, NULL);
+  pthread_cond_init(&pool->work, NULL);
+  pthread_cond_init(&pool->idle, NULL);
+  pthread_cond_init(&pool->room, NULL);
+  pool->head = NULL;
+  pool->tail = NULL;
+  pool->stats = (BackupStats){0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0};
+  pool->stop = 0;
+
+  for (pool->num_threads = 0; pool->num_threads < num_threads;
+       pool->num_threads++) {
+    if (pthread_create(&pool->threads[pool->num_threads], NULL,
+                       backup_thread, pool) != 0) {
+      fprintf(stderr, "Failed to create backup thread\n");
+      backup_pool_destroy(pool);
+      return NULL;
+    }
+  }
+
+  return pool;
+}
+
+BackupTask *backup_reserve(BackupPool *pool) {
+  BackupTask *task = malloc(sizeof(BackupTask));
+  if (task == NULL) {
+    return NULL;
+  }
+
+  pthread_mutex_lock(&pool->lock);
+  // The tasks reserved count as queued, their snapshots are being taken
+  if (pool->stats.queued >= pool->num_threads) {
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    while (pool->stats.queued >= pool->num_threads) {
+      pthread_cond_wait(&pool->room, &pool->lock);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    uint64_t throttle_us = elapsed_us(&start, &end);
+    BackupStats *stats = &pool->stats;
+    stats->throttled++;
+    stats->throttle_us += throttle_us;
+    if (throttle_us > stats->max_throttle_us) {
+      stats->max_throttle_us = throttle_us;
+    }
+  }
+  pool->stats.queued++;
+  pthread_mutex_unlock(&pool->lock);
+  return task;
+}
+
+void backup_submit(BackupPool *pool, BackupTask *task, int (*run)(void *arg),
+                   void *arg) {
+  task->run = run;
+  task->arg = arg;
+  task->next = NULL;
+  clock_gettime(CLOCK_MONOTONIC, &task->submitted);
+
+  pthread_mutex_lock(&pool->lock);
+  if (pool->tail != NULL) {
+    pool->tail->next = task;
+  } else {
+    pool->head = task;
+  }
+  pool->tail = task;
+  pthread_cond_signal(&pool->work);
+  pthread_mutex_unlock(&pool->lock);
+}
+
+void backup_cancel(BackupPool *pool, BackupTask *task) {
+  pthread_mutex_lock(&pool->lock);
+  pool->stats.queued--;
+  pthread_cond_signal(&pool->room);
+  // Whoever waits for the queue to empty may be waiting for this task
+  pthread_cond_broadcast(&pool->idle);
+  pthread_mutex_unlock(&pool->lock);
+  free(task);
+}
+
+void backup_wait(BackupPool *pool) {
+  pthread_mutex_lock(&pool->lock);
+  while (pool->stats.queued > 0 || pool->stats.running > 0) {
+    pthread_cond_wait(&pool->idle, &pool->lock);
+  }
+  pthread_mutex_unlock(&pool->lock);
+}
+
+void backup_stats(BackupPool *pool, BackupStats *stats) {
+  pthread_mutex_lock(&pool->lock);
+  *stats = pool->stats;
+  pthread_mutex_unlock(&pool->lock);
+}
+
+void backup_pool_destroy(BackupPool *pool) {
+  pthread_mutex_lock(&pool->lock);
+  pool->stop = 1;
+  pthread_cond_broadcast(&pool->work);
+  pthread_mutex_unlock(&pool->lock);
+
+  // The threads only stop once the queue is empty
+  for (size_t i = 0; i < pool->num_threads; i++) {
+    pthread_join(pool->threads[i], NULL);
+  }
+
+  pthread_cond_destroy(&pool->work);
+  pthread_cond_destroy(&pool->idle);
+  pthread_cond_destroy(&pool->room);
+  pthread_mutex_destroy(&pool->lock);
+  free(pool);
+}
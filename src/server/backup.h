@@ -0,0 +1,90 @@
+#ifndef KVS_BACKUP_H
+#define KVS_BACKUP_H
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+// Threads that write backups in the background, so the job that asked for a
+// backup goes on as soon as its snapshot is taken. At most one backup per
+// thread is in progress, which is how the number of backups at once is
+// limited: a backup submitted while every thread is busy waits in the queue,
+// the job that submitted it does not. Each backup waiting keeps the versions
+// its snapshot sees, so the queue holds at most as many backups as there are
+// threads: a job asking for more waits for room before taking its snapshot.
+
+typedef struct BackupTask {
+  int (*run)(void *arg); // Returns 0 if the backup was written
+  void *arg;
+  struct timespec submitted;
+  struct BackupTask *next;
+} BackupTask;
+
+// Counters of the backups, for STATS
+typedef struct BackupStats {
+  size_t queued;     // Backups waiting for a thread
+  size_t running;    // Backups being written
+  size_t completed;  // Backups finished, written or not
+  size_t failed;     // Backups that could not be written
+  uint64_t wait_us;  // Total time the finished backups waited in the queue
+  uint64_t max_wait_us;
+  uint64_t run_us;   // Total time the finished backups took to be written
+  uint64_t max_run_us;
+  size_t throttled;  // Backups whose job waited for room in the queue
+  uint64_t throttle_us; // Total time the jobs waited for room
+  uint64_t max_throttle_us;
+} BackupStats;
+
+typedef struct BackupPool {
+  pthread_mutex_t lock;
+  pthread_cond_t work; // Signaled when a task is submitted
+  pthread_cond_t idle; // Signaled when a thread finishes a task
+  pthread_cond_t room; // Signaled when a thread claims a task
+  BackupTask *head;    // Tasks not claimed yet, oldest first
+  BackupTask *tail;
+  BackupStats stats;
+  int stop;
+  size_t num_threads;
+  pthread_t threads[];
+} BackupPool;
+
+/// Creates a pool of backup threads.
+/// @param num_threads Number of threads, the most backups written at once,
+/// at least 1.
+/// @return The pool, NULL on failure.
+BackupPool *backup_pool_create(size_t num_threads);
+
+/// Waits for room in the queue and reserves it, for a task to be submitted.
+/// @param pool The pool.
+/// @return The task, NULL on failure.
+BackupTask *backup_reserve(BackupPool *pool);
+
+/// Queues a task reserved by backup_reserve, to be run by a backup thread,
+/// without waiting for it.
+/// @param pool The pool.
+/// @param task The task reserved.
+/// @param run Function that does the backup, returns 0 if successful.
+/// @param arg Argument given to run.
+void backup_submit(BackupPool *pool, BackupTask *task, int (*run)(void *arg),
+                   void *arg);
+
+/// Gives back the room reserved for a task that will not be submitted.
+/// @param pool The pool.
+/// @param task The task reserved.
+void backup_cancel(BackupPool *pool, BackupTask *task);
+
+/// Waits for every task submitted to finish.
+/// @param pool The pool.
+void backup_wait(BackupPool *pool);
+
+/// Reads the counters of the backups.
+/// @param pool The pool.
+/// @param stats Set to the counters.
+void backup_stats(BackupPool *pool, BackupStats *stats);
+
+/// Waits for the tasks submitted, stops the threads and frees the pool.
+/// @param pool The pool.
+void backup_pool_destroy(BackupPool *pool);
+
+#endif // KVS_BACKUP_H
@@ -1,3 +1,7 @@
 #define MAX_WRITE_SIZE 256
 #define MAX_STRING_SIZE 40
 #define MAX_JOB_FILE_NAME_SIZE 256
+#define SHARDS_PER_CORE 4
+#define MAX_SHARDS 4096
+#define MAX_VALUE_SIZE (64 * 1024)
+#define NOTIFICATION_TIMEOUT_MS 100
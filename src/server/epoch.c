@@ -0,0 +1,224 @@
+#include "epoch.h"
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+// A thread tries to advance the epoch and free its retired memory every
+// EPOCH_COLLECT_INTERVAL retires.
+#define EPOCH_COLLECT_INTERVAL 64
+// Bit of EpochRecord.local set while the thread is inside a critical section
+#define EPOCH_ACTIVE ((uint64_t)1)
+
+typedef struct Retired {
+  void *ptr;
+  void (*destroy)(void *);
+  uint64_t epoch; // Global epoch when it was retired
+} Retired;
+
+typedef struct RetiredList {
+  Retired *items;
+  size_t count;
+  size_t capacity;
+} RetiredList;
+
+// Per thread state. Records are never freed, the record of a thread that
+// exits is reused by the next thread that registers.
+typedef struct EpochRecord {
+  // Epoch observed when entering the critical section (shifted left by one)
+  // with EPOCH_ACTIVE set, 0 while outside.
+  _Atomic uint64_t local;
+  _Atomic int in_use;
+  unsigned int nesting;
+  RetiredList retired;
+  struct EpochRecord *_Atomic next;
+} EpochRecord;
+
+static _Atomic uint64_t global_epoch = 1;
+static EpochRecord *_Atomic records = NULL;
+
+// Memory retired by threads that exited before it could be freed
+static RetiredList orphans = {NULL, 0, 0};
+static pthread_mutex_t orphans_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static pthread_key_t record_key;
+static pthread_once_t record_key_once = PTHREAD_ONCE_INIT;
+static _Thread_local EpochRecord *local_record = NULL;
+
+static int push_retired(RetiredList *list, Retired item) {
+  if (list->count == list->capacity) {
+    size_t capacity = list->capacity ? list->capacity * 2 : 64;
+    Retired *items = realloc(list->items, capacity * sizeof(Retired));
+    if (items == NULL) {
+      return 1;
+    }
+    list->items = items;
+    list->capacity = capacity;
+  }
+  list->items[list->count++] = item;
+  return 0;
+}
+
+// Frees the items retired at least two epochs before the current one, no
+// reader can still reference them.
+// @param sorted Whether the items are in the order they were retired, then
+// the scan stops at the first one too recent (a long critical section, like
+// a scan, may hold back thousands of them).
+static void free_retired(RetiredList *list, uint64_t epoch, int sorted) {
+  size_t kept = 0;
+  size_t i = 0;
+  for (; i < list->count; i++) {
+    Retired item = list->items[i];
+    if (item.epoch + 2 <= epoch) {
+      item.destroy(item.ptr);
+    } else if (sorted) {
+      break;
+    } else {
+      list->items[kept++] = item;
+    }
+  }
+  if (i < list->count) {
+    memmove(list->items + kept, list->items + i,
+            (list->count - i) * sizeof(Retired));
+  }
+  list->count = kept + list->count - i;
+}
+
+// Called when a thread exits, hands its retired memory to the orphan list
+// and frees the record for another thread.
+static void release_record(void *arg) {
+  EpochRecord *record = arg;
+
+  pthread_mutex_lock(&orphans_lock);
+  for (size_t i = 0; i < record->retired.count; i++) {
+    // On failure the memory leaks, which is safer than freeing it too soon
+    push_retired(&orphans, record->retired.items[i]);
+  }
+  pthread_mutex_unlock(&orphans_lock);
+  record->retired.count = 0;
+
+  atomic_store_explicit(&record->local, 0, memory_order_release);
+  atomic_store_explicit(&record->in_use, 0, memory_order_release);
+}
+
+static void create_record_key(void) {
+  pthread_key_create(&record_key, release_record);
+}
+
+static EpochRecord *get_record(void) {
+  if (local_record != NULL) {
+    return local_record;
+  }
+
+  pthread_once(&record_key_once, create_record_key);
+
+  // Reuse the record of a thread that already exited
+  EpochRecord *record = atomic_load_explicit(&records, memory_order_acquire);
+  for (; record != NULL; record = atomic_load(&record->next)) {
+    int expected = 0;
+    if (atomic_compare_exchange_strong(&record->in_use, &expected, 1)) {
+      break;
+    }
+  }
+
+  if (record == NULL) {
+    record = calloc(1, sizeof(EpochRecord));
+    if (record == NULL) {
+      abort();
+    }
+    atomic_init(&record->in_use, 1);
+    EpochRecord *head = atomic_load(&records);
+    do {
+      atomic_store(&record->next, head);
+    } while (!atomic_compare_exchange_weak(&records, &head, record));
+  }
+
+  pthread_setspecific(record_key, record);
+  local_record = record;
+  return record;
+}
+
+void epoch_enter(void) {
+  EpochRecord *record = get_record();
+  if (record->nesting++ > 0) {
+    return;
+  }
+
+  uint64_t epoch = atomic_load_explicit(&global_epoch, memory_order_relaxed);
+  atomic_store_explicit(&record->local, (epoch << 1) | EPOCH_ACTIVE,
+                        memory_order_relaxed);
+  // The announcement must be visible before any read of the table
+  atomic_thread_fence(memory_order_seq_cst);
+}
+
+void epoch_exit(void) {
+  EpochRecord *record = local_record;
+  if (--record->nesting > 0) {
+    return;
+  }
+  atomic_store_explicit(&record->local, 0, memory_order_release);
+}
+
+// Advances the global epoch if every thread inside a critical section has
+// already observed it.
+// @return The global epoch after the attempt.
+static uint64_t try_advance(void) {
+  atomic_thread_fence(memory_order_seq_cst);
+  uint64_t epoch = atomic_load_explicit(&global_epoch, memory_order_acquire);
+
+  EpochRecord *record = atomic_load_explicit(&records, memory_order_acquire);
+  for (; record != NULL; record = atomic_load(&record->next)) {
+    uint64_t local = atomic_load_explicit(&record->local, memory_order_acquire);
+    if ((local & EPOCH_ACTIVE) && (local >> 1) != epoch) {
+      return epoch;
+    }
+  }
+
+  if (atomic_compare_exchange_strong(&global_epoch, &epoch, epoch + 1)) {
+    return epoch + 1;
+  }
+  return epoch;
+}
+
+void epoch_retire(void *ptr, void (*destroy)(void *)) {
+  EpochRecord *record = get_record();
+  Retired item = {ptr, destroy,
+                  atomic_load_explicit(&global_epoch, memory_order_acquire)};
+
+  if (push_retired(&record->retired, item)) {
+    // Out of memory to defer it. Inside a critical section the epoch of the
+    // thread itself holds the global one back, so it could never be freed:
+    // it leaks, which is safer than freeing it too soon. Outside, the thread
+    // waits until it can be freed right away.
+    if (record->nesting > 0) {
+      return;
+    }
+    while (try_advance() < item.epoch + 2)
+      ;
+    destroy(ptr);
+    return;
+  }
+
+  if (record->retired.count % EPOCH_COLLECT_INTERVAL == 0) {
+    uint64_t epoch = try_advance();
+    free_retired(&record->retired, epoch, 1);
+
+    if (pthread_mutex_trylock(&orphans_lock) == 0) {
+      free_retired(&orphans, epoch, 0);
+      pthread_mutex_unlock(&orphans_lock);
+    }
+  }
+}
+
+void epoch_reclaim_all(void) {
+  pthread_mutex_lock(&orphans_lock);
+  free_retired(&orphans, UINT64_MAX, 0);
+  pthread_mutex_unlock(&orphans_lock);
+
+  EpochRecord *record = atomic_load_explicit(&records, memory_order_acquire);
+  for (; record != NULL; record = atomic_load(&record->next)) {
+    free_retired(&record->retired, UINT64_MAX, 1);
+  }
+}
@@ -0,0 +1,26 @@
+#ifndef KVS_EPOCH_H
+#define KVS_EPOCH_H
+
+// Epoch based memory reclamation. Readers that traverse the table without
+// locks do it inside a critical section (epoch_enter/epoch_exit); memory
+// unlinked by writers is retired and only freed once every reader that could
+// still hold a reference to it has left its critical section.
+
+/// Enters a read-side critical section. Critical sections may be nested.
+void epoch_enter(void);
+
+/// Leaves a read-side critical section.
+void epoch_exit(void);
+
+/// Retires memory that is no longer reachable by new readers. Without memory
+/// to defer it, it is freed once the readers are gone if the calling thread
+/// is outside a critical section, and leaked if it is inside one.
+/// @param ptr Memory to be reclaimed.
+/// @param destroy Function that frees ptr, called once it is safe to do so.
+void epoch_retire(void *ptr, void (*destroy)(void *));
+
+/// Frees all retired memory right away. Only safe when no thread is inside a
+/// critical section, e.g. when the table is being destroyed.
+void epoch_reclaim_all(void);
+
+#endif // KVS_EPOCH_H
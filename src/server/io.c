@@ -1,12 +1,12 @@
+#include "io.h"
+
 #include <limits.h>
 #include <stdio.h>
 #include <string.h>
 #include <unistd.h>
 
-void write_str(int fd, const char *str) {
-  size_t len = strlen(str);
-  const char *ptr = str;
-
+// Writes len bytes, retrying partial writes.
+static void write_bytes(int fd, const char *ptr, size_t len) {
   while (len > 0) {
     ssize_t written = write(fd, ptr, len);
 
@@ -20,6 +20,8 @@ void write_str(int fd, const char *str) {
   }
 }
 
+void write_str(int fd, const char *str) { write_bytes(fd, str, strlen(str)); }
+
 void write_uint(int fd, int value) {
   char buffer[16];
   size_t i = 16;
@@ -44,3 +46,116 @@ size_t strn_memcpy(char *dest, const char *src, size_t n) {
   memcpy(dest, src, bytes_to_copy);
   return bytes_to_copy;
 }
+
+// Checks if a string could be mistaken for something else by the parser:
+// it has a delimiter, or starts like a length prefix.
+static int needs_prefix(const char *str, size_t len) {
+  if (len > 0 && str[0] == '$') {
+    return 1;
+  }
+  for (size_t i = 0; i < len; i++) {
+    switch (str[i]) {
+    case ',':
+    case '(':
+    case ')':
+    case '[':
+    case ']':
+    case ' ':
+    case '\n':
+    case '\0':
+      return 1;
+    default:
+      break;
+    }
+  }
+  return 0;
+}
+
+// Formats the "$<length>:" prefix of a string.
+// @param buffer Buffer of at least 24 bytes.
+// @return Length of the prefix.
+static size_t format_prefix(char *buffer, size_t len) {
+  char digits[20];
+  size_t num_digits = 0;
+  do {
+    digits[num_digits++] = (char)('0' + len % 10);
+    len /= 10;
+  } while (len > 0);
+
+  size_t i = 0;
+  buffer[i++] = '$';
+  while (num_digits > 0) {
+    buffer[i++] = digits[--num_digits];
+  }
+  buffer[i++] = ':';
+  return i;
+}
+
+size_t encoded_size(const char *str, size_t len) {
+  char prefix[24];
+  return needs_prefix(str, len) ? format_prefix(prefix, len) + len : len;
+}
+
+size_t encode_str(char *dest, const char *str, size_t len) {
+  size_t prefix = needs_prefix(str, len) ? format_prefix(dest, len) : 0;
+  memcpy(dest + prefix, str, len);
+  return prefix + len;
+}
+
+// Output of the commands of each thread, see Output
+static _Thread_local char output_buffer[OUTPUT_BUFFER_SIZE];
+
+void output_begin(Output *out, int fd) {
+  out->fd = fd;
+  out->used = 0;
+  out->data = output_buffer;
+}
+
+void output_flush(Output *out) {
+  write_bytes(out->fd, out->data, out->used);
+  out->used = 0;
+}
+
+void output_bytes(Output *out, const char *str, size_t len) {
+  if (out->used + len > OUTPUT_BUFFER_SIZE) {
+    output_flush(out);
+    if (len > OUTPUT_BUFFER_SIZE) {
+      write_bytes(out->fd, str, len);
+      return;
+    }
+  }
+  memcpy(out->data + out->used, str, len);
+  out->used += len;
+}
+
+void output_str(Output *out, const char *str) {
+  output_bytes(out, str, strlen(str));
+}
+
+void output_encoded(Output *out, const char *str, size_t len) {
+  if (needs_prefix(str, len)) {
+    char prefix[24];
+    output_bytes(out, prefix, format_prefix(prefix, len));
+  }
+  output_bytes(out, str, len);
+}
+
+void output_uint(Output *out, uint64_t value) {
+  char digits[20];
+  size_t num_digits = sizeof(digits);
+  do {
+    digits[--num_digits] = (char)('0' + value % 10);
+    value /= 10;
+  } while (value > 0);
+  output_bytes(out, digits + num_digits, sizeof(digits) - num_digits);
+}
+
+void output_pair(Output *out, const char *key, const char *value, size_t len,
+                 const char *separator, const char *suffix) {
+  output_bytes(out, "(", 1);
+  output_encoded(out, key, strlen(key));
+  output_str(out, separator);
+  output_encoded(out, value, len);
+  output_bytes(out, ")", 1);
+  output_str(out, suffix);
+}
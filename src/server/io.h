@@ -1,6 +1,7 @@
 #ifndef KVS_IO_H
 #define KVS_IO_H
 
+#include <stdint.h>
 #include <unistd.h>
 
 /// Writes a string to the given file descriptor.
@@ -20,4 +21,76 @@ void write_uint(int fd, int value);
 /// @return Number of bytes copied
 size_t strn_memcpy(char *dest, const char *src, size_t n);
 
+/// Number of bytes a string takes once encoded for the output: as it is, or
+/// with a "$<length>:" prefix if it has a delimiter of the KVS specification
+/// (or starts with a '$'), the same way the parser reads it.
+/// @param str The string, may have any byte.
+/// @param len Length of the string.
+/// @return Number of bytes.
+size_t encoded_size(const char *str, size_t len);
+
+/// Copies a string encoded for the output (see encoded_size).
+/// @param dest Buffer of encoded_size(str, len) bytes.
+/// @param str The string, may have any byte.
+/// @param len Length of the string.
+/// @return Number of bytes written to dest.
+size_t encode_str(char *dest, const char *str, size_t len);
+
+// Size of the output buffer of each thread
+#define OUTPUT_BUFFER_SIZE (64 * 1024)
+
+// Output of a command, gathered in a buffer of the calling thread so a whole
+// response usually takes a single write, done once the locks are released.
+// The buffer is only written when it fills up or is flushed; pieces larger
+// than it are written straight from where they are. A thread has one output
+// in use at a time. Nothing is truncated, and it does not allocate memory, so
+// it is async signal safe.
+typedef struct Output {
+  int fd;
+  size_t used; // Bytes of data not written yet
+  char *data;
+} Output;
+
+/// Starts the output of a command, with the buffer of the calling thread.
+/// @param out Output to initialize.
+/// @param fd The file descriptor to write to.
+void output_begin(Output *out, int fd);
+
+/// Adds bytes to an output.
+/// @param out The output.
+/// @param str The bytes.
+/// @param len Number of bytes.
+void output_bytes(Output *out, const char *str, size_t len);
+
+/// Adds a string to an output.
+/// @param out The output.
+/// @param str The string.
+void output_str(Output *out, const char *str);
+
+/// Adds a string encoded for the output (see encoded_size).
+/// @param out The output.
+/// @param str The string, may have any byte.
+/// @param len Length of the string.
+void output_encoded(Output *out, const char *str, size_t len);
+
+/// Adds an unsigned integer to an output, in decimal.
+/// @param out The output.
+/// @param value The integer.
+void output_uint(Output *out, uint64_t value);
+
+/// Adds a pair as "(key<separator>value)<suffix>", with the key and the
+/// value encoded (see encoded_size).
+/// @param out The output.
+/// @param key The key.
+/// @param value The value, may have any byte.
+/// @param len Length of the value.
+/// @param separator Added between the key and the value.
+/// @param suffix Added after the pair.
+void output_pair(Output *out, const char *key, const char *value, size_t len,
+                 const char *separator, const char *suffix);
+
+/// Writes what is left of an output.
+/// @param out The output.
+void output_flush(Output *out);
+
 #endif // KVS_IO_H
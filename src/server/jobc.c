@@ -0,0 +1,220 @@
+#include "jobc.h"
+
+#include <limits.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "src/common/constants.h"
+
+// Most bytes a varint takes (a size_t on 64 bits)
+#define VARINT_MAX_SIZE 10
+
+// Number of values each key of a command has.
+static size_t values_per_key(enum Command command) {
+  switch (command) {
+  case CMD_WRITE:
+  case CMD_WRITE_TTL:
+  case CMD_INCR:
+  case CMD_APPEND:
+    return 1;
+  case CMD_CAS:
+    return 2;
+  case CMD_READ:
+  case CMD_DELETE:
+  case CMD_SHOW:
+  case CMD_SCAN:
+  case CMD_STATS:
+  case CMD_WAIT:
+  case CMD_BACKUP:
+  case CMD_HELP:
+  case CMD_EMPTY:
+  case CMD_INVALID:
+  case EOC:
+    break;
+  }
+  return 0;
+}
+
+// Most keys a command parsed from text may have, 0 if it has none.
+static size_t max_keys(enum Command command) {
+  switch (command) {
+  case CMD_WRITE:
+  case CMD_WRITE_TTL:
+  case CMD_INCR:
+  case CMD_APPEND:
+  case CMD_READ:
+  case CMD_DELETE:
+    return MAX_WRITE_SIZE - 1;
+  case CMD_CAS:
+    return MAX_WRITE_SIZE / 2 - 1;
+  case CMD_SCAN:
+    return 2;
+  case CMD_SHOW:
+  case CMD_STATS:
+  case CMD_WAIT:
+  case CMD_BACKUP:
+  case CMD_HELP:
+  case CMD_EMPTY:
+  case CMD_INVALID:
+  case EOC:
+    break;
+  }
+  return 0;
+}
+
+// Bytes of an integer as a varint.
+static size_t varint_size(size_t n) {
+  size_t size = 1;
+  for (; n >= 0x80; n >>= 7) {
+    size++;
+  }
+  return size;
+}
+
+size_t jobc_size(const JobCommand *command) {
+  size_t width = values_per_key(command->command);
+  size_t size = 1 + varint_size(command->number) +
+                varint_size(command->num_keys);
+  for (size_t i = 0; i < command->num_keys; i++) {
+    size_t len = strlen(command->keys[i]) + 1;
+    size += varint_size(len) + len;
+    for (size_t j = 0; j < width; j++) {
+      len = command->values[i * width + j].len;
+      size += varint_size(len) + len;
+    }
+  }
+  return size;
+}
+
+// Writes an integer 7 bits a byte, lowest first, the high bit set on every
+// byte but the last.
+static void put_varint(char **dest, size_t n) {
+  for (; n >= 0x80; n >>= 7) {
+    *(*dest)++ = (char)((n & 0x7F) | 0x80);
+  }
+  *(*dest)++ = (char)n;
+}
+
+static void put_bytes(char **dest, const char *data, size_t len) {
+  put_varint(dest, len);
+  memcpy(*dest, data, len);
+  *dest += len;
+}
+
+void jobc_encode(const JobCommand *command, char *dest) {
+  size_t width = values_per_key(command->command);
+  *dest++ = (char)command->command;
+  put_varint(&dest, command->number);
+  put_varint(&dest, command->num_keys);
+  for (size_t i = 0; i < command->num_keys; i++) {
+    put_bytes(&dest, command->keys[i], strlen(command->keys[i]) + 1);
+    for (size_t j = 0; j < width; j++) {
+      const Value *value = &command->values[i * width + j];
+      put_bytes(&dest, value->data, value->len);
+    }
+  }
+}
+
+int jobc_open(JobcReader *reader, int fd) {
+  struct stat st;
+  if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) ||
+      st.st_size < JOBC_MAGIC_SIZE) {
+    return 1;
+  }
+  void *data = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  if (data == MAP_FAILED) {
+    return 1;
+  }
+  if (memcmp(data, JOBC_MAGIC, JOBC_MAGIC_SIZE) != 0) {
+    munmap(data, (size_t)st.st_size);
+    return 1;
+  }
+  posix_madvise(data, (size_t)st.st_size, POSIX_MADV_SEQUENTIAL);
+  reader->data = data;
+  reader->pos = JOBC_MAGIC_SIZE;
+  reader->len = (size_t)st.st_size;
+  return 0;
+}
+
+// Reads a varint of a record.
+// @return 0 if successful, 1 if it does not fit in the job or a size_t.
+static int get_varint(JobcReader *reader, size_t *n) {
+  *n = 0;
+  for (unsigned int shift = 0; shift < 7 * VARINT_MAX_SIZE; shift += 7) {
+    if (reader->pos == reader->len) {
+      return 1;
+    }
+    unsigned char byte = (unsigned char)reader->data[reader->pos++];
+    *n |= (size_t)(byte & 0x7F) << shift;
+    if (byte < 0x80) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+// Reads a length prefixed string of a record.
+// @return 0 if successful, 1 if it does not fit in the job.
+static int get_bytes(JobcReader *reader, const char **data, size_t *len) {
+  if (get_varint(reader, len) || reader->len - reader->pos < *len) {
+    return 1;
+  }
+  *data = reader->data + reader->pos;
+  reader->pos += *len;
+  return 0;
+}
+
+int jobc_next(JobcReader *reader, JobCommand *command) {
+  *command = (JobCommand){EOC, 0, reader->keys, reader->values, 0};
+  if (reader->pos == reader->len) {
+    return 0;
+  }
+
+  // Empty lines are left out, the end of the job is the end of the file
+  unsigned char byte = (unsigned char)reader->data[reader->pos++];
+  size_t number, num_keys;
+  if (byte > CMD_INVALID || byte == CMD_EMPTY ||
+      get_varint(reader, &number) || number > UINT_MAX ||
+      get_varint(reader, &num_keys)) {
+    return 1;
+  }
+  enum Command type = (enum Command)byte;
+  if (num_keys > max_keys(type) ||
+      (num_keys == 0 && max_keys(type) > 0) ||
+      (type == CMD_SCAN && num_keys != 2)) {
+    return 1;
+  }
+
+  size_t width = values_per_key(type);
+  for (size_t i = 0; i < num_keys; i++) {
+    const char *key;
+    size_t key_len;
+    // Keys are null terminated, with no other null byte
+    if (get_bytes(reader, &key, &key_len) || key_len == 0 ||
+        key_len > MAX_KEY_SIZE ||
+        memchr(key, '\0', key_len) != key + key_len - 1) {
+      return 1;
+    }
+    reader->keys[i] = (char *)key;
+    for (size_t j = 0; j < width; j++) {
+      Value *value = &reader->values[i * width + j];
+      if (get_bytes(reader, &value->data, &value->len) ||
+          value->len > MAX_VALUE_SIZE) {
+        return 1;
+      }
+      // The table copies large values to a blob of its own
+      value->blob = NULL;
+    }
+  }
+  command->command = type;
+  command->number = (unsigned int)number;
+  command->num_keys = num_keys;
+  return 0;
+}
+
+void jobc_close(JobcReader *reader) {
+  munmap((void *)reader->data, reader->len);
+  reader->data = NULL;
+  reader->pos = reader->len = 0;
+}
@@ -0,0 +1,65 @@
+#ifndef KVS_JOBC_H
+#define KVS_JOBC_H
+
+#include <stddef.h>
+
+#include "constants.h"
+#include "parser.h"
+#include "value.h"
+
+// A compiled job (.jobc): the commands of a text job already parsed, as
+// written by kvs-jobc, which the job threads run without parsing any text.
+// The file starts with JOBC_MAGIC, followed by a record per command, empty
+// lines left out:
+//
+//   the command byte, the number (TTL or delay), the number of keys,
+//   then for each key: its length, the key and its terminator,
+//   followed by its values, each its length and the bytes.
+//
+// Numbers and lengths are varints (7 bits a byte, lowest first), so a short
+// string costs a single byte more than its text. Keys keep their terminator,
+// so both keys and values are used in place in the mapped file. The command
+// is the enum Command value, the version in the magic changes whenever the
+// enum does.
+
+#define JOBC_MAGIC "KVSJOBC1"
+#define JOBC_MAGIC_SIZE 8
+
+// Input of a compiled job, mapped in memory
+typedef struct JobcReader {
+  const char *data;
+  size_t pos; // Next record
+  size_t len;
+  char *keys[MAX_WRITE_SIZE]; // Keys of the last command, in data
+  Value values[MAX_WRITE_SIZE];
+} JobcReader;
+
+/// Number of bytes of the record of a command.
+/// @param command The command, not CMD_EMPTY or EOC.
+size_t jobc_size(const JobCommand *command);
+
+/// Writes the record of a command.
+/// @param command The command, not CMD_EMPTY or EOC.
+/// @param dest To write the record to, jobc_size bytes.
+void jobc_encode(const JobCommand *command, char *dest);
+
+/// Maps a compiled job and checks its magic.
+/// @param reader Reader to initialize.
+/// @param fd File descriptor of the job, still owned by the caller.
+/// @return 0 if successful, 1 if it could not be mapped or is not a
+/// compiled job.
+int jobc_open(JobcReader *reader, int fd);
+
+/// Decodes the next command of a compiled job, checking it is one the text
+/// parser could have produced.
+/// @param reader The reader.
+/// @param command To store the command in (EOC at the end of the job), its
+/// keys and values are in the reader until the next call.
+/// @return 0 if successful, 1 if the record is not valid.
+int jobc_next(JobcReader *reader, JobCommand *command);
+
+/// Unmaps a compiled job.
+/// @param reader The reader.
+void jobc_close(JobcReader *reader);
+
+#endif // KVS_JOBC_H
@@ -1,142 +1,1754 @@
 #include "kvs.h"
 
-#include <ctype.h>
+#include <sched.h>
 #include <stdlib.h>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 #include <stdio.h>
 #include "string.h"
 
-// Hash function based on key initial.
-// @param key Lowercase alphabetical string.
-// @return hash.
-// NOTE: This is not an ideal hash function, but is useful for test purposes of
-// the project
-int hash(const char *key) {
-  int firstLetter = tolower(key[0]);
-  if (firstLetter >= 'a' && firstLetter <= 'z') {
-    return firstLetter - 'a';
-  } else if (firstLetter >= '0' && firstLetter <= '9') {
-    return firstLetter - '0';
+#include "constants.h"
+#include "epoch.h"
+
+// Maximum load of a table (live pairs + tombstones), in percentage.
+#define MAX_LOAD 75
+// Number of old slots moved to the new table by each write during a resize.
+#define REHASH_STEP 64
+#define HASH_SEED 0x9747b28c5bd1e995ULL
+
+// Marks the slot of a deleted pair, so probe sequences that pass through it
+// are not cut short.
+static KeyNode tombstone;
+#define TOMBSTONE (&tombstone)
+
+// Control bytes. A full slot has the 7 low bits of the hash of its pair (so
+// the high bit is only set for free slots).
+#define CTRL_EMPTY 0x80
+#define CTRL_DELETED 0xFE
+// The group a probe starts at comes from the hash bits above the control ones
+#define H1(h) ((h) >> 7)
+#define H2(h) ((uint8_t)((h) & 0x7F))
+
+// 64-bit MurmurHash2 (MurmurHash64A), reads the key 8 bytes at a time.
+uint64_t hash(const char *key) {
+  const uint64_t m = 0xc6a4a7935bd1e995ULL;
+  const int r = 47;
+  size_t len = strlen(key);
+  const unsigned char *data = (const unsigned char *)key;
+  const unsigned char *end = data + (len / 8) * 8;
+  uint64_t h = HASH_SEED ^ (len * m);
+
+  while (data != end) {
+    uint64_t k;
+    memcpy(&k, data, sizeof(k));
+    data += sizeof(k);
+
+    k *= m;
+    k ^= k >> r;
+    k *= m;
+    h ^= k;
+    h *= m;
   }
-  return -1; // Invalid index for non-alphabetic or number strings
+
+  if (len & 7) {
+    for (size_t i = len & 7; i > 0; i--) {
+      h ^= (uint64_t)data[i - 1] << (8 * (i - 1));
+    }
+    h *= m;
+  }
+
+  h ^= h >> r;
+  h *= m;
+  h ^= h >> r;
+  return h;
 }
 
-struct HashTable *create_hash_table() {
+// Offset of the filter of a table from its start, the first cache line
+// after the control bytes.
+static size_t filter_offset(size_t capacity) {
+  size_t offset = sizeof(SlotTable) + capacity * sizeof(Slot) + capacity;
+  return (offset + CACHE_LINE_SIZE - 1) & ~(size_t)(CACHE_LINE_SIZE - 1);
+}
+
+// Bytes of memory of a table.
+static size_t table_bytes(size_t capacity) {
+  return filter_offset(capacity) + capacity * FILTER_COUNTERS_PER_SLOT / 2;
+}
+
+// Allocates an empty table.
+static SlotTable *create_slot_table(size_t capacity) {
+  // Aligned so each block of the filter is a single cache line
+  SlotTable *table = aligned_alloc(CACHE_LINE_SIZE, table_bytes(capacity));
+  if (table != NULL) {
+    memset(table, 0, table_bytes(capacity));
+    table->capacity = capacity;
+    table->ctrl = (_Atomic uint64_t *)&table->slots[capacity];
+    table->filter =
+        (_Atomic uint64_t *)((char *)table + filter_offset(capacity));
+    for (size_t i = 0; i < capacity / 8; i++) {
+      atomic_init(&table->ctrl[i], CTRL_EMPTY * UINT64_C(0x0101010101010101));
+    }
+  }
+  return table;
+}
+
+// Initializes an empty shard.
+// @param max_memory Bytes the shard may use, 0 for no limit.
+// @return 0 if successful, 1 otherwise.
+static int init_shard(Shard *shard, size_t max_memory) {
+  SlotTable *table = create_slot_table(TABLE_SIZE);
+  if (!table)
+    return 1;
+  atomic_init(&shard->table, table);
+  atomic_init(&shard->old_table, NULL);
+  atomic_init(&shard->seq, 0);
+  shard->size = 0;
+  shard->used = 0;
+  shard->rehash_pos = 0;
+  slab_init(&shard->slab);
+  for (size_t i = 0; i < INDEX_MAX_HEIGHT; i++) {
+    atomic_init(&shard->index[i], NULL);
+  }
+  shard->index_height = 1;
+  shard->versions = NULL;
+  shard->num_versions = 0;
+  shard->versions_capacity = 0;
+  shard->changed = NULL;
+  shard->num_changed = 0;
+  shard->changed_capacity = 0;
+  shard->changes_lost = 0;
+  // Any non zero seed works, the address keeps shards apart
+  shard->index_rng = (uint64_t)(uintptr_t)shard | 1;
+  shard->memory = table_bytes(TABLE_SIZE);
+  shard->max_memory = max_memory;
+  shard->clock_hand = 0;
+  pthread_rwlock_init(&shard->lock, NULL);
+  return 0;
+}
+
+struct HashTable *create_hash_table(size_t num_shards, size_t max_memory) {
+  if (num_shards == 0)
+    return NULL;
+  size_t shard_memory = max_memory / num_shards;
+  if (max_memory > 0 && shard_memory == 0) {
+    shard_memory = 1;
+  }
   HashTable *ht = malloc(sizeof(HashTable));
   if (!ht)
     return NULL;
-  for (int i = 0; i < TABLE_SIZE; i++) {
-    ht->table[i] = NULL;
+  atomic_init(&ht->now, 0);
+  atomic_init(&ht->stamp, 1);
+  atomic_init(&ht->newest_snapshot, 0);
+  atomic_init(&ht->checkpoint, 0);
+  pthread_mutex_init(&ht->snapshots_lock, NULL);
+  ht->snapshots = NULL;
+  ht->filter_counts =
+      aligned_alloc(CACHE_LINE_SIZE, FILTER_STRIPES * sizeof(FilterCounts));
+  ht->shards = aligned_alloc(CACHE_LINE_SIZE, num_shards * sizeof(Shard));
+  if (!ht->filter_counts || !ht->shards) {
+    pthread_mutex_destroy(&ht->snapshots_lock);
+    free(ht->filter_counts);
+    free(ht->shards);
+    free(ht);
+    return NULL;
+  }
+  for (size_t i = 0; i < FILTER_STRIPES; i++) {
+    atomic_init(&ht->filter_counts[i].negatives, 0);
+    atomic_init(&ht->filter_counts[i].false_positives, 0);
+  }
+  for (ht->num_shards = 0; ht->num_shards < num_shards; ht->num_shards++) {
+    if (init_shard(&ht->shards[ht->num_shards], shard_memory)) {
+      free_table(ht);
+      return NULL;
+    }
   }
-  pthread_rwlock_init(&ht->tablelock, NULL);
   return ht;
 }
 
-void notify_clients(const char *key, const char *value);
+// The shard is picked from the high bits of the hash, the slot inside the
+// shard from the low bits, so the two are independent.
+static size_t shard_index(HashTable *ht, uint64_t h) {
+  return (size_t)(((h >> 32) * ht->num_shards) >> 32);
+}
 
+size_t shard_of(HashTable *ht, const char *key) {
+  return shard_index(ht, hash(key));
+}
 
-int write_pair(HashTable *ht, const char *key, const char *value) {
-  int index = hash(key);
+static void lock_shard(Shard *shard, int write) {
+  if (write) {
+    pthread_rwlock_wrlock(&shard->lock);
+    // Lock-free readers of the shard will retry until it is unlocked
+    atomic_fetch_add_explicit(&shard->seq, 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+  } else {
+    pthread_rwlock_rdlock(&shard->lock);
+  }
+}
 
-  // Search for the key node
-  KeyNode *keyNode = ht->table[index];
-  KeyNode *previousNode;
+static void unlock_shard(Shard *shard) {
+  // Only a writer can leave the sequence number odd
+  if (atomic_load_explicit(&shard->seq, memory_order_relaxed) & 1) {
+    atomic_fetch_add_explicit(&shard->seq, 1, memory_order_release);
+  }
+  pthread_rwlock_unlock(&shard->lock);
+}
 
-  while (keyNode != NULL) {
-    if (strcmp(keyNode->key, key) == 0) {
-      // overwrite value
-      free(keyNode->value);
-      keyNode->value = strdup(value);
-      notify_clients(key, value); // Notificar clientes
+static int compare_indexes(const void *a, const void *b) {
+  size_t x = *(const size_t *)a, y = *(const size_t *)b;
+  return (x > y) - (x < y);
+}
+
+size_t lock_shards(HashTable *ht, size_t *shards, size_t count, int write) {
+  if (count == 0) {
+    return 0;
+  }
+
+  qsort(shards, count, sizeof(size_t), compare_indexes);
+  size_t distinct = 1;
+  for (size_t i = 1; i < count; i++) {
+    if (shards[i] != shards[distinct - 1]) {
+      shards[distinct++] = shards[i];
+    }
+  }
+
+  for (size_t i = 0; i < distinct; i++) {
+    lock_shard(&ht->shards[shards[i]], write);
+  }
+  return distinct;
+}
+
+void unlock_shards(HashTable *ht, const size_t *shards, size_t count) {
+  for (size_t i = count; i > 0; i--) {
+    unlock_shard(&ht->shards[shards[i - 1]]);
+  }
+}
+
+void lock_all_shards(HashTable *ht, int write) {
+  for (size_t i = 0; i < ht->num_shards; i++) {
+    lock_shard(&ht->shards[i], write);
+  }
+}
+
+void unlock_all_shards(HashTable *ht) {
+  for (size_t i = ht->num_shards; i > 0; i--) {
+    unlock_shard(&ht->shards[i - 1]);
+  }
+}
+
+unsigned int read_begin_shard(HashTable *ht, size_t shard) {
+  unsigned int seq;
+  while ((seq = atomic_load_explicit(&ht->shards[shard].seq,
+                                     memory_order_acquire)) &
+         1) {
+    sched_yield();
+  }
+  return seq;
+}
+
+int validate_shard(HashTable *ht, size_t shard, unsigned int seq) {
+  atomic_thread_fence(memory_order_acquire);
+  return atomic_load_explicit(&ht->shards[shard].seq, memory_order_relaxed) ==
+         seq;
+}
+
+void notify_clients(const char *key, const char *value, size_t len);
+
+static _Atomic(Blob *) *blob_link(KeyNode *keyNode) {
+  return (_Atomic(Blob *) *)((char *)keyNode + keyNode->value_offset);
+}
+
+static void release_blob(void *ptr) { blob_release(ptr); }
+
+static void destroy_node(void *ptr) {
+  KeyNode *keyNode = ptr;
+  if (keyNode->large) {
+    blob_release(atomic_load_explicit(blob_link(keyNode),
+                                      memory_order_relaxed));
+  }
+  slab_free(keyNode);
+}
+
+// Bytes of memory used by a pair, its blob included. Called with the shard
+// locked.
+static size_t node_bytes(KeyNode *keyNode) {
+  size_t bytes = slab_size(keyNode);
+  if (keyNode->large) {
+    bytes += blob_bytes(
+        atomic_load_explicit(blob_link(keyNode), memory_order_relaxed));
+  }
+  return bytes;
+}
+
+static _Atomic uint64_t *value_words(KeyNode *keyNode) {
+  return (_Atomic uint64_t *)((char *)keyNode + keyNode->value_offset);
+}
+
+// Number of bytes available for the inline value of a node.
+static size_t value_capacity(KeyNode *keyNode) {
+  return slab_size(keyNode) - keyNode->value_offset;
+}
+
+// Stores a small value (len bytes plus a terminator) in a node, which must
+// have room for it. Readers that overlap with the store see an odd or
+// changed version and retry.
+static void store_value(KeyNode *keyNode, const char *value, size_t len) {
+  _Atomic uint64_t *words = value_words(keyNode);
+  unsigned int version = atomic_load_explicit(&keyNode->version,
+                                              memory_order_relaxed);
+  atomic_store_explicit(&keyNode->version, version + 1, memory_order_relaxed);
+  atomic_thread_fence(memory_order_release);
+
+  for (size_t i = 0; i * sizeof(uint64_t) <= len; i++) {
+    uint64_t word = 0;
+    size_t remaining = len - i * sizeof(uint64_t);
+    memcpy(&word, value + i * sizeof(uint64_t),
+           remaining < sizeof(word) ? remaining : sizeof(word));
+    atomic_store_explicit(&words[i], word, memory_order_relaxed);
+  }
+  atomic_store_explicit(&keyNode->value_len, (uint32_t)len,
+                        memory_order_relaxed);
+
+  atomic_store_explicit(&keyNode->version, version + 2, memory_order_release);
+}
+
+// Copies the inline value of a node. Safe to call without the lock, from
+// inside an epoch critical section, while a writer updates the value in
+// place.
+// @param buffer Buffer of LARGE_VALUE_SIZE bytes, the value is null
+// terminated.
+// @return Length of the value.
+static size_t copy_value(KeyNode *keyNode, char *buffer) {
+  _Atomic uint64_t *words = value_words(keyNode);
+
+  while (1) {
+    unsigned int version = atomic_load_explicit(&keyNode->version,
+                                                memory_order_acquire);
+    if (version & 1) {
+      sched_yield();
+      continue;
+    }
+
+    // The length may be torn by a concurrent store, the copy is then
+    // discarded, but it must stay within the buffer
+    size_t len = atomic_load_explicit(&keyNode->value_len,
+                                      memory_order_relaxed);
+    if (len >= LARGE_VALUE_SIZE) {
+      len = LARGE_VALUE_SIZE - 1;
+    }
+    for (size_t i = 0; i * sizeof(uint64_t) < len; i++) {
+      uint64_t word = atomic_load_explicit(&words[i], memory_order_relaxed);
+      size_t remaining = len - i * sizeof(uint64_t);
+      memcpy(buffer + i * sizeof(uint64_t), &word,
+             remaining < sizeof(word) ? remaining : sizeof(word));
+    }
+    buffer[len] = '\0';
+
+    atomic_thread_fence(memory_order_acquire);
+    if (atomic_load_explicit(&keyNode->version, memory_order_relaxed) ==
+        version) {
+      return len;
+    }
+  }
+}
+
+// Gets a blob holding a value, taking a new reference to the one of the
+// value if it has one.
+// @return the blob, NULL on failure.
+static Blob *value_blob(const Value *value) {
+  if (value->blob != NULL) {
+    return blob_retain(value->blob);
+  }
+  Blob *blob = blob_create(value->len);
+  if (blob != NULL) {
+    memcpy(blob->data, value->data, value->len);
+  }
+  return blob;
+}
+
+// Allocates a node for a pair from the slab of its shard.
+// @param height Number of index levels the node will be in.
+// @param expires Tick when the pair expires, 0 if it never does.
+// @param stamp Stamp of the write (see Snapshot).
+// @return the node, NULL on failure.
+static KeyNode *create_node(Shard *shard, const char *key, const Value *value,
+                            uint8_t height, uint32_t expires, uint64_t stamp) {
+  size_t key_size = strlen(key) + 1;
+  // The index links and the value start at a word boundary
+  size_t tower_offset = (offsetof(KeyNode, key) + key_size + 7) & ~(size_t)7;
+  size_t value_offset = tower_offset + height * sizeof(_Atomic(KeyNode *));
+  int large = value->len >= LARGE_VALUE_SIZE;
+  size_t value_size =
+      large ? sizeof(Blob *) : (value->len + 1 + 7) & ~(size_t)7;
+
+  Blob *blob = NULL;
+  if (large && (blob = value_blob(value)) == NULL) {
+    return NULL;
+  }
+  KeyNode *keyNode = slab_alloc(&shard->slab, value_offset + value_size);
+  if (keyNode == NULL) {
+    blob_release(blob);
+    return NULL;
+  }
+  atomic_init(&keyNode->version, 0);
+  keyNode->value_offset = (uint32_t)value_offset;
+  keyNode->tower_offset = (uint32_t)tower_offset;
+  keyNode->height = height;
+  // New pairs get a full turn of the clock hand before they can be evicted
+  atomic_init(&keyNode->referenced, 1);
+  keyNode->large = (uint8_t)large;
+  keyNode->deleted = 0;
+  atomic_init(&keyNode->expires, expires);
+  atomic_init(&keyNode->value_len, 0);
+  atomic_init(&keyNode->stamp, stamp);
+  atomic_init(&keyNode->older, NULL);
+  memcpy(keyNode->key, key, key_size);
+  if (large) {
+    atomic_init(blob_link(keyNode), blob);
+  } else {
+    store_value(keyNode, value->data, value->len);
+  }
+  shard->memory += node_bytes(keyNode);
+  return keyNode;
+}
+
+// Checks if the pair of a node is past its expiry tick at a given tick.
+static int expired_at(KeyNode *keyNode, uint32_t now) {
+  uint32_t expires = atomic_load_explicit(&keyNode->expires,
+                                          memory_order_relaxed);
+  // Ticks are compared by difference, so they may wrap around
+  return expires != 0 && now - expires < UINT32_MAX / 2;
+}
+
+// Checks if the pair of a node is past its expiry tick.
+static int expired(HashTable *ht, KeyNode *keyNode) {
+  return expired_at(keyNode,
+                    atomic_load_explicit(&ht->now, memory_order_relaxed));
+}
+
+// Marks a node as recently used. The flag is only written when it changes, so
+// readers of a hot pair do not keep invalidating its cache line.
+static void touch_node(KeyNode *keyNode) {
+  if (!atomic_load_explicit(&keyNode->referenced, memory_order_relaxed)) {
+    atomic_store_explicit(&keyNode->referenced, 1, memory_order_relaxed);
+  }
+}
+
+// Links of a node in each level of the index.
+static _Atomic(KeyNode *) *tower(KeyNode *keyNode) {
+  return (_Atomic(KeyNode *) *)((char *)keyNode + keyNode->tower_offset);
+}
+
+// Picks the height of a new node: each level of the index holds about a
+// quarter of the nodes of the level below.
+static uint8_t random_height(Shard *shard) {
+  // xorshift64
+  uint64_t x = shard->index_rng;
+  x ^= x << 13;
+  x ^= x >> 7;
+  x ^= x << 17;
+  shard->index_rng = x;
+
+  uint8_t height = 1;
+  while (height < INDEX_MAX_HEIGHT && (x & 3) == 0) {
+    height++;
+    x >>= 2;
+  }
+  return height;
+}
+
+// Finds, in each level of the index, the link to the first node with a key
+// not smaller than key. Called with the shard locked.
+// @param links Array of INDEX_MAX_HEIGHT to store the links in, only the
+// levels in use are set.
+static void index_search(Shard *shard, const char *key,
+                         _Atomic(KeyNode *) *links[]) {
+  _Atomic(KeyNode *) *tower_links = shard->index;
+  for (size_t level = shard->index_height; level > 0; level--) {
+    KeyNode *next;
+    while ((next = atomic_load_explicit(&tower_links[level - 1],
+                                        memory_order_relaxed)) != NULL &&
+           strcmp(next->key, key) < 0) {
+      tower_links = tower(next);
+    }
+    links[level - 1] = &tower_links[level - 1];
+  }
+}
+
+// Finds the first node with a key not smaller than key. Safe to call without
+// the lock, from inside an epoch critical section.
+static KeyNode *index_seek(Shard *shard, const char *key) {
+  // The levels in use may change meanwhile, the unused ones are empty
+  _Atomic(KeyNode *) *tower_links = shard->index;
+  for (size_t level = INDEX_MAX_HEIGHT; level > 1; level--) {
+    KeyNode *next;
+    while ((next = atomic_load_explicit(&tower_links[level - 1],
+                                        memory_order_acquire)) != NULL &&
+           strcmp(next->key, key) < 0) {
+      tower_links = tower(next);
+    }
+  }
+  KeyNode *next;
+  while ((next = atomic_load_explicit(&tower_links[0],
+                                      memory_order_acquire)) != NULL &&
+         strcmp(next->key, key) < 0) {
+    tower_links = tower(next);
+  }
+  return next;
+}
+
+// Finds the node of a key in the index, with the shard locked.
+// @return the node, NULL if the key is not in the index.
+static KeyNode *index_find(Shard *shard, const char *key) {
+  _Atomic(KeyNode *) *links[INDEX_MAX_HEIGHT];
+  index_search(shard, key, links);
+  KeyNode *keyNode = atomic_load_explicit(links[0], memory_order_relaxed);
+  return keyNode != NULL && strcmp(keyNode->key, key) == 0 ? keyNode : NULL;
+}
+
+// Adds a node to the index. The key must not be in the index already.
+static void index_insert(Shard *shard, KeyNode *keyNode) {
+  _Atomic(KeyNode *) *links[INDEX_MAX_HEIGHT];
+  index_search(shard, keyNode->key, links);
+  for (; shard->index_height < keyNode->height; shard->index_height++) {
+    links[shard->index_height] = &shard->index[shard->index_height];
+  }
+
+  // Each level of the node is set before the node is published in it
+  _Atomic(KeyNode *) *next = tower(keyNode);
+  for (size_t level = 0; level < keyNode->height; level++) {
+    atomic_store_explicit(
+        &next[level], atomic_load_explicit(links[level], memory_order_relaxed),
+        memory_order_relaxed);
+    atomic_store_explicit(links[level], keyNode, memory_order_release);
+  }
+}
+
+// Removes a node from the index. Its own links are left as they are, for the
+// scans standing on it.
+// @return 0 if it was removed, 1 if it was not in the index.
+static int index_remove(Shard *shard, KeyNode *keyNode) {
+  _Atomic(KeyNode *) *links[INDEX_MAX_HEIGHT];
+  index_search(shard, keyNode->key, links);
+  if (atomic_load_explicit(links[0], memory_order_relaxed) != keyNode) {
+    return 1;
+  }
+
+  _Atomic(KeyNode *) *next = tower(keyNode);
+  for (size_t level = 0; level < keyNode->height; level++) {
+    atomic_store_explicit(
+        links[level], atomic_load_explicit(&next[level], memory_order_relaxed),
+        memory_order_release);
+  }
+  while (shard->index_height > 1 &&
+         atomic_load_explicit(&shard->index[shard->index_height - 1],
+                              memory_order_relaxed) == NULL) {
+    shard->index_height--;
+  }
+  return 0;
+}
+
+// Puts a node in the place of another with the same key and height.
+static void index_replace(Shard *shard, KeyNode *old, KeyNode *keyNode) {
+  _Atomic(KeyNode *) *links[INDEX_MAX_HEIGHT];
+  index_search(shard, old->key, links);
+
+  _Atomic(KeyNode *) *old_next = tower(old);
+  _Atomic(KeyNode *) *next = tower(keyNode);
+  for (size_t level = 0; level < old->height; level++) {
+    atomic_store_explicit(
+        &next[level],
+        atomic_load_explicit(&old_next[level], memory_order_relaxed),
+        memory_order_relaxed);
+    atomic_store_explicit(links[level], keyNode, memory_order_release);
+  }
+}
+
+// Control bytes of the group of slots starting at pos (a multiple of the
+// group size). The bytes are only a filter: a lookup always checks the node
+// of a slot before using it, so a byte being changed while it is read can at
+// most make it look at one slot more or end as if the pair was not written
+// yet.
+#if defined(__SSE2__)
+typedef __m128i Group;
+
+static Group load_group(SlotTable *table, size_t pos) {
+  uint64_t low =
+      atomic_load_explicit(&table->ctrl[pos / 8], memory_order_relaxed);
+  uint64_t high =
+      atomic_load_explicit(&table->ctrl[pos / 8 + 1], memory_order_relaxed);
+  return _mm_set_epi64x((long long)high, (long long)low);
+}
+
+// Bit i is set if byte i of the group is byte.
+static unsigned int match_byte(Group group, uint8_t byte) {
+  return (unsigned int)_mm_movemask_epi8(
+      _mm_cmpeq_epi8(group, _mm_set1_epi8((char)byte)));
+}
+
+// Bit i is set if slot i of the group is empty or deleted.
+static unsigned int match_free(Group group) {
+  return (unsigned int)_mm_movemask_epi8(group);
+}
+#else
+// Portable fallback, compares the bytes one at a time
+typedef struct Group {
+  uint64_t words[TABLE_GROUP_SIZE / 8];
+} Group;
+
+static Group load_group(SlotTable *table, size_t pos) {
+  Group group;
+  for (size_t i = 0; i < TABLE_GROUP_SIZE / 8; i++) {
+    group.words[i] =
+        atomic_load_explicit(&table->ctrl[pos / 8 + i], memory_order_relaxed);
+  }
+  return group;
+}
+
+static unsigned int match_byte(Group group, uint8_t byte) {
+  unsigned int mask = 0;
+  for (unsigned int i = 0; i < TABLE_GROUP_SIZE; i++) {
+    uint8_t ctrl = (uint8_t)(group.words[i / 8] >> (i % 8 * 8));
+    mask |= (unsigned int)(ctrl == byte) << i;
+  }
+  return mask;
+}
+
+static unsigned int match_free(Group group) {
+  unsigned int mask = 0;
+  for (unsigned int i = 0; i < TABLE_GROUP_SIZE; i++) {
+    uint8_t ctrl = (uint8_t)(group.words[i / 8] >> (i % 8 * 8));
+    mask |= (unsigned int)(ctrl >> 7) << i;
+  }
+  return mask;
+}
+#endif
+
+static uint8_t get_ctrl(SlotTable *table, size_t i) {
+  uint64_t word =
+      atomic_load_explicit(&table->ctrl[i / 8], memory_order_relaxed);
+  return (uint8_t)(word >> (i % 8 * 8));
+}
+
+// Sets the control byte of a slot. Called with the shard locked for
+// writing, so the word is not changed by anyone else meanwhile.
+static void set_ctrl(SlotTable *table, size_t i, uint8_t byte) {
+  unsigned int shift = (unsigned int)(i % 8 * 8);
+  uint64_t word =
+      atomic_load_explicit(&table->ctrl[i / 8], memory_order_relaxed);
+  word = (word & ~((uint64_t)0xFF << shift)) | (uint64_t)byte << shift;
+  atomic_store_explicit(&table->ctrl[i / 8], word, memory_order_release);
+}
+
+// Probe sequence: groups at triangular offsets from the first one, which
+// visits every group of a power of two table.
+#define FOR_EACH_GROUP(table, h, pos)                                         \
+  for (size_t pos = H1(h) & ((table)->capacity - TABLE_GROUP_SIZE),          \
+              step_ = 0;                                                      \
+       ; step_ += TABLE_GROUP_SIZE,                                           \
+              pos = (pos + step_) & ((table)->capacity - 1))
+
+// Finds the slot holding a key in one of the tables. Safe to call without
+// the lock, from inside an epoch critical section.
+// @return the slot, NULL if the key is not there.
+static Slot *find_slot(SlotTable *table, uint64_t h, const char *key) {
+  // The load factor guarantees there is always an empty slot to stop at
+  FOR_EACH_GROUP(table, h, pos) {
+    Group group = load_group(table, pos);
+    for (unsigned int match = match_byte(group, H2(h)); match != 0;
+         match &= match - 1) {
+      Slot *slot = &table->slots[pos + (size_t)__builtin_ctz(match)];
+      KeyNode *keyNode = atomic_load_explicit(&slot->node,
+                                              memory_order_acquire);
+      if (keyNode != NULL && keyNode != TOMBSTONE &&
+          atomic_load_explicit(&slot->hash, memory_order_relaxed) == h &&
+          strcmp(keyNode->key, key) == 0) {
+        return slot;
+      }
+    }
+    if (match_byte(group, CTRL_EMPTY) != 0) {
+      return NULL;
+    }
+  }
+}
+
+// Counters of the filter in a block, one cache line
+#define FILTER_BLOCK_COUNTERS (TABLE_GROUP_SIZE * FILTER_COUNTERS_PER_SLOT)
+
+// Gets the counters of the filter of a table set by a key. The hash is mixed
+// again (splitmix64 finalizer) so they are not picked by the same bits that
+// pick the shard and the group of the key.
+// @param counters Set to the indexes of the FILTER_HASHES counters.
+static void filter_counters(SlotTable *table, uint64_t h, size_t counters[]) {
+  h = (h ^ (h >> 30)) * 0xbf58476d1ce4e5b9ULL;
+  h = (h ^ (h >> 27)) * 0x94d049bb133111ebULL;
+  h ^= h >> 31;
+  size_t block = (size_t)(h >> 32) & (table->capacity / TABLE_GROUP_SIZE - 1);
+  for (size_t i = 0; i < FILTER_HASHES; i++) {
+    counters[i] = block * FILTER_BLOCK_COUNTERS +
+                  ((size_t)(h >> (7 * i)) & (FILTER_BLOCK_COUNTERS - 1));
+  }
+}
+
+// Checks the filter of a table for a key. Safe to call without the lock.
+// @return 0 if the key is not in the table, 1 if it may be.
+static int filter_contains(SlotTable *table, uint64_t h) {
+  size_t counters[FILTER_HASHES];
+  filter_counters(table, h, counters);
+  for (size_t i = 0; i < FILTER_HASHES; i++) {
+    uint64_t word = atomic_load_explicit(&table->filter[counters[i] / 16],
+                                         memory_order_acquire);
+    if ((word >> (counters[i] % 16 * 4) & 0xF) == 0) {
       return 0;
     }
-    previousNode = keyNode;
-    keyNode = previousNode->next; // Move to the next node
   }
+  return 1;
+}
+
+// Adds a key to the filter of a table (add 1) or removes it (add 0). Called
+// with the shard locked for writing, like set_ctrl.
+static void filter_update(SlotTable *table, uint64_t h, int add) {
+  size_t counters[FILTER_HASHES];
+  filter_counters(table, h, counters);
+  for (size_t i = 0; i < FILTER_HASHES; i++) {
+    _Atomic uint64_t *word = &table->filter[counters[i] / 16];
+    unsigned int shift = (unsigned int)(counters[i] % 16 * 4);
+    uint64_t counter = (uint64_t)1 << shift;
+    uint64_t value = atomic_load_explicit(word, memory_order_relaxed);
+    if ((value >> shift & 0xF) == 0xF) {
+      continue; // Saturated, no longer knows how many keys set it
+    }
+    value = add ? value + counter : value - counter;
+    atomic_store_explicit(word, value, memory_order_release);
+  }
+}
+
+// Stripe of the filter counts of the thread, SIZE_MAX until its first miss
+static _Thread_local size_t filter_stripe = SIZE_MAX;
+static _Atomic size_t next_filter_stripe = 0;
+
+// Counts a lookup of a missing key in the stripe of the thread. Only the
+// threads of a stripe share its counts, so the add stays in a cache line
+// they rarely have to take from another core.
+static void count_miss(HashTable *ht, int maybe) {
+  if (filter_stripe == SIZE_MAX) {
+    filter_stripe = atomic_fetch_add_explicit(&next_filter_stripe, 1,
+                                              memory_order_relaxed) %
+                    FILTER_STRIPES;
+  }
+  FilterCounts *counts = &ht->filter_counts[filter_stripe];
+  atomic_fetch_add_explicit(maybe ? &counts->false_positives
+                                  : &counts->negatives,
+                            1, memory_order_relaxed);
+}
+
+// Finds the node of a key, looking in the table being drained by a resize
+// too. Safe to call without the lock, from inside an epoch critical section.
+static KeyNode *lookup(HashTable *ht, uint64_t h, const char *key) {
+  Shard *shard = &ht->shards[shard_index(ht, h)];
+  SlotTable *table = atomic_load_explicit(&shard->table, memory_order_acquire);
+  while (1) {
+    // The old table is searched first: a pair being moved is placed in the
+    // new table (and its filter) before it is removed from the old one, so
+    // it is always found in one of them.
+    SlotTable *old = atomic_load_explicit(&shard->old_table,
+                                          memory_order_acquire);
+    Slot *slot = NULL;
+    int maybe = 0; // Whether a filter let the lookup through
+    if (old != NULL && old != table && filter_contains(old, h)) {
+      maybe = 1;
+      slot = find_slot(old, h, key);
+    }
+    if (slot == NULL && filter_contains(table, h)) {
+      maybe = 1;
+      slot = find_slot(table, h, key);
+    }
+    if (slot != NULL) {
+      // The slot may have been freed and reused for another key since
+      // find_slot matched it, so the key is checked again
+      KeyNode *keyNode = atomic_load_explicit(&slot->node,
+                                              memory_order_acquire);
+      if (keyNode != NULL && keyNode != TOMBSTONE &&
+          atomic_load_explicit(&slot->hash, memory_order_relaxed) == h &&
+          strcmp(keyNode->key, key) == 0) {
+        return keyNode;
+      }
+    }
+
+    // A resize started while searching, the pair may have been moved
+    SlotTable *current = atomic_load_explicit(&shard->table,
+                                              memory_order_acquire);
+    if (current == table) {
+      count_miss(ht, maybe);
+      return NULL;
+    }
+    table = current;
+  }
+}
+
+// Places a node in the first free slot of its probe sequence. The key must
+// not be in the table already.
+static void place(Shard *shard, uint64_t h, KeyNode *keyNode) {
+  SlotTable *table = atomic_load_explicit(&shard->table, memory_order_relaxed);
+  size_t i = 0;
+  FOR_EACH_GROUP(table, h, pos) {
+    unsigned int free_slots = match_free(load_group(table, pos));
+    if (free_slots != 0) {
+      i = pos + (size_t)__builtin_ctz(free_slots);
+      break;
+    }
+  }
+
+  if (get_ctrl(table, i) == CTRL_EMPTY) {
+    shard->used++;
+  }
+  filter_update(table, h, 1);
+  atomic_store_explicit(&table->slots[i].hash, h, memory_order_relaxed);
+  // Publishes the node, readers that see it also see its contents
+  atomic_store_explicit(&table->slots[i].node, keyNode, memory_order_release);
+  set_ctrl(table, i, H2(h));
+}
+
+// Moves up to steps slots of the old table to the new one, retiring the old
+// table once it has been drained.
+static void rehash_step(Shard *shard, size_t steps) {
+  SlotTable *old = atomic_load_explicit(&shard->old_table,
+                                        memory_order_relaxed);
+  while (old != NULL && steps-- > 0) {
+    Slot *slot = &old->slots[shard->rehash_pos++];
+    KeyNode *keyNode = atomic_load_explicit(&slot->node, memory_order_relaxed);
+    if (keyNode != NULL && keyNode != TOMBSTONE) {
+      uint64_t h = atomic_load_explicit(&slot->hash, memory_order_relaxed);
+      place(shard, h, keyNode);
+      // Keeps the probe sequences of the pairs not moved yet
+      atomic_store_explicit(&slot->node, TOMBSTONE, memory_order_release);
+      set_ctrl(old, shard->rehash_pos - 1, CTRL_DELETED);
+      filter_update(old, h, 0);
+    }
+
+    if (shard->rehash_pos == old->capacity) {
+      atomic_store_explicit(&shard->old_table, NULL, memory_order_release);
+      shard->memory -= table_bytes(old->capacity);
+      epoch_retire(old, free);
+      old = NULL;
+      shard->rehash_pos = 0;
+    }
+  }
+}
+
+// Starts a resize: the current table becomes the old one and the pairs are
+// moved to a new table by the following writes. The table only grows if it
+// is mostly live pairs, otherwise it is rebuilt with the same capacity to get
+// rid of the tombstones.
+// @return 0 if successful, 1 otherwise.
+static int start_resize(Shard *shard) {
+  // Only one resize at a time, finish the previous one
+  rehash_step(shard, SIZE_MAX);
+
+  SlotTable *current = atomic_load_explicit(&shard->table,
+                                            memory_order_relaxed);
+  size_t capacity = current->capacity;
+  if (shard->size * 200 >= capacity * MAX_LOAD) {
+    capacity *= 2;
+  }
+
+  SlotTable *table = create_slot_table(capacity);
+  if (table == NULL) {
+    return 1;
+  }
+  shard->memory += table_bytes(capacity);
+
+  // The old table is published before the new one, so a reader that sees
+  // the new table also sees the old one
+  atomic_store_explicit(&shard->old_table, current, memory_order_release);
+  atomic_store_explicit(&shard->table, table, memory_order_release);
+  shard->rehash_pos = 0;
+  shard->used = 0;
+  return 0;
+}
+
+int reserve_pairs(HashTable *ht, size_t num_pairs) {
+  // Keys spread a little unevenly, some room is left for the fuller shards
+  size_t per_shard = num_pairs / ht->num_shards;
+  per_shard += per_shard / 8;
+  for (size_t i = 0; i < ht->num_shards; i++) {
+    Shard *shard = &ht->shards[i];
+    size_t index = i;
+    lock_shards(ht, &index, 1, 1);
+    rehash_step(shard, SIZE_MAX);
+    SlotTable *current = atomic_load_explicit(&shard->table,
+                                              memory_order_relaxed);
+    size_t capacity = current->capacity;
+    while ((shard->size + per_shard) * 100 > capacity * MAX_LOAD) {
+      capacity *= 2;
+    }
+    // Within the memory of the shard, else the table grows as pairs come
+    int grow = capacity > current->capacity &&
+               (shard->max_memory == 0 ||
+                shard->memory + table_bytes(capacity) <= shard->max_memory);
+    SlotTable *table = grow ? create_slot_table(capacity) : NULL;
+    if (table != NULL) {
+      shard->memory += table_bytes(capacity);
+      atomic_store_explicit(&shard->old_table, current, memory_order_release);
+      atomic_store_explicit(&shard->table, table, memory_order_release);
+      shard->rehash_pos = 0;
+      shard->used = 0;
+      rehash_step(shard, SIZE_MAX);
+    }
+    unlock_shards(ht, &index, 1);
+    if (grow && table == NULL) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+// Stamp of the writes made now, with the shard locked.
+static uint64_t current_stamp(HashTable *ht) {
+  return atomic_load_explicit(&ht->stamp, memory_order_relaxed);
+}
+
+// Checks if a snapshot in use may still see a node, with its shard locked.
+// Such a node is left as it is: writes make a new version instead.
+static int keep_version(HashTable *ht, KeyNode *keyNode) {
+  return atomic_load_explicit(&keyNode->older, memory_order_relaxed) != NULL ||
+         atomic_load_explicit(&ht->newest_snapshot, memory_order_relaxed) >=
+             atomic_load_explicit(&keyNode->stamp, memory_order_relaxed);
+}
+
+// Makes room for one more node in the versions of a shard.
+// @return 0 if successful, 1 otherwise.
+static int reserve_version(Shard *shard) {
+  if (shard->num_versions < shard->versions_capacity) {
+    return 0;
+  }
+  size_t capacity = shard->versions_capacity ? shard->versions_capacity * 2
+                                             : 64;
+  KeyNode **versions = realloc(shard->versions, capacity * sizeof(KeyNode *));
+  if (versions == NULL) {
+    return 1;
+  }
+  shard->versions = versions;
+  shard->versions_capacity = capacity;
+  return 0;
+}
+
+// Links a new version to the one it replaces and records it in the versions
+// of the shard, which must have room for it (see reserve_version).
+static void push_version(Shard *shard, KeyNode *keyNode, KeyNode *older) {
+  atomic_store_explicit(&keyNode->older, older, memory_order_relaxed);
+  shard->versions[shard->num_versions++] = keyNode;
+}
+
+// Frees the older versions no snapshot can see anymore, with the shard
+// locked: those of the nodes written up to stamp oldest.
+// @param oldest Stamp of the oldest snapshot in use, UINT64_MAX if none.
+static void collect_versions(Shard *shard, uint64_t oldest) {
+  size_t done = 0;
+  for (; done < shard->num_versions; done++) {
+    KeyNode *keyNode = shard->versions[done];
+    if (atomic_load_explicit(&keyNode->stamp, memory_order_relaxed) > oldest) {
+      break; // So are the ones written after it
+    }
+    // Scans may still be walking the older versions
+    epoch_retire(atomic_load_explicit(&keyNode->older, memory_order_relaxed),
+                 destroy_node);
+    atomic_store_explicit(&keyNode->older, NULL, memory_order_release);
+    // A deletion nobody sees leaves the index, unless a new version of the
+    // pair already replaced it there
+    if (keyNode->deleted && index_remove(shard, keyNode) == 0) {
+      epoch_retire(keyNode, destroy_node);
+    }
+  }
+  if (done > 0) {
+    shard->num_versions -= done;
+    memmove(shard->versions, shard->versions + done,
+            shard->num_versions * sizeof(KeyNode *));
+  }
+}
+
+// Frees every older version once no snapshot is in use, with the shard
+// locked. Snapshots are only taken with every shard locked, so none can
+// start meanwhile.
+static void collect_idle_versions(HashTable *ht, Shard *shard) {
+  if (shard->num_versions > 0 &&
+      atomic_load_explicit(&ht->newest_snapshot, memory_order_relaxed) == 0) {
+    collect_versions(shard, UINT64_MAX);
+  }
+}
+
+// Records that a key is about to be written or removed, if checkpoints are
+// taken, with the shard locked.
+// @param keyNode Current node of the key, NULL if it is missing.
+static void record_change(HashTable *ht, Shard *shard, KeyNode *keyNode,
+                          const char *key) {
+  uint64_t checkpoint = atomic_load_explicit(&ht->checkpoint,
+                                             memory_order_relaxed);
+  // Written since the checkpoint, so already recorded
+  if (checkpoint == 0 ||
+      (keyNode != NULL &&
+       atomic_load_explicit(&keyNode->stamp, memory_order_relaxed) >
+           checkpoint)) {
+    return;
+  }
+
+  if (shard->num_changed == shard->changed_capacity) {
+    size_t capacity = shard->changed_capacity ? shard->changed_capacity * 2
+                                              : 64;
+    char **changed = realloc(shard->changed, capacity * sizeof(char *));
+    if (changed == NULL) {
+      shard->changes_lost = 1;
+      return;
+    }
+    shard->changed = changed;
+    shard->changed_capacity = capacity;
+  }
+  char *copy = strdup(key);
+  if (copy == NULL) {
+    shard->changes_lost = 1;
+    return;
+  }
+  shard->changed[shard->num_changed++] = copy;
+}
+
+// Removes the pair of a slot from the shard. The node is freed once no
+// reader can be using it, or once no snapshot can see it: then a deleted
+// version takes its place in the index.
+// @param table Table the slot belongs to, the current or the old one.
+// @return 0 if successful, 1 otherwise.
+static int remove_node(HashTable *ht, Shard *shard, SlotTable *table,
+                       Slot *slot) {
+  collect_idle_versions(ht, shard);
+  KeyNode *keyNode = atomic_load_explicit(&slot->node, memory_order_relaxed);
+  record_change(ht, shard, keyNode, keyNode->key);
+  if (keep_version(ht, keyNode)) {
+    if (reserve_version(shard)) {
+      return 1;
+    }
+    Value empty = {"", 0, NULL};
+    KeyNode *deleted = create_node(shard, keyNode->key, &empty,
+                                   keyNode->height, 0, current_stamp(ht));
+    if (deleted == NULL) {
+      return 1;
+    }
+    deleted->deleted = 1;
+    // Deleted versions are not counted, they go with the snapshots
+    shard->memory -= node_bytes(deleted);
+    push_version(shard, deleted, keyNode);
+    index_replace(shard, keyNode, deleted);
+  } else {
+    index_remove(shard, keyNode);
+    // Readers may still be using the node, it is freed once they are done
+    epoch_retire(keyNode, destroy_node);
+  }
+  size_t i = (size_t)(slot - table->slots);
+
+  // A group only gets an empty slot back through this, so if it has one now
+  // it was never full and no probe sequence goes past it: the slot can be
+  // emptied
+  Group group = load_group(table, i & ~(size_t)(TABLE_GROUP_SIZE - 1));
+  if (table == atomic_load_explicit(&shard->table, memory_order_relaxed) &&
+      match_byte(group, CTRL_EMPTY) != 0) {
+    atomic_store_explicit(&slot->node, NULL, memory_order_release);
+    set_ctrl(table, i, CTRL_EMPTY);
+    shard->used--;
+  } else {
+    // The old table always keeps its probe sequences until it is drained
+    atomic_store_explicit(&slot->node, TOMBSTONE, memory_order_release);
+    set_ctrl(table, i, CTRL_DELETED);
+  }
+  filter_update(table, atomic_load_explicit(&slot->hash, memory_order_relaxed),
+                0);
+  shard->size--;
+  shard->memory -= node_bytes(keyNode);
+  return 0;
+}
+
+// Evicts pairs until the shard is within its memory limit, except keep (the
+// pair just written).
+static void evict(HashTable *ht, Shard *shard, KeyNode *keep) {
+  if (shard->max_memory == 0 || shard->memory <= shard->max_memory) {
+    return;
+  }
+
+  // The hand only sweeps the current table
+  rehash_step(shard, SIZE_MAX);
+
+  SlotTable *table = atomic_load_explicit(&shard->table, memory_order_relaxed);
+  size_t mask = table->capacity - 1;
+  // After a full turn every reference bit is clear, two turns are enough to
+  // evict every pair
+  for (size_t steps = 2 * table->capacity;
+       steps > 0 && shard->memory > shard->max_memory; steps--) {
+    Slot *slot = &table->slots[shard->clock_hand++ & mask];
+    KeyNode *keyNode = atomic_load_explicit(&slot->node, memory_order_relaxed);
+    if (keyNode == NULL || keyNode == TOMBSTONE || keyNode == keep) {
+      continue;
+    }
+    if (atomic_load_explicit(&keyNode->referenced, memory_order_relaxed)) {
+      atomic_store_explicit(&keyNode->referenced, 0, memory_order_relaxed);
+      continue;
+    }
+
+    // The node is retired at most, its key is still there
+    if (remove_node(ht, shard, table, slot) == 0) {
+      notify_clients(keyNode->key, "EVICTED", 7); // Notificar clientes
+    }
+  }
+}
+
+// Finds the slot of a key in the tables of a shard, with the shard locked.
+// @param table If not NULL, set to the table the slot is in.
+// @return the slot, NULL if the key is not there.
+static Slot *find_locked(Shard *shard, uint64_t h, const char *key,
+                         SlotTable **table) {
+  SlotTable *current = atomic_load_explicit(&shard->table,
+                                            memory_order_relaxed);
+  SlotTable *old = atomic_load_explicit(&shard->old_table,
+                                        memory_order_relaxed);
+  Slot *slot = find_slot(current, h, key);
+  if (slot == NULL && old != NULL) {
+    current = old;
+    slot = find_slot(old, h, key);
+  }
+  if (table != NULL) {
+    *table = current;
+  }
+  return slot;
+}
+
+// Gets the live pair of a slot found by find_locked.
+// @return the node, NULL if the slot is NULL or its pair expired.
+static KeyNode *live_node(HashTable *ht, Slot *slot) {
+  if (slot == NULL) {
+    return NULL;
+  }
+  KeyNode *keyNode = atomic_load_explicit(&slot->node, memory_order_relaxed);
+  return expired(ht, keyNode) ? NULL : keyNode;
+}
+
+// Stores the value of a pair, in the node of slot if the key is already
+// there, no snapshot can see it and the value fits in it, and notifies the
+// subscribers of the key.
+// @param slot Slot of the key found by find_locked, NULL if it is missing.
+// @return 0 if successful, 1 otherwise.
+static int put_value(HashTable *ht, Shard *shard, uint64_t h, Slot *slot,
+                     const char *key, const Value *value, uint32_t expires) {
+  collect_idle_versions(ht, shard);
+  record_change(
+      ht, shard,
+      slot ? atomic_load_explicit(&slot->node, memory_order_relaxed) : NULL,
+      key);
+  uint64_t stamp = current_stamp(ht);
+  int large = value->len >= LARGE_VALUE_SIZE;
+  if (slot != NULL) {
+    KeyNode *keyNode = atomic_load_explicit(&slot->node, memory_order_relaxed);
+    touch_node(keyNode);
+    int keep = keep_version(ht, keyNode);
+    if (!keep && large && keyNode->large) {
+      // Swaps the blob, readers may still be using the old one
+      Blob *blob = value_blob(value);
+      if (blob == NULL) {
+        return 1;
+      }
+      shard->memory += blob_bytes(blob);
+      Blob *replaced = atomic_exchange_explicit(blob_link(keyNode), blob,
+                                                memory_order_acq_rel);
+      shard->memory -= blob_bytes(replaced);
+      epoch_retire(replaced, release_blob);
+      atomic_store_explicit(&keyNode->expires, expires, memory_order_relaxed);
+      atomic_store_explicit(&keyNode->stamp, stamp, memory_order_relaxed);
+      evict(ht, shard, keyNode);
+    } else if (!keep && !large && !keyNode->large &&
+               value->len < value_capacity(keyNode)) {
+      // overwrite value in place
+      store_value(keyNode, value->data, value->len);
+      atomic_store_explicit(&keyNode->expires, expires, memory_order_relaxed);
+      atomic_store_explicit(&keyNode->stamp, stamp, memory_order_relaxed);
+    } else {
+      // The pair moves to another node. Readers may still be copying the old
+      // one, and snapshots may still see it.
+      if (keep && reserve_version(shard)) {
+        return 1;
+      }
+      KeyNode *newNode = create_node(shard, key, value, keyNode->height,
+                                     expires, stamp);
+      if (newNode == NULL) {
+        return 1;
+      }
+      // Linked to the version it replaces before scans can reach it, or a
+      // snapshot that sees only the older one would skip the pair
+      if (keep) {
+        push_version(shard, newNode, keyNode);
+      }
+      index_replace(shard, keyNode, newNode);
+      atomic_store_explicit(&slot->node, newNode, memory_order_release);
+      shard->memory -= node_bytes(keyNode);
+      if (!keep) {
+        epoch_retire(keyNode, destroy_node);
+      }
+      evict(ht, shard, newNode);
+    }
+    notify_clients(key, value->data, value->len); // Notificar clientes
+    return 0;
+  }
+
   // Key not found, create a new key node
-  keyNode = malloc(sizeof(KeyNode));
-  keyNode->key = strdup(key);       // Allocate memory for the key
-  keyNode->value = strdup(value);   // Allocate memory for the value
-  keyNode->next = ht->table[index]; // Link to existing nodes
-  ht->table[index] = keyNode; // Place new key node at the start of the list
-  notify_clients(key, value); // Notificar clientes
+  SlotTable *table = atomic_load_explicit(&shard->table, memory_order_relaxed);
+  if ((shard->used + 1) * 100 > table->capacity * MAX_LOAD &&
+      start_resize(shard)) {
+    return 1;
+  }
+
+  // A deletion snapshots still see may hold the place of the key in the
+  // index, the new node becomes its newer version
+  KeyNode *deleted = shard->num_versions > 0 ? index_find(shard, key) : NULL;
+  if (deleted != NULL && reserve_version(shard)) {
+    return 1;
+  }
+  KeyNode *keyNode = create_node(
+      shard, key, value, deleted ? deleted->height : random_height(shard),
+      expires, stamp);
+  if (keyNode == NULL) {
+    return 1;
+  }
+  place(shard, h, keyNode);
+  if (deleted != NULL) {
+    push_version(shard, keyNode, deleted);
+    index_replace(shard, deleted, keyNode);
+  } else {
+    index_insert(shard, keyNode);
+  }
+  shard->size++;
+  evict(ht, shard, keyNode);
+  notify_clients(key, value->data, value->len); // Notificar clientes
   return 0;
 }
 
+int write_pair(HashTable *ht, const char *key, const Value *value,
+               uint32_t expires) {
+  uint64_t h = hash(key);
+  Shard *shard = &ht->shards[shard_index(ht, h)];
+  rehash_step(shard, REHASH_STEP);
+  return put_value(ht, shard, h, find_locked(shard, h, key, NULL), key,
+                   value, expires);
+}
 
+int incr_pair(HashTable *ht, const char *key, long long delta,
+              long long *result) {
+  uint64_t h = hash(key);
+  Shard *shard = &ht->shards[shard_index(ht, h)];
+  rehash_step(shard, REHASH_STEP);
+  Slot *slot = find_locked(shard, h, key, NULL);
+  KeyNode *keyNode = live_node(ht, slot);
 
+  // A missing key counts from 0
+  long long current = 0;
+  uint32_t expires = 0;
+  if (keyNode != NULL) {
+    char buffer[LARGE_VALUE_SIZE];
+    size_t len;
+    const char *value = node_value(keyNode, buffer, &len);
+    if (parse_integer(value, len, &current) != 0) {
+      return 1;
+    }
+    expires = atomic_load_explicit(&keyNode->expires, memory_order_relaxed);
+  }
+  if (__builtin_add_overflow(current, delta, result)) {
+    return 1;
+  }
 
-int key_exists(HashTable *ht, const char *key) {
-  int index = hash(key);
+  char digits[32];
+  int len = snprintf(digits, sizeof(digits), "%lld", *result);
+  Value value = {digits, (size_t)len, NULL};
+  return put_value(ht, shard, h, slot, key, &value, expires);
+}
 
-  KeyNode *keyNode = ht->table[index];
-  while (keyNode != NULL) {
-    if (strcmp(keyNode->key, key) == 0) {
-      return 1; // Key exists
+int append_pair(HashTable *ht, const char *key, const Value *suffix) {
+  uint64_t h = hash(key);
+  Shard *shard = &ht->shards[shard_index(ht, h)];
+  rehash_step(shard, REHASH_STEP);
+  Slot *slot = find_locked(shard, h, key, NULL);
+  KeyNode *keyNode = live_node(ht, slot);
+  if (keyNode == NULL) {
+    return put_value(ht, shard, h, slot, key, suffix, 0);
+  }
+
+  char buffer[LARGE_VALUE_SIZE];
+  size_t len;
+  const char *value = node_value(keyNode, buffer, &len);
+  size_t total = len + suffix->len;
+  if (total > MAX_VALUE_SIZE) {
+    return 1;
+  }
+
+  // A small result is joined on the stack and stored in place if it fits.
+  // Blobs may be shared with readers, so a large one is always a new blob.
+  char joined[LARGE_VALUE_SIZE];
+  Value result = {joined, total, NULL};
+  if (total >= LARGE_VALUE_SIZE) {
+    if ((result.blob = blob_create(total)) == NULL) {
+      return 1;
     }
-    keyNode = keyNode->next;
+    result.data = result.blob->data;
+  }
+  memcpy((char *)result.data, value, len);
+  memcpy((char *)result.data + len, suffix->data, suffix->len);
+  ((char *)result.data)[total] = '\0';
+
+  int error = put_value(
+      ht, shard, h, slot, key, &result,
+      atomic_load_explicit(&keyNode->expires, memory_order_relaxed));
+  blob_release(result.blob);
+  return error;
+}
+
+int cas_pair(HashTable *ht, const char *key, const Value *expected,
+             const Value *value) {
+  uint64_t h = hash(key);
+  Shard *shard = &ht->shards[shard_index(ht, h)];
+  rehash_step(shard, REHASH_STEP);
+  Slot *slot = find_locked(shard, h, key, NULL);
+  KeyNode *keyNode = live_node(ht, slot);
+  if (keyNode == NULL) {
+    return 1;
+  }
+
+  char buffer[LARGE_VALUE_SIZE];
+  size_t len;
+  const char *current = node_value(keyNode, buffer, &len);
+  if (len != expected->len || memcmp(current, expected->data, len) != 0) {
+    return 2;
+  }
+  if (put_value(ht, shard, h, slot, key, value,
+                atomic_load_explicit(&keyNode->expires,
+                                     memory_order_relaxed)) != 0) {
+    return -1;
   }
+  return 0;
+}
 
-  return 0; // Key does not exist
+int key_exists(HashTable *ht, const char *key) {
+  uint64_t h = hash(key);
+  epoch_enter();
+  KeyNode *keyNode = lookup(ht, h, key);
+  int exists = keyNode != NULL && !expired(ht, keyNode);
+  epoch_exit();
+  return exists;
 }
 
 
 
-char *read_pair(HashTable *ht, const char *key) {
-  int index = hash(key);
+char *read_pair(HashTable *ht, const char *key, size_t *len) {
+  char buffer[LARGE_VALUE_SIZE];
+  Value value;
+  if (read_pair_into(ht, key, buffer, &value) != 0) {
+    return NULL; // NULL if the key was not found
+  }
 
-  KeyNode *keyNode = ht->table[index];
-  while (keyNode != NULL) {
-    if (strcmp(keyNode->key, key) == 0) {
-      return strdup(keyNode->value); // Return a copy of the value
+  // Return a copy of the value
+  char *copy = malloc(value.len + 1);
+  if (copy != NULL) {
+    memcpy(copy, value.data, value.len + 1);
+    *len = value.len;
+  }
+  blob_release(value.blob);
+  return copy;
+}
+
+int read_pair_into(HashTable *ht, const char *key, char *buffer,
+                   Value *value) {
+  uint64_t h = hash(key);
+
+  epoch_enter();
+  KeyNode *keyNode = lookup(ht, h, key);
+  int found = keyNode != NULL && !expired(ht, keyNode);
+  if (found) {
+    touch_node(keyNode);
+    if (keyNode->large) {
+      // The table keeps its reference until no reader can be here
+      Blob *blob = blob_retain(
+          atomic_load_explicit(blob_link(keyNode), memory_order_acquire));
+      *value = (Value){blob->data, blob->len, blob};
+    } else {
+      size_t len = copy_value(keyNode, buffer);
+      *value = (Value){buffer, len, NULL};
     }
-    keyNode = keyNode->next;
   }
+  epoch_exit();
 
-  return NULL; // Key not found
+  return !found;
+}
+
+const char *node_value(KeyNode *keyNode, char *buffer, size_t *len) {
+  if (keyNode->large) {
+    Blob *blob = atomic_load_explicit(blob_link(keyNode),
+                                      memory_order_acquire);
+    *len = blob->len;
+    return blob->data;
+  }
+  *len = copy_value(keyNode, buffer);
+  return buffer;
 }
 
 
 int delete_pair(HashTable *ht, const char *key) {
-  int index = hash(key);
+  uint64_t h = hash(key);
+  Shard *shard = &ht->shards[shard_index(ht, h)];
+  rehash_step(shard, REHASH_STEP);
+
+  SlotTable *table;
+  Slot *slot = find_locked(shard, h, key, &table);
+  // An expired pair is already gone for the clients, its removal is left to
+  // expire_pair
+  if (live_node(ht, slot) == NULL) {
+    return 1;
+  }
+
+  if (remove_node(ht, shard, table, slot) != 0) {
+    return 1;
+  }
+  notify_clients(key, "DELETED", 7); // Notificar clientes
+  return 0;
+}
+
+int expire_pair(HashTable *ht, const char *key, uint32_t expires) {
+  uint64_t h = hash(key);
+  Shard *shard = &ht->shards[shard_index(ht, h)];
+
+  SlotTable *table;
+  Slot *slot = find_locked(shard, h, key, &table);
+  // The pair may have been deleted, or written again with another TTL
+  if (slot == NULL ||
+      atomic_load_explicit(
+          &atomic_load_explicit(&slot->node, memory_order_relaxed)->expires,
+          memory_order_relaxed) != expires) {
+    return 1;
+  }
+
+  if (remove_node(ht, shard, table, slot) != 0) {
+    return 1;
+  }
+  notify_clients(key, "DELETED", 7); // Notificar clientes
+  return 0;
+}
+
+// Registers a snapshot, with every shard locked and the snapshots lock held.
+static void add_snapshot(HashTable *ht, Snapshot *snapshot) {
+  snapshot->stamp = atomic_load_explicit(&ht->stamp, memory_order_relaxed);
+  atomic_store_explicit(&ht->stamp, snapshot->stamp + 1, memory_order_relaxed);
+  snapshot->now = atomic_load_explicit(&ht->now, memory_order_relaxed);
+  snapshot->prev = NULL;
+  snapshot->next = ht->snapshots;
+  if (ht->snapshots != NULL) {
+    ht->snapshots->prev = snapshot;
+  }
+  ht->snapshots = snapshot;
+  atomic_store_explicit(&ht->newest_snapshot, snapshot->stamp,
+                        memory_order_relaxed);
+}
+
+void snapshot_begin(HashTable *ht, Snapshot *snapshot) {
+  snapshot_begin_with(ht, snapshot, NULL, NULL);
+}
+
+void snapshot_begin_with(HashTable *ht, Snapshot *snapshot,
+                         void (*locked)(void *arg), void *arg) {
+  // Writers stamp their versions with the shard locked, so with every shard
+  // locked none is halfway through. Lock-free reads do not need to retry.
+  lock_all_shards(ht, 0);
+  pthread_mutex_lock(&ht->snapshots_lock);
+  add_snapshot(ht, snapshot);
+  pthread_mutex_unlock(&ht->snapshots_lock);
+  if (locked != NULL) {
+    locked(arg);
+  }
+  unlock_all_shards(ht);
+}
+
+static int compare_keys(const void *a, const void *b) {
+  return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+int checkpoint_begin(HashTable *ht, Snapshot *snapshot, Changes *changes) {
+  // The shards only record changes while holding their lock, and the
+  // snapshots lock keeps other checkpoints out
+  lock_all_shards(ht, 0);
+  pthread_mutex_lock(&ht->snapshots_lock);
+  size_t count = 0;
+  for (size_t i = 0; i < ht->num_shards; i++) {
+    count += ht->shards[i].num_changed;
+  }
+  changes->keys = malloc((count > 0 ? count : 1) * sizeof(char *));
+  if (changes->keys == NULL) {
+    pthread_mutex_unlock(&ht->snapshots_lock);
+    unlock_all_shards(ht);
+    return 1;
+  }
+
+  // The first checkpoint has nothing to compare with
+  changes->complete =
+      atomic_load_explicit(&ht->checkpoint, memory_order_relaxed) != 0;
+  changes->count = 0;
+  for (size_t i = 0; i < ht->num_shards; i++) {
+    Shard *shard = &ht->shards[i];
+    if (shard->num_changed > 0) {
+      memcpy(changes->keys + changes->count, shard->changed,
+             shard->num_changed * sizeof(char *));
+      changes->count += shard->num_changed;
+      shard->num_changed = 0;
+    }
+    if (shard->changes_lost) {
+      changes->complete = 0;
+      shard->changes_lost = 0;
+    }
+  }
+  add_snapshot(ht, snapshot);
+  atomic_store_explicit(&ht->checkpoint, snapshot->stamp,
+                        memory_order_relaxed);
+  pthread_mutex_unlock(&ht->snapshots_lock);
+  unlock_all_shards(ht);
+
+  // A key deleted and written again is recorded twice
+  qsort(changes->keys, changes->count, sizeof(char *), compare_keys);
+  size_t unique = 0;
+  for (size_t i = 0; i < changes->count; i++) {
+    if (unique > 0 &&
+        strcmp(changes->keys[unique - 1], changes->keys[i]) == 0) {
+      free(changes->keys[i]);
+    } else {
+      changes->keys[unique++] = changes->keys[i];
+    }
+  }
+  changes->count = unique;
+  return 0;
+}
+
+void changes_free(Changes *changes) {
+  for (size_t i = 0; i < changes->count; i++) {
+    free(changes->keys[i]);
+  }
+  free(changes->keys);
+  changes->keys = NULL;
+  changes->count = 0;
+}
+
+void snapshot_end(HashTable *ht, Snapshot *snapshot) {
+  pthread_mutex_lock(&ht->snapshots_lock);
+  if (snapshot->prev != NULL) {
+    snapshot->prev->next = snapshot->next;
+  } else {
+    ht->snapshots = snapshot->next;
+  }
+  if (snapshot->next != NULL) {
+    snapshot->next->prev = snapshot->prev;
+  }
+  atomic_store_explicit(&ht->newest_snapshot,
+                        ht->snapshots ? ht->snapshots->stamp : 0,
+                        memory_order_relaxed);
+  pthread_mutex_unlock(&ht->snapshots_lock);
+
+  for (size_t i = 0; i < ht->num_shards; i++) {
+    Shard *shard = &ht->shards[i];
+    lock_shard(shard, 1);
+    // Read with the shard locked, a snapshot taken meanwhile is accounted for
+    pthread_mutex_lock(&ht->snapshots_lock);
+    uint64_t oldest = UINT64_MAX;
+    for (Snapshot *other = ht->snapshots; other != NULL; other = other->next) {
+      oldest = other->stamp; // Newest first, the last one is the oldest
+    }
+    pthread_mutex_unlock(&ht->snapshots_lock);
+    collect_versions(shard, oldest);
+    unlock_shard(shard);
+  }
+}
+
+// Gets the version of the pair of a node that a snapshot sees.
+// @return the version, NULL if the pair is missing or expired in it.
+static KeyNode *snapshot_version(const Snapshot *snapshot, KeyNode *keyNode) {
+  while (keyNode != NULL && atomic_load_explicit(&keyNode->stamp,
+                                                 memory_order_relaxed) >
+                                snapshot->stamp) {
+    keyNode = atomic_load_explicit(&keyNode->older, memory_order_acquire);
+  }
+  if (keyNode == NULL || keyNode->deleted ||
+      expired_at(keyNode, snapshot->now)) {
+    return NULL;
+  }
+  return keyNode;
+}
+
+// Orders the heap of a scan by the key of its nodes.
+static int node_less(KeyNode *a, KeyNode *b) {
+  return strcmp(a->key, b->key) < 0;
+}
+
+// Moves the node at position i of the heap down to its place.
+static void sift_down(Scan *scan, size_t i) {
+  KeyNode **heap = scan->heap;
+  while (1) {
+    size_t smallest = i;
+    size_t left = 2 * i + 1, right = 2 * i + 2;
+    if (left < scan->count && node_less(heap[left], heap[smallest])) {
+      smallest = left;
+    }
+    if (right < scan->count && node_less(heap[right], heap[smallest])) {
+      smallest = right;
+    }
+    if (smallest == i) {
+      return;
+    }
+    KeyNode *aux = heap[i];
+    heap[i] = heap[smallest];
+    heap[smallest] = aux;
+    i = smallest;
+  }
+}
+
+int scan_begin(HashTable *ht, Scan *scan, const Snapshot *snapshot,
+               const char *start, const char *end) {
+  scan->heap = malloc(ht->num_shards * sizeof(KeyNode *));
+  if (scan->heap == NULL) {
+    return 1;
+  }
+  scan->ht = ht;
+  scan->snapshot = snapshot;
+  scan->count = 0;
+  scan->end = end;
+  scan->keys = NULL;
+  scan->num_keys = 0;
+
+  // Nodes unlinked while the scan stands on them are not freed until it ends
+  epoch_enter();
+  // The first node of the range in each shard, found in O(log n)
+  for (size_t i = 0; i < ht->num_shards; i++) {
+    Shard *shard = &ht->shards[i];
+    KeyNode *first =
+        start != NULL
+            ? index_seek(shard, start)
+            : atomic_load_explicit(&shard->index[0], memory_order_acquire);
+    if (first != NULL) {
+      scan->heap[scan->count++] = first;
+    }
+  }
 
-  KeyNode *keyNode = ht->table[index];
-  KeyNode *prevNode = NULL;
+  for (size_t i = scan->count / 2; i > 0; i--) {
+    sift_down(scan, i - 1);
+  }
+  return 0;
+}
+
+void scan_keys_begin(HashTable *ht, Scan *scan, const Snapshot *snapshot,
+                     char *const *keys, size_t num_keys) {
+  scan->ht = ht;
+  scan->snapshot = snapshot;
+  scan->heap = NULL;
+  scan->count = 0;
+  scan->end = NULL;
+  scan->keys = keys;
+  scan->num_keys = num_keys;
+  // Nodes unlinked while the scan stands on them are not freed until it ends
+  epoch_enter();
+}
 
+KeyNode *scan_next(Scan *scan) {
+  // Each key of a list is found in the index of its shard, in O(log n)
+  while (scan->num_keys > 0) {
+    const char *key = *scan->keys++;
+    scan->num_keys--;
+    Shard *shard = &scan->ht->shards[shard_of(scan->ht, key)];
+    KeyNode *keyNode = index_seek(shard, key);
+    if (keyNode != NULL && strcmp(keyNode->key, key) == 0 &&
+        (keyNode = snapshot_version(scan->snapshot, keyNode)) != NULL) {
+      return keyNode;
+    }
+  }
+
+  while (scan->count > 0) {
+    KeyNode *keyNode = scan->heap[0];
+    if (scan->end != NULL && strcmp(keyNode->key, scan->end) > 0) {
+      // The smallest key left is past the end, so are all the others
+      scan->count = 0;
+      return NULL;
+    }
+
+    // The shard of the node continues with its successor
+    KeyNode *next = atomic_load_explicit(&tower(keyNode)[0],
+                                         memory_order_acquire);
+    if (next != NULL) {
+      scan->heap[0] = next;
+    } else {
+      scan->heap[0] = scan->heap[--scan->count];
+    }
+    sift_down(scan, 0);
+
+    KeyNode *version = snapshot_version(scan->snapshot, keyNode);
+    if (version != NULL) {
+      return version;
+    }
+  }
+  return NULL;
+}
+
+void scan_end(Scan *scan) {
+  epoch_exit();
+  free(scan->heap);
+  scan->heap = NULL;
+  scan->count = 0;
+}
+
+void filter_stats(HashTable *ht, FilterStats *stats) {
+  stats->negatives = 0;
+  stats->false_positives = 0;
+  for (size_t i = 0; i < FILTER_STRIPES; i++) {
+    FilterCounts *counts = &ht->filter_counts[i];
+    stats->negatives +=
+        atomic_load_explicit(&counts->negatives, memory_order_relaxed);
+    stats->false_positives +=
+        atomic_load_explicit(&counts->false_positives, memory_order_relaxed);
+  }
+}
+
+// Releases the blobs of the large values of a shard, of every pair in its
+// index and every older version of them.
+static void release_blobs(Shard *shard) {
+  KeyNode *keyNode = atomic_load_explicit(&shard->index[0],
+                                          memory_order_relaxed);
   while (keyNode != NULL) {
-    if (strcmp(keyNode->key, key) == 0) {
-      if (prevNode == NULL) {
-        // Node to delete is the first node
-        ht->table[index] = keyNode->next;
-      } else {
-        // Node to delete is not the first; bypass it
-        prevNode->next = keyNode->next;
+    KeyNode *next = atomic_load_explicit(&tower(keyNode)[0],
+                                         memory_order_relaxed);
+    for (KeyNode *version = keyNode; version != NULL;
+         version = atomic_load_explicit(&version->older,
+                                        memory_order_relaxed)) {
+      if (version->large) {
+        blob_release(atomic_load_explicit(blob_link(version),
+                                          memory_order_relaxed));
       }
-      
-      // Free the memory allocated for the key and value
-      free(keyNode->key);
-      free(keyNode->value);
-      free(keyNode); // Free the key node itself
-      notify_clients(key, "DELETED"); // Notificar clientes
-      return 0;      // Exit the function
     }
-    prevNode = keyNode;      // Move prevNode to current node
-    keyNode = keyNode->next; // Move to the next node
+    keyNode = next;
   }
-
-  return 1;
 }
 
 void free_table(HashTable *ht) {
-  for (int i = 0; i < TABLE_SIZE; i++) {
-    KeyNode *keyNode = ht->table[i];
-    while (keyNode != NULL) {
-      KeyNode *temp = keyNode;
-      keyNode = keyNode->next;
-      free(temp->key);
-      free(temp->value);
-      free(temp);
+  // Retired nodes live in the slabs, they are reclaimed before the slabs go
+  epoch_reclaim_all();
+  for (size_t i = 0; i < ht->num_shards; i++) {
+    Shard *shard = &ht->shards[i];
+    release_blobs(shard);
+    free(atomic_load_explicit(&shard->old_table, memory_order_relaxed));
+    free(atomic_load_explicit(&shard->table, memory_order_relaxed));
+    // Frees every node still in the tables
+    slab_destroy(&shard->slab);
+    free(shard->versions);
+    for (size_t j = 0; j < shard->num_changed; j++) {
+      free(shard->changed[j]);
     }
+    free(shard->changed);
+    pthread_rwlock_destroy(&shard->lock);
   }
-  pthread_rwlock_destroy(&ht->tablelock);
+  pthread_mutex_destroy(&ht->snapshots_lock);
+  free(ht->filter_counts);
+  free(ht->shards);
   free(ht);
 }
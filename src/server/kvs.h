@@ -1,44 +1,324 @@
 #ifndef KEY_VALUE_STORE_H
 #define KEY_VALUE_STORE_H
-#define TABLE_SIZE 26
+// Initial number of slots of a shard (must be a power of two)
+#define TABLE_SIZE 64
+#define CACHE_LINE_SIZE 64
+// Number of control bytes compared at once by a lookup
+#define TABLE_GROUP_SIZE 16
+// Counters of the Bloom filter of a table per slot, 4 bits each
+#define FILTER_COUNTERS_PER_SLOT 8
+// Counters of the filter set by each pair, all in the block of the pair
+#define FILTER_HASHES 4
+// Counters of the lookups of missing keys, shared by the threads of a stripe
+#define FILTER_STRIPES 64
+// Maximum number of levels of the ordered index of a shard
+#define INDEX_MAX_HEIGHT 16
 
 #include <pthread.h>
+#include <stdatomic.h>
 #include <stddef.h>
+#include <stdint.h>
 
+#include "slab.h"
+#include "value.h"
+
+// Readers do not take any lock: every field a reader may see while a writer
+// changes it is atomic, and memory unlinked by writers is only freed once no
+// reader can still reach it (see epoch.h).
+
+// A pair is a single slab object holding the key and the value inline: the
+// header, the null terminated key, the links of the node in the ordered index
+// of its shard and then the value, stored as atomic words starting at
+// value_offset up to the end of the object. A large value (see value.h) is
+// not inline, the node holds an atomic pointer to its blob at value_offset
+// instead.
+//
+// A node is also a version of its pair (see Snapshot). The table and the
+// index hold the newest version, which links to the older versions that
+// snapshots in use may still see. Deleting a pair such a snapshot may see
+// leaves a deleted version in the index in its place.
 typedef struct KeyNode {
-  char *key;
-  char *value;
-  struct KeyNode *next;
+  // Odd while a writer updates the value in place, lets readers copying the
+  // value retry if it changed under them (see copy_value).
+  _Atomic unsigned int version;
+  uint32_t value_offset; // Offset of the value from the start of the node
+  uint32_t tower_offset; // Offset of the index links (height pointers)
+  uint8_t height;        // Number of levels of the index the node is in
+  // Set by readers, cleared by the eviction clock hand (see Shard)
+  _Atomic uint8_t referenced;
+  uint8_t large;   // 1 if the value is in a blob, never changes
+  uint8_t deleted; // 1 if the version records a deletion, never changes
+  // Tick of the expiry clock (see HashTable) when the pair expires, 0 if it
+  // never does
+  _Atomic uint32_t expires;
+  _Atomic uint32_t value_len; // Length of an inline value
+  _Atomic uint64_t stamp;     // Stamp of the write of the version
+  // Next older version, kept while a snapshot in use may see it
+  _Atomic(struct KeyNode *) older;
+  char key[];
 } KeyNode;
 
+// A slot of the open-addressing table. The full hash is cached so probing and
+// rehashing never have to touch the node unless the hashes match.
+typedef struct Slot {
+  _Atomic uint64_t hash;
+  _Atomic(KeyNode *) node; // NULL if empty, TOMBSTONE if the pair was deleted
+} Slot;
+
+// Swiss table layout: besides the slots, the table has one control byte per
+// slot (empty, deleted, or 7 bits of the hash of the pair), so a lookup
+// filters a whole group of slots by comparing their control bytes at once
+// and only looks at the slots whose bytes match.
+//
+// In front of the slots, a counting Bloom filter of the keys in the table
+// answers most lookups of missing keys by reading a single cache line. The
+// filter is split in blocks of a cache line, one per group of slots, and a
+// key sets FILTER_HASHES counters of one block. Counters saturate: one that
+// reached its maximum is never decremented again, which can only cause false
+// positives. It grows with the table, and a resize rebuilds it as the pairs
+// are moved to the new table.
+typedef struct SlotTable {
+  size_t capacity; // Number of slots (power of two, at least a group)
+  // Control bytes packed in words (byte i of a word is its bits 8i to 8i+7),
+  // stored after the slots
+  _Atomic uint64_t *ctrl;
+  // Counters of the filter packed in words (counter i of a word is its bits
+  // 4i to 4i+3), stored after the control bytes, aligned to a cache line
+  _Atomic uint64_t *filter;
+  Slot slots[];
+} SlotTable;
+
+// A shard owns a part of the keys, chosen by their hash, with its own table
+// and lock, so batches on unrelated keys do not block each other. The lock
+// is only taken by writers (and by SHOW and BACKUP).
+typedef struct Shard {
+  // Aligned so the locks of different shards are not in the same cache line
+  _Alignas(CACHE_LINE_SIZE) pthread_rwlock_t lock;
+  // Odd while a writer holds the lock, lets lock-free readers check that
+  // nothing changed while they read a batch of keys.
+  _Atomic unsigned int seq;
+
+  _Atomic(SlotTable *) table; // Table where new pairs are inserted
+  size_t size; // Number of live pairs in both tables
+  size_t used; // Number of non empty slots (live + tombstones) in table
+
+  // While a resize is in progress the pairs still in old_table are moved to
+  // table a few at a time by every write, so no single write pays for the
+  // whole rehash.
+  _Atomic(SlotTable *) old_table;
+  size_t rehash_pos; // Next slot of old_table to be moved
+
+  Slab slab; // Memory of the nodes of the shard
+
+  // Skip list of the pairs of the shard sorted by key, used by the ordered
+  // commands (SCAN, SHOW and BACKUP). Changed under the lock of the shard,
+  // walked without it by scans: nodes are linked with release stores and an
+  // unlinked node keeps its links, so a scan standing on it carries on.
+  _Atomic(KeyNode *) index[INDEX_MAX_HEIGHT]; // First node of each level
+  size_t index_height;                        // Number of levels in use
+  uint64_t index_rng; // State of the generator of node heights
+
+  // Nodes with an older version, in the order they were written (so by
+  // stamp). Their older versions are freed once no snapshot can see them.
+  KeyNode **versions;
+  size_t num_versions;
+  size_t versions_capacity;
+
+  // Keys written or removed since the last checkpoint (see checkpoint_begin),
+  // copies owned by the shard. Only tracked once a checkpoint was taken.
+  char **changed;
+  size_t num_changed;
+  size_t changed_capacity;
+  int changes_lost; // 1 if a change could not be recorded
+
+  // Bytes used by the live nodes and the tables of the shard. Once it goes
+  // over max_memory, pairs are evicted with the CLOCK policy: the hand sweeps
+  // the table, evicting the first pair not read since the last sweep and
+  // clearing the reference bit of the others.
+  size_t memory;
+  size_t max_memory; // 0 for no limit
+  size_t clock_hand; // Next slot of table to be visited
+} Shard;
+
+// Lookups of missing keys counted by the readers of a stripe (see
+// FilterStats), in a cache line of their own
+typedef struct FilterCounts {
+  _Alignas(CACHE_LINE_SIZE) _Atomic size_t negatives;
+  _Atomic size_t false_positives;
+} FilterCounts;
+
+// A point-in-time view of the table, that scans can walk while writers keep
+// going. Every write stamps the version it makes with the stamp of the table,
+// which each new snapshot advances: a snapshot sees the newest version of
+// each pair with a stamp up to its own. While a snapshot may see a version,
+// writers leave it alone and make a new one instead of changing it in place.
+typedef struct Snapshot {
+  uint64_t stamp; // Versions written up to this stamp are visible
+  uint32_t now;   // Tick of the expiry clock when it was taken
+  struct Snapshot *prev, *next; // Snapshots in use, newest first
+} Snapshot;
+
 typedef struct HashTable {
-  KeyNode *table[TABLE_SIZE];
-  pthread_rwlock_t tablelock;
+  size_t num_shards;
+  Shard *shards;
+  // Current tick of the expiry clock, advanced by whoever expires the pairs
+  // with a TTL. Pairs past their tick are treated as missing until removed.
+  _Atomic uint32_t now;
+  // Stamp of the writes made now, only changes when a snapshot is taken (so
+  // writers share the cache line of the counter instead of fighting for it)
+  _Atomic uint64_t stamp;
+  _Atomic uint64_t newest_snapshot; // Stamp of the newest in use, 0 if none
+  // Stamp of the last checkpoint, 0 if none. A pair whose node has a newer
+  // stamp already had its key recorded as changed.
+  _Atomic uint64_t checkpoint;
+  pthread_mutex_t snapshots_lock;
+  Snapshot *snapshots;
+  // FILTER_STRIPES counts, each thread adds to the one of its stripe: readers
+  // of the same shard would fight over a shared counter on every miss
+  FilterCounts *filter_counts;
 } HashTable;
 
 
 /// Creates a new KVS hash table.
+/// @param num_shards Number of independently locked shards.
+/// @param max_memory Bytes the table may use (split evenly among the shards),
+/// 0 for no limit.
 /// @return Newly created hash table, NULL on failure
-struct HashTable *create_hash_table();
+struct HashTable *create_hash_table(size_t num_shards, size_t max_memory);
+
+/// Hashes a key (64-bit MurmurHash2).
+/// @param key The key.
+/// @return hash.
+uint64_t hash(const char *key);
+
+
+/// Grows the tables of the shards at once to hold a number of pairs more, so
+/// loading them does not resize the tables over and over. Takes the locks of
+/// the shards itself.
+/// @param ht The hash table.
+/// @param num_pairs Number of pairs about to be written.
+/// @return 0 if successful, 1 otherwise.
+int reserve_pairs(HashTable *ht, size_t num_pairs);
+
+/// Gets the shard a key belongs to.
+/// @param ht The hash table.
+/// @param key The key.
+/// @return Index of the shard.
+size_t shard_of(HashTable *ht, const char *key);
+
+/// Locks a set of shards. Shards are always locked in increasing order, so
+/// batches locking several shards cannot deadlock.
+/// @param ht The hash table.
+/// @param shards Indexes of the shards, sorted and deduplicated in place.
+/// @param count Number of indexes.
+/// @param write 1 to lock for writing, 0 for reading.
+/// @return Number of distinct shards locked.
+size_t lock_shards(HashTable *ht, size_t *shards, size_t count, int write);
+
+/// Unlocks a set of shards locked by lock_shards.
+/// @param ht The hash table.
+/// @param shards Indexes returned by lock_shards.
+/// @param count Number of distinct shards returned by lock_shards.
+void unlock_shards(HashTable *ht, const size_t *shards, size_t count);
+
+/// Locks every shard of the table, in increasing order.
+/// @param ht The hash table.
+/// @param write 1 to lock for writing, 0 for reading.
+void lock_all_shards(HashTable *ht, int write);
+
+/// Unlocks every shard of the table.
+/// @param ht The hash table.
+void unlock_all_shards(HashTable *ht);
 
-int hash(const char *key);
+/// Reads the sequence number of a shard for a lock-free read of a batch,
+/// waiting while a writer holds the shard.
+/// @param ht The hash table.
+/// @param shard Index of the shard.
+/// @return The sequence number, to be given to validate_shard.
+unsigned int read_begin_shard(HashTable *ht, size_t shard);
 
+/// Checks that a shard was not written since read_begin_shard.
+/// @param ht The hash table.
+/// @param shard Index of the shard.
+/// @param seq Sequence number returned by read_begin_shard.
+/// @return 1 if nothing changed, 0 if the reads have to be retried.
+int validate_shard(HashTable *ht, size_t shard, unsigned int seq);
+
+// key_exists, read_pair and scans need no lock. write_pair, incr_pair,
+// append_pair, cas_pair and delete_pair expect the caller to hold the write
+// lock of the shard of the key.
 
 int key_exists(HashTable *ht, const char *key);
 
 
-// Writes a key value pair in the hash table.
+// Writes a key value pair in the hash table. A large value in a blob is not
+// copied, the table takes a reference to the blob.
 // @param ht The hash table.
 // @param key The key.
 // @param value The value.
+// @param expires Tick when the pair expires, 0 if it never does.
 // @return 0 if successful.
-int write_pair(HashTable *ht, const char *key, const char *value);
+int write_pair(HashTable *ht, const char *key, const Value *value,
+               uint32_t expires);
+
+/// Adds to the integer value of a pair, in place if the result fits in its
+/// node. A missing key is taken as 0, a pair keeps its TTL.
+/// @param ht The hash table.
+/// @param key The key.
+/// @param delta Amount to add.
+/// @param result Pointer to store the new value in.
+/// @return 0 if successful, 1 if the value is not an integer, the result
+/// overflows or it could not be written.
+int incr_pair(HashTable *ht, const char *key, long long delta,
+              long long *result);
+
+/// Appends to the value of a pair, in place if the result fits in its node.
+/// A missing key is written with the suffix as its value, a pair keeps its
+/// TTL.
+/// @param ht The hash table.
+/// @param key The key.
+/// @param suffix Value to append.
+/// @return 0 if successful, 1 if the value would be longer than
+/// MAX_VALUE_SIZE or it could not be written.
+int append_pair(HashTable *ht, const char *key, const Value *suffix);
+
+/// Replaces the value of a pair if it is the expected one. The pair keeps its
+/// TTL.
+/// @param ht The hash table.
+/// @param key The key.
+/// @param expected Value the pair must have.
+/// @param value New value.
+/// @return 0 if the value was replaced, 1 if the key is missing, 2 if it has
+/// another value, -1 if it could not be written.
+int cas_pair(HashTable *ht, const char *key, const Value *expected,
+             const Value *value);
 
 // Reads the value of a given key.
 // @param ht The hash table.
 // @param key The key.
-// return the value if found, NULL otherwise.
-char *read_pair(HashTable *ht, const char *key);
+// @param len Pointer to store the length of the value in.
+// return a null terminated copy of the value if found, NULL otherwise.
+char *read_pair(HashTable *ht, const char *key, size_t *len);
+
+/// Reads the value of a given key without allocating memory. A small value
+/// is copied to a buffer, a large one is not copied: the caller gets a
+/// reference to its blob.
+/// @param ht The hash table.
+/// @param key The key.
+/// @param buffer Buffer of LARGE_VALUE_SIZE bytes for a small value.
+/// @param value Set to the value, the caller releases its blob (if any).
+/// @return 0 if the key was found, 1 otherwise.
+int read_pair_into(HashTable *ht, const char *key, char *buffer, Value *value);
+
+/// Gets the value of a node, with its shard locked or of a version seen by a
+/// scan. A small value is copied to a buffer, a large one is returned in
+/// place (valid while the shard is locked or the scan is in use). Does not
+/// allocate memory.
+/// @param keyNode The node.
+/// @param buffer Buffer of LARGE_VALUE_SIZE bytes for a small value.
+/// @param len Pointer to store the length of the value in.
+/// @return The value.
+const char *node_value(KeyNode *keyNode, char *buffer, size_t *len);
 
 /// Deletes a pair from the table.
 /// @param ht Hash table to read from.
@@ -46,6 +326,112 @@ char *read_pair(HashTable *ht, const char *key);
 /// @return 0 if the node was deleted successfully, 1 otherwise.
 int delete_pair(HashTable *ht, const char *key);
 
+/// Deletes a pair that expired, unless it was written again since. Expects
+/// the caller to hold the write lock of the shard of the key.
+/// @param ht Hash table to delete from.
+/// @param key Key of the pair.
+/// @param expires Tick the pair was set to expire at.
+/// @return 0 if the pair was deleted, 1 otherwise.
+int expire_pair(HashTable *ht, const char *key, uint32_t expires);
+
+/// Takes a snapshot of the table. Waits for the writers holding shards, but
+/// only for as long as it takes to read the stamp.
+/// @param ht The hash table.
+/// @param snapshot Snapshot to register, in use until snapshot_end.
+void snapshot_begin(HashTable *ht, Snapshot *snapshot);
+
+/// Takes a snapshot of the table like snapshot_begin, and runs a function
+/// while every shard is still locked, so it sees the table as the snapshot
+/// does.
+/// @param ht The hash table.
+/// @param snapshot Snapshot to register, in use until snapshot_end.
+/// @param locked Function run with every shard locked.
+/// @param arg Argument given to locked.
+void snapshot_begin_with(HashTable *ht, Snapshot *snapshot,
+                         void (*locked)(void *arg), void *arg);
+
+// Keys changed between two checkpoints, sorted and without duplicates.
+typedef struct Changes {
+  char **keys;
+  size_t count;
+  int complete; // 0 if some changes could not be recorded
+} Changes;
+
+/// Takes a snapshot of the table that is also a checkpoint: gets the keys
+/// written or removed since the previous checkpoint, and starts recording
+/// the changes made from now on.
+/// @param ht The hash table.
+/// @param snapshot Snapshot to register, in use until snapshot_end.
+/// @param changes Set to the keys changed since the previous checkpoint, none
+/// (and not complete) for the first one. Freed with changes_free.
+/// @return 0 if successful, 1 otherwise (then no snapshot is taken).
+int checkpoint_begin(HashTable *ht, Snapshot *snapshot, Changes *changes);
+
+/// Frees the keys of a checkpoint.
+/// @param changes The keys.
+void changes_free(Changes *changes);
+
+/// Stops using a snapshot, freeing the versions only it could still see.
+/// @param ht The hash table.
+/// @param snapshot The snapshot.
+void snapshot_end(HashTable *ht, Snapshot *snapshot);
+
+// Iterates the pairs of a key range of a snapshot in order, merging the
+// indexes of every shard. Needs no lock, the scan stays inside an epoch
+// critical section (see epoch.h) until scan_end.
+typedef struct Scan {
+  HashTable *ht;
+  const Snapshot *snapshot;
+  KeyNode **heap;  // Next node of each shard not yet exhausted, a min heap
+  size_t count;    // Number of nodes in the heap
+  const char *end; // Last key of the range (inclusive), NULL for no limit
+  char *const *keys; // Keys looked up instead of a range, NULL for a range
+  size_t num_keys;   // Keys not looked up yet
+} Scan;
+
+/// Starts iterating the pairs with start <= key <= end.
+/// @param ht Hash table to read from.
+/// @param scan Scan to initialize.
+/// @param snapshot Snapshot to read, in use until the scan ends.
+/// @param start First key of the range, NULL to start at the smallest key.
+/// @param end Last key of the range, NULL to go up to the largest key.
+/// @return 0 if successful, 1 otherwise.
+int scan_begin(HashTable *ht, Scan *scan, const Snapshot *snapshot,
+               const char *start, const char *end);
+
+/// Starts iterating the pairs of a list of keys, in the order of the list.
+/// @param ht Hash table to read from.
+/// @param scan Scan to initialize.
+/// @param snapshot Snapshot to read, in use until the scan ends.
+/// @param keys The keys, in use until the scan ends.
+/// @param num_keys Number of keys.
+void scan_keys_begin(HashTable *ht, Scan *scan, const Snapshot *snapshot,
+                     char *const *keys, size_t num_keys);
+
+/// Gets the next pair of a scan, skipping expired pairs (and the missing
+/// keys of a list). Does not allocate
+/// memory, so it can be used in a child process after a fork.
+/// @param scan The scan.
+/// @return The version of the pair seen by the snapshot, NULL once the range
+/// is over.
+KeyNode *scan_next(Scan *scan);
+
+/// Frees the memory of a scan.
+/// @param scan The scan.
+void scan_end(Scan *scan);
+
+// Lookups of keys missing from the table, since it was created.
+typedef struct FilterStats {
+  size_t negatives;       // Answered by the Bloom filters alone
+  size_t false_positives; // Passed a filter but were not in the table
+} FilterStats;
+
+/// Gets the statistics of the Bloom filters of the table. Needs no lock, the
+/// counts of lookups running meanwhile may be left out.
+/// @param ht The hash table.
+/// @param stats Set to the sums of the counts of every stripe.
+void filter_stats(HashTable *ht, FilterStats *stats);
+
 /// Frees the hashtable.
 /// @param ht Hash table to be deleted.
 void free_table(HashTable *ht);
@@ -0,0 +1,279 @@
+#include "load.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+int backup_file_map(const char *path, BackupFile *file) {
+  *file = (BackupFile){NULL, 0, 0, NULL};
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) {
+    fprintf(stderr, "Failed to open %s: %s\n", path, strerror(errno));
+    return 1;
+  }
+  struct stat st;
+  if (fstat(fd, &st) != 0) {
+    fprintf(stderr, "Failed to stat %s: %s\n", path, strerror(errno));
+    close(fd);
+    return 1;
+  }
+  file->size = (size_t)st.st_size;
+  if (file->size > 0) {
+    void *data = mmap(NULL, file->size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (data == MAP_FAILED) {
+      fprintf(stderr, "Failed to map %s: %s\n", path, strerror(errno));
+      close(fd);
+      return 1;
+    }
+    file->data = data;
+    // The lines are parsed by several threads at once, all of it is needed
+    posix_madvise(file->data, file->size, POSIX_MADV_WILLNEED);
+  }
+  close(fd);
+
+  if (file->size >= 6 && memcmp(file->data, "DELTA ", 6) == 0) {
+    const char *end = memchr(file->data, '\n', file->size);
+    if (end == NULL) {
+      fprintf(stderr, "Invalid header of %s\n", path);
+      backup_file_unmap(file);
+      return 1;
+    }
+    file->start = (size_t)(end - file->data) + 1;
+
+    const char *name = file->data + 6;
+    size_t name_len = (size_t)(end - name);
+    const char *slash = strrchr(path, '/');
+    size_t dir_len = slash != NULL ? (size_t)(slash - path) + 1 : 0;
+    file->base = malloc(dir_len + name_len + 1);
+    if (file->base == NULL) {
+      backup_file_unmap(file);
+      return 1;
+    }
+    memcpy(file->base, path, dir_len);
+    memcpy(file->base + dir_len, name, name_len);
+    file->base[dir_len + name_len] = '\0';
+  }
+  return 0;
+}
+
+void backup_file_unmap(BackupFile *file) {
+  if (file->data != NULL) {
+    munmap(file->data, file->size);
+  }
+  free(file->base);
+  *file = (BackupFile){NULL, 0, 0, NULL};
+}
+
+int backup_chain_map(const char *path, BackupChain *chain) {
+  chain->length = 0;
+  chain->files = malloc(BACKUP_MAX_CHAIN * sizeof(BackupFile));
+  if (chain->files == NULL) {
+    return 1;
+  }
+  const char *next = path;
+  while (next != NULL) {
+    if (chain->length == BACKUP_MAX_CHAIN) {
+      fprintf(stderr, "Chain of deltas of %s too long\n", path);
+      backup_chain_unmap(chain);
+      return 1;
+    }
+    if (backup_file_map(next, &chain->files[chain->length]) != 0) {
+      backup_chain_unmap(chain);
+      return 1;
+    }
+    next = chain->files[chain->length++].base;
+  }
+  return 0;
+}
+
+void backup_chain_unmap(BackupChain *chain) {
+  for (size_t i = 0; i < chain->length; i++) {
+    backup_file_unmap(&chain->files[i]);
+  }
+  free(chain->files);
+  *chain = (BackupChain){NULL, 0};
+}
+
+/// Parses an encoded string with a "$<length>:" prefix.
+/// @param pos Position of the '$', set to the end of the string.
+/// @return 0 if successful, 1 otherwise.
+static int parse_prefixed(const BackupFile *file, size_t *pos,
+                          const char **str, size_t *len) {
+  const char *data = file->data;
+  size_t size = file->size;
+  size_t i = *pos + 1;
+  size_t n = 0;
+  for (; i < size && data[i] >= '0' && data[i] <= '9'; i++) {
+    n = n * 10 + (size_t)(data[i] - '0');
+  }
+  if (i >= size || data[i] != ':' || size - i - 1 < n) {
+    return 1;
+  }
+  *str = data + i + 1;
+  *len = n;
+  *pos = i + 1 + n;
+  return 0;
+}
+
+size_t backup_file_parse(const BackupFile *file, size_t pos,
+                         BackupLine *line) {
+  const char *data = file->data;
+  size_t size = file->size;
+  if (pos >= size || data[pos] != '(') {
+    return 0;
+  }
+  pos++;
+
+  // Without a prefix, a string has none of the delimiters, so it ends at the
+  // first one: found with memchr, which is much faster than a loop
+  if (pos < size && data[pos] == '$') {
+    if (parse_prefixed(file, &pos, &line->key, &line->key_len)) {
+      return 0;
+    }
+  } else {
+    const char *close = memchr(data + pos, ')', size - pos);
+    if (close == NULL) {
+      return 0;
+    }
+    const char *comma = memchr(data + pos, ',', (size_t)(close - data) - pos);
+    const char *end = comma != NULL ? comma : close;
+    line->key = data + pos;
+    line->key_len = (size_t)(end - line->key);
+    pos = (size_t)(end - data);
+  }
+
+  line->value = NULL;
+  line->value_len = 0;
+  if (pos < size && data[pos] == ',') {
+    if (size - pos < 2 || data[pos + 1] != ' ') {
+      return 0;
+    }
+    pos += 2;
+    if (pos < size && data[pos] == '$') {
+      if (parse_prefixed(file, &pos, &line->value, &line->value_len)) {
+        return 0;
+      }
+    } else {
+      const char *close = memchr(data + pos, ')', size - pos);
+      if (close == NULL) {
+        return 0;
+      }
+      line->value = data + pos;
+      line->value_len = (size_t)(close - line->value);
+      pos = (size_t)(close - data);
+    }
+  }
+
+  if (pos >= size || data[pos] != ')') {
+    return 0;
+  }
+  pos++;
+
+  line->expires_ms = 0;
+  if (line->value != NULL && pos < size && data[pos] == ' ') {
+    size_t digits = 0;
+    for (pos++; pos < size && data[pos] >= '0' && data[pos] <= '9'; pos++) {
+      line->expires_ms = line->expires_ms * 10 + (uint64_t)(data[pos] - '0');
+      digits++;
+    }
+    // Up to 19 digits always fit
+    if (digits == 0 || digits > 19) {
+      return 0;
+    }
+  }
+
+  if (pos >= size || data[pos] != '\n') {
+    return 0;
+  }
+  return pos + 1;
+}
+
+// A backup found in a directory
+typedef struct Candidate {
+  char *path;
+  struct timespec taken;
+} Candidate;
+
+// Newest first, backups taken within the same tick of the clock go by name.
+static int compare_candidates(const void *a, const void *b) {
+  const Candidate *x = a, *y = b;
+  if (x->taken.tv_sec != y->taken.tv_sec) {
+    return x->taken.tv_sec < y->taken.tv_sec ? 1 : -1;
+  }
+  if (x->taken.tv_nsec != y->taken.tv_nsec) {
+    return x->taken.tv_nsec < y->taken.tv_nsec ? 1 : -1;
+  }
+  return -strcmp(x->path, y->path);
+}
+
+int backup_file_latest(const char *directory, char *path, size_t size) {
+  DIR *dir = opendir(directory);
+  if (dir == NULL) {
+    fprintf(stderr, "Failed to open directory: %s\n", directory);
+    return 1;
+  }
+
+  Candidate *candidates = NULL;
+  size_t count = 0, capacity = 0;
+  int failed = 0;
+  struct dirent *entry;
+  while (!failed && (entry = readdir(dir)) != NULL) {
+    size_t len = strlen(entry->d_name);
+    // Backups still being written end in ".bck.tmp", they are left out
+    if (len <= 4 || strcmp(entry->d_name + len - 4, ".bck") != 0) {
+      continue;
+    }
+    char candidate[PATH_MAX];
+    struct stat st;
+    if (snprintf(candidate, sizeof(candidate), "%s/%s", directory,
+                 entry->d_name) >= (int)sizeof(candidate) ||
+        strlen(candidate) >= size || stat(candidate, &st) != 0 ||
+        !S_ISREG(st.st_mode)) {
+      continue;
+    }
+    if (count == capacity) {
+      capacity = capacity > 0 ? capacity * 2 : 16;
+      Candidate *grown = realloc(candidates, capacity * sizeof(Candidate));
+      if (grown == NULL) {
+        failed = 1;
+        break;
+      }
+      candidates = grown;
+    }
+    if ((candidates[count].path = strdup(candidate)) == NULL) {
+      failed = 1;
+      break;
+    }
+    candidates[count++].taken = st.st_mtim;
+  }
+  closedir(dir);
+
+  int found = 0;
+  if (!failed) {
+    qsort(candidates, count, sizeof(Candidate), compare_candidates);
+  }
+  for (size_t i = 0; !failed && !found && i < count; i++) {
+    BackupChain chain;
+    if (backup_chain_map(candidates[i].path, &chain) != 0) {
+      fprintf(stderr, "Passing over backup %s, its chain is incomplete\n",
+              candidates[i].path);
+      continue;
+    }
+    backup_chain_unmap(&chain);
+    strcpy(path, candidates[i].path);
+    found = 1;
+  }
+
+  for (size_t i = 0; i < count; i++) {
+    free(candidates[i].path);
+  }
+  free(candidates);
+  return !found;
+}
@@ -0,0 +1,82 @@
+#ifndef KVS_LOAD_H
+#define KVS_LOAD_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Reading of the backups back, to start the server with the pairs of its
+// latest backup. A backup is mapped in memory and its lines are parsed in
+// place, without copying them.
+//
+// A line of a backup is "(key, value)" and a key removed by a delta is
+// "(key)", with the keys and values encoded as the server writes them (a
+// "$<length>:" prefix when they have delimiters). A pair with a TTL is
+// "(key, value) <ms>", ms being the wall clock time it expires at, in
+// milliseconds since the epoch. A delta starts with a "DELTA <base>" line,
+// the base being next to it.
+
+// Longest chain of deltas followed, in case the headers make a loop
+#define BACKUP_MAX_CHAIN 4096
+
+typedef struct BackupFile {
+  char *data; // The whole file, mapped read only
+  size_t size;
+  size_t start; // Where the lines start, after the header of a delta
+  char *base;   // Path of the backup a delta applies to, NULL if full
+} BackupFile;
+
+// A backup and the ones it applies to: files[0] is the backup, each next one
+// the base of the previous, files[length - 1] the full backup
+typedef struct BackupChain {
+  BackupFile *files;
+  size_t length;
+} BackupChain;
+
+typedef struct BackupLine {
+  const char *key; // Not null terminated, points into the file
+  size_t key_len;
+  const char *value; // Points into the file, NULL for a key removed
+  size_t value_len;
+  uint64_t expires_ms; // When the pair expires (see above), 0 if never
+} BackupLine;
+
+/// Maps a backup in memory and reads its header.
+/// @param path Path of the backup.
+/// @param file Set to the backup mapped.
+/// @return 0 if successful, 1 otherwise.
+int backup_file_map(const char *path, BackupFile *file);
+
+/// Unmaps a backup mapped by backup_file_map.
+/// @param file The backup.
+void backup_file_unmap(BackupFile *file);
+
+/// Maps a backup and every backup of its chain of deltas.
+/// @param path Path of the backup.
+/// @param chain Set to the backups mapped.
+/// @return 0 if successful, 1 if a backup of the chain is missing or invalid.
+int backup_chain_map(const char *path, BackupChain *chain);
+
+/// Unmaps the backups mapped by backup_chain_map.
+/// @param chain The chain.
+void backup_chain_unmap(BackupChain *chain);
+
+/// Parses the line of a backup that starts at a position.
+/// @param file The backup.
+/// @param pos Where the line starts.
+/// @param line Set to the parts of the line.
+/// @return Where the next line starts, 0 if the line is not valid.
+size_t backup_file_parse(const BackupFile *file, size_t pos,
+                         BackupLine *line);
+
+/// Finds the latest backup written in a directory whose chain is complete.
+/// The backups are ordered by when their snapshots were taken, which the
+/// server sets as their modification time: they are written in parallel and
+/// may end in any order. A delta whose base was never written, by a crash,
+/// is passed over for an older backup.
+/// @param directory The directory.
+/// @param path Buffer to store the path of the backup in.
+/// @param size Size of the buffer.
+/// @return 0 if a backup was found, 1 otherwise.
+int backup_file_latest(const char *directory, char *path, size_t size);
+
+#endif // KVS_LOAD_H
@@ -5,20 +5,26 @@
 #include <stdlib.h>
 #include <string.h>
 #include <sys/types.h>
-#include <sys/wait.h>
 #include <unistd.h>
 #include <pthread.h>
 #include <sys/stat.h> // Include for mkfifo
 #include <signal.h>   // Include for signal handling
+#include <errno.h>
+#include <poll.h>
 
 #include "kvs.h"
+#include "slab.h"
 #include "constants.h"
 #include "io.h"
+#include "jobc.h"
+#include "load.h"
 #include "operations.h"
 #include "parser.h"
+#include "ring.h"
 #include "src/common/protocol.h"
 #include "src/common/constants.h"
 #include "src/client/api.h"
+#include "src/common/io.h"
 
 
 struct SharedData {
@@ -36,7 +42,7 @@ struct ClientData {
   char notif_pipe_path[40];
   int active;
   pthread_t thread;
-  char subscribed_keys[MAX_NUMBER_SUB][MAX_STRING_SIZE];
+  char subscribed_keys[MAX_NUMBER_SUB][MAX_KEY_SIZE];
   int num_subscribed_keys;
 };
 
@@ -45,11 +51,11 @@ size_t num_clients = 0;
 pthread_mutex_t clients_mutex = PTHREAD_MUTEX_INITIALIZER;
 
 pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
-pthread_mutex_t n_current_backups_lock = PTHREAD_MUTEX_INITIALIZER;
 void *kvs_table = NULL; // Declare kvs_table
 
-size_t active_backups = 0; // Number of active backups
-size_t max_backups;        // Maximum allowed simultaneous backups
+size_t max_backups;   // Maximum allowed simultaneous backups
+int fork_backups = 0; // Whether backups fork a process, see kvs_backup
+int pipeline_jobs = 0; // Whether text jobs are parsed ahead by a thread
 size_t max_threads;        // Maximum allowed simultaneous threads
 char *jobs_directory = NULL;
 
@@ -115,19 +121,24 @@ void handle_sigusr1(int sig) {
 
 int filter_job_files(const struct dirent *entry) {
   const char *dot = strrchr(entry->d_name, '.');
-  if (dot != NULL && strcmp(dot, ".job") == 0) {
-    return 1; // Keep this file (it has the .job extension)
+  if (dot != NULL &&
+      (strcmp(dot, ".job") == 0 || strcmp(dot, ".jobc") == 0)) {
+    return 1; // Keep this file (it has the .job or .jobc extension)
   }
   return 0;
 }
 
+// A job is either text (.job) or compiled by kvs-jobc (.jobc), both write
+// their output to a .out file. A text job compiled next to it is only run
+// compiled: both would write the same .out and .bck files.
 static int entry_files(const char *dir, struct dirent *entry, char *in_path,
-                       char *out_path) {
+                       char *out_path, int *compiled) {
   const char *dot = strrchr(entry->d_name, '.');
-  if (dot == NULL || dot == entry->d_name || strlen(dot) != 4 ||
-      strcmp(dot, ".job")) {
+  if (dot == NULL || dot == entry->d_name ||
+      (strcmp(dot, ".job") && strcmp(dot, ".jobc"))) {
     return 1;
   }
+  *compiled = dot[4] == 'c';
 
   if (strlen(entry->d_name) + strlen(dir) + 2 > MAX_JOB_FILE_NAME_SIZE) {
     fprintf(stderr, "%s/%s\n", dir, entry->d_name);
@@ -138,120 +149,250 @@ static int entry_files(const char *dir, struct dirent *entry, char *in_path,
   strcat(in_path, "/");
   strcat(in_path, entry->d_name);
 
+  if (!*compiled && strlen(in_path) + 2 <= MAX_JOB_FILE_NAME_SIZE) {
+    strcat(in_path, "c");
+    int has_compiled = access(in_path, F_OK) == 0;
+    in_path[strlen(in_path) - 1] = '\0';
+    if (has_compiled) {
+      return 1;
+    }
+  }
+
   strcpy(out_path, in_path);
   strcpy(strrchr(out_path, '.'), ".out");
 
   return 0;
 }
 
-static int run_job(int in_fd, int out_fd, char *filename) {
-  size_t file_backups = 0;
-  while (1) {
-    char keys[MAX_WRITE_SIZE][MAX_STRING_SIZE] = {0};
-    char values[MAX_WRITE_SIZE][MAX_STRING_SIZE] = {0};
-    unsigned int delay;
-    size_t num_pairs;
-
-    switch (get_next(in_fd)) {
-    case CMD_WRITE:
-      num_pairs =
-          parse_write(in_fd, keys, values, MAX_WRITE_SIZE, MAX_STRING_SIZE);
-      if (num_pairs == 0) {
-        write_str(STDERR_FILENO, "Invalid command. See HELP for usage\n");
-        continue;
-      }
+// Runs a command of a job.
+// @param command The command, parsed or decoded.
+// @param file_backups Number of backups the job asked for so far.
+// @return 0 to go on with the job, 1 once it ended, 2 if the process must
+// exit (the child of a backup).
+static int run_command(const JobCommand *command, int out_fd, char *filename,
+                       size_t *file_backups) {
+  size_t num_pairs = command->num_keys;
+  char **keys = command->keys;
+  switch (command->command) {
+  case CMD_WRITE:
+    if (kvs_write(num_pairs, keys, command->values, 0, out_fd)) {
+      write_str(STDERR_FILENO, "Failed to write pair\n");
+    }
+    break;
 
-      if (kvs_write(num_pairs, keys, values)) {
-        write_str(STDERR_FILENO, "Failed to write pair\n");
-      }
-      break;
+  case CMD_WRITE_TTL:
+    if (kvs_write(num_pairs, keys, command->values, command->number,
+                  out_fd)) {
+      write_str(STDERR_FILENO, "Failed to write pair\n");
+    }
+    break;
 
-    case CMD_READ:
-      num_pairs =
-          parse_read_delete(in_fd, keys, MAX_WRITE_SIZE, MAX_STRING_SIZE);
+  case CMD_INCR:
+    if (kvs_incr(num_pairs, keys, command->values, out_fd)) {
+      write_str(STDERR_FILENO, "Failed to increment pair\n");
+    }
+    break;
 
-      if (num_pairs == 0) {
-        write_str(STDERR_FILENO, "Invalid command. See HELP for usage\n");
-        continue;
-      }
+  case CMD_APPEND:
+    if (kvs_append(num_pairs, keys, command->values, out_fd)) {
+      write_str(STDERR_FILENO, "Failed to append to pair\n");
+    }
+    break;
 
-      if (kvs_read(num_pairs, keys, out_fd)) {
-        write_str(STDERR_FILENO, "Failed to read pair\n");
-      }
-      break;
+  case CMD_CAS:
+    if (kvs_cas(num_pairs, keys, command->values, out_fd)) {
+      write_str(STDERR_FILENO, "Failed to compare and swap pair\n");
+    }
+    break;
 
-    case CMD_DELETE:
-      num_pairs =
-          parse_read_delete(in_fd, keys, MAX_WRITE_SIZE, MAX_STRING_SIZE);
+  case CMD_READ:
+    if (kvs_read(num_pairs, keys, out_fd)) {
+      write_str(STDERR_FILENO, "Failed to read pair\n");
+    }
+    break;
 
-      if (num_pairs == 0) {
-        write_str(STDERR_FILENO, "Invalid command. See HELP for usage\n");
-        continue;
-      }
+  case CMD_DELETE:
+    if (kvs_delete(num_pairs, keys, out_fd)) {
+      write_str(STDERR_FILENO, "Failed to delete pair\n");
+    }
+    break;
 
-      if (kvs_delete(num_pairs, keys, out_fd)) {
-        write_str(STDERR_FILENO, "Failed to delete pair\n");
-      }
-      break;
+  case CMD_SHOW:
+    kvs_show(out_fd);
+    break;
 
-    case CMD_SHOW:
-      kvs_show(out_fd);
-      break;
+  case CMD_SCAN:
+    if (kvs_scan(keys[0], keys[1], out_fd)) {
+      write_str(STDERR_FILENO, "Failed to scan pairs\n");
+    }
+    break;
 
-    case CMD_WAIT:
-      if (parse_wait(in_fd, &delay, NULL) == -1) {
-        write_str(STDERR_FILENO, "Invalid command. See HELP for usage\n");
-        continue;
-      }
+  case CMD_STATS:
+    kvs_stats(out_fd);
+    break;
 
-      if (delay > 0) {
-        printf("Waiting %d seconds\n", delay / 1000);
-        kvs_wait(delay);
-      }
-      break;
+  case CMD_WAIT:
+    if (command->number > 0) {
+      printf("Waiting %d seconds\n", command->number / 1000);
+      kvs_wait(command->number);
+    }
+    break;
 
-    case CMD_BACKUP:
-      pthread_mutex_lock(&n_current_backups_lock);
-      if (active_backups >= max_backups) {
-        wait(NULL);
-      } else {
-        active_backups++;
-      }
-      pthread_mutex_unlock(&n_current_backups_lock);
-      int aux = kvs_backup(++file_backups, filename, jobs_directory);
+  case CMD_BACKUP: {
+    // Never waits, the backup threads limit the backups in progress
+    int aux = kvs_backup(++*file_backups, filename, jobs_directory);
 
-      if (aux < 0) {
-        write_str(STDERR_FILENO, "Failed to do backup\n");
-      } else if (aux == 1) {
-        return 1;
-      }
-      break;
+    if (aux < 0) {
+      write_str(STDERR_FILENO, "Failed to do backup\n");
+    } else if (aux == 1) {
+      return 2;
+    }
+    break;
+  }
 
-    case CMD_INVALID:
-      write_str(STDERR_FILENO, "Invalid command. See HELP for usage\n");
-      break;
+  case CMD_INVALID:
+    write_str(STDERR_FILENO, "Invalid command. See HELP for usage\n");
+    break;
+
+  case CMD_HELP:
+    write_str(STDOUT_FILENO,
+              "Available commands:\n"
+              "  WRITE [(key,value)(key2,value2),...]\n"
+              "  WRITETTL <ttl_ms> [(key,value)(key2,value2),...]\n"
+              "  INCR [(key,delta)(key2,delta2),...]\n"
+              "  APPEND [(key,suffix)(key2,suffix2),...]\n"
+              "  CAS [(key,expected,value)(key2,expected2,value2),...]\n"
+              "  READ [key,key2,...]\n"
+              "  DELETE [key,key2,...]\n"
+              "  SHOW\n"
+              "  SCAN [start,end]\n"
+              "  STATS\n"
+              "  WAIT <delay_ms>\n"
+              "  BACKUP\n" // Not implemented
+              "  HELP\n"
+              "Keys and values with delimiters (or longer ones) may be\n"
+              "given as $<length>:<bytes>\n");
+
+    break;
+
+  case CMD_EMPTY:
+    break;
+
+  case EOC:
+    printf("EOF\n");
+    return 1;
+  }
+  return 0;
+}
 
-    case CMD_HELP:
-      write_str(STDOUT_FILENO,
-                "Available commands:\n"
-                "  WRITE [(key,value)(key2,value2),...]\n"
-                "  READ [key,key2,...]\n"
-                "  DELETE [key,key2,...]\n"
-                "  SHOW\n"
-                "  WAIT <delay_ms>\n"
-                "  BACKUP\n" // Not implemented
-                "  HELP\n");
+// Runs a text job, parsing each command.
+// @return 0 once the job ended, 1 if the process must exit.
+static int run_job(JobReader *reader, int out_fd, char *filename,
+                   Args *args) {
+  size_t file_backups = 0;
+  JobCommand command;
+  int result;
+  do {
+    parse_command(reader, args, &command);
+  } while ((result = run_command(&command, out_fd, filename,
+                                 &file_backups)) == 0);
+  return result - 1;
+}
 
+// The stages of a pipelined job
+typedef struct PipelinedJob {
+  CommandRing ring;
+  JobReader *reader;
+  pthread_t parser;
+} PipelinedJob;
+
+// Parser stage of a pipelined job, fills the ring up to the end of the job.
+static void *parse_ahead(void *arg) {
+  PipelinedJob *job = arg;
+  CommandSlot *slot;
+  while ((slot = ring_claim(&job->ring)) != NULL) {
+    parse_command(job->reader, &slot->args, &slot->command);
+    enum Command command = slot->command.command;
+    ring_publish(&job->ring);
+    if (command == EOC) {
       break;
+    }
+  }
+  return NULL;
+}
 
-    case CMD_EMPTY:
-      break;
+// Runs a text job with a thread of its own parsing the next commands while
+// one runs, so the time to parse a command overlaps the time the last one
+// waits for its locks. Commands still run one at a time in order, but
+// adjacent WRITEs already parsed run as one batch (of up to MAX_WRITE_SIZE
+// pairs), which takes the locks of its shards and logs once. A later pair
+// of a key overwrites an earlier one, as if they had run one by one.
+// @return 0 once the job ended, 1 if the process must exit.
+static int run_pipelined_job(JobReader *reader, int out_fd, char *filename,
+                             Args *args) {
+  PipelinedJob *job = malloc(sizeof(PipelinedJob));
+  if (job == NULL || ring_init(&job->ring) != 0) {
+    free(job);
+    return run_job(reader, out_fd, filename, args);
+  }
+  job->reader = reader;
+  if (pthread_create(&job->parser, NULL, parse_ahead, job) != 0) {
+    ring_destroy(&job->ring);
+    free(job);
+    return run_job(reader, out_fd, filename, args);
+  }
 
-    case EOC:
-      printf("EOF\n");
-      return 0;
+  size_t file_backups = 0;
+  char *keys[MAX_WRITE_SIZE];
+  Value values[MAX_WRITE_SIZE];
+  int result = 0;
+  while (result == 0) {
+    CommandSlot *slot = ring_front(&job->ring);
+    JobCommand command = slot->command;
+    size_t count = 1;
+    CommandSlot *next;
+    while (command.command == CMD_WRITE &&
+           (next = ring_peek(&job->ring, count)) != NULL &&
+           next->command.command == CMD_WRITE &&
+           command.num_keys + next->command.num_keys <= MAX_WRITE_SIZE) {
+      if (count == 1) {
+        memcpy(keys, command.keys, command.num_keys * sizeof(char *));
+        memcpy(values, command.values, command.num_keys * sizeof(Value));
+        command.keys = keys;
+        command.values = values;
+      }
+      memcpy(keys + command.num_keys, next->command.keys,
+             next->command.num_keys * sizeof(char *));
+      memcpy(values + command.num_keys, next->command.values,
+             next->command.num_keys * sizeof(Value));
+      command.num_keys += next->command.num_keys;
+      count++;
     }
+    result = run_command(&command, out_fd, filename, &file_backups);
+    ring_release(&job->ring, count);
   }
+
+  ring_stop(&job->ring);
+  pthread_join(job->parser, NULL);
+  ring_destroy(&job->ring);
+  free(job);
+  return result - 1;
+}
+
+// Runs a compiled job, its commands are used as they are in the file.
+// @return 0 once the job ended, 1 if the process must exit.
+static int run_compiled_job(JobcReader *reader, int out_fd, char *filename) {
+  size_t file_backups = 0;
+  JobCommand command;
+  int result;
+  do {
+    if (jobc_next(reader, &command) != 0) {
+      write_str(STDERR_FILENO, "Invalid compiled job, it ends here\n");
+      command.command = EOC;
+    }
+  } while ((result = run_command(&command, out_fd, filename,
+                                 &file_backups)) == 0);
+  return result - 1;
 }
 
 // frees arguments
@@ -268,7 +409,8 @@ static void *get_file(void *arguments) {
   struct dirent *entry;
   char in_path[MAX_JOB_FILE_NAME_SIZE], out_path[MAX_JOB_FILE_NAME_SIZE];
   while ((entry = readdir(dir)) != NULL) {
-    if (entry_files(dir_name, entry, in_path, out_path)) {
+    int compiled;
+    if (entry_files(dir_name, entry, in_path, out_path, &compiled)) {
       continue;
     }
 
@@ -285,6 +427,19 @@ static void *get_file(void *arguments) {
       pthread_exit(NULL);
     }
 
+    JobcReader compiled_reader;
+    if (compiled && jobc_open(&compiled_reader, in_fd) != 0) {
+      write_str(STDERR_FILENO, "Not a compiled job: ");
+      write_str(STDERR_FILENO, in_path);
+      write_str(STDERR_FILENO, "\n");
+      close(in_fd);
+      if (pthread_mutex_lock(&thread_data->directory_mutex) != 0) {
+        fprintf(stderr, "Thread failed to lock directory_mutex\n");
+        return NULL;
+      }
+      continue;
+    }
+
     int out_fd = open(out_path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
     if (out_fd == -1) {
       write_str(STDERR_FILENO, "Failed to open output file: ");
@@ -293,7 +448,23 @@ static void *get_file(void *arguments) {
       pthread_exit(NULL);
     }
 
-    int out = run_job(in_fd, out_fd, entry->d_name);
+    int out;
+    if (compiled) {
+      out = run_compiled_job(&compiled_reader, out_fd, entry->d_name);
+      jobc_close(&compiled_reader);
+    } else {
+      Args args;
+      JobReader reader;
+      if (args_init(&args) != 0 || reader_init(&reader, in_fd) != 0) {
+        write_str(STDERR_FILENO, "Failed to allocate the job buffers\n");
+        pthread_exit(NULL);
+      }
+      out = pipeline_jobs
+                ? run_pipelined_job(&reader, out_fd, entry->d_name, &args)
+                : run_job(&reader, out_fd, entry->d_name, &args);
+      reader_destroy(&reader);
+      args_destroy(&args);
+    }
 
     close(in_fd);
     close(out_fd);
@@ -396,6 +567,22 @@ int remove_client(const char *req_pipe_path) {
 }
 
 
+// Reads the key of a request: its length (a uint32_t) and its bytes.
+// @param fd File descriptor of the request pipe.
+// @param key Buffer of MAX_KEY_SIZE bytes, the key is null terminated.
+// @return 0 if successful, 1 otherwise.
+static int read_request_key(int fd, char *key) {
+  uint32_t len;
+  if (read_all(fd, &len, sizeof(len), NULL) != 1 || len >= MAX_KEY_SIZE ||
+      read_all(fd, key, len, NULL) != 1) {
+    fprintf(stderr, "Invalid key in request\n");
+    return 1;
+  }
+  key[len] = '\0';
+  // Keys are null terminated strings
+  return strlen(key) != len;
+}
+
 void *client_handler(void *arg) {
   struct ClientData *client_data = (struct ClientData *)arg;
   sigset_t set;
@@ -422,29 +609,20 @@ void *client_handler(void *arg) {
   client_data->notif_fd = notif_fd;
 
 
-  char buffer[128];
   while (1) {
 
 
-    ssize_t bytes_read = read(req_fd, buffer, sizeof(buffer) - 1);
+    char op_code;
+    ssize_t bytes_read = read(req_fd, &op_code, 1);
 
     if (bytes_read > 0) {
-      buffer[bytes_read] = '\0';
-      char op_code = buffer[0];
       int result = 1;
       switch (op_code) {
         case OP_CODE_SUBSCRIBE: {
-          char key[MAX_STRING_SIZE];
-          strncpy(key, buffer + 1, MAX_STRING_SIZE - 1);
-          key[MAX_STRING_SIZE - 1] = '\0'; // Garantir que a chave é terminada com '\0'
-
-          // Remover espaços em branco adicionais
-          for (int i = strlen(key) - 1; i >= 0 && key[i] == ' '; i--) {
-            key[i] = '\0';
-          }
+          char key[MAX_KEY_SIZE];
 
           // Check if key exists in the kvs table
-          if (key_exists(kvs_table, key)) {
+          if (read_request_key(req_fd, key) == 0 && kvs_key_exists(key)) {
             result = 1;
             for (int i = 0; i < client_data->num_subscribed_keys; i++) {
               if (strcmp(client_data->subscribed_keys[i], key) == 0) {
@@ -454,7 +632,7 @@ void *client_handler(void *arg) {
             }
 
             if (result == 1 && client_data->num_subscribed_keys < MAX_NUMBER_SUB) {
-              strncpy(client_data->subscribed_keys[client_data->num_subscribed_keys], key, MAX_STRING_SIZE);
+              strcpy(client_data->subscribed_keys[client_data->num_subscribed_keys], key);
               client_data->num_subscribed_keys++;
             }
           } else {
@@ -478,22 +656,17 @@ void *client_handler(void *arg) {
 
 
       case OP_CODE_UNSUBSCRIBE: {
-          char key[MAX_STRING_SIZE];
-          strncpy(key, buffer + 1, MAX_STRING_SIZE - 1);
-          key[MAX_STRING_SIZE - 1] = '\0'; // Garantir que a chave é terminada com '\0'
+          char key[MAX_KEY_SIZE];
 
-          // Remover espaços em branco adicionais
-          for (int i = strlen(key) - 1; i >= 0 && key[i] == ' '; i--) {
-            key[i] = '\0';
-          }
+          int valid = read_request_key(req_fd, key) == 0;
 
           // Remove subscription
           result = 1; // Inicialmente assume que a subscrição não existia
-          for (int i = 0; i < client_data->num_subscribed_keys; i++) {
+          for (int i = 0; valid && i < client_data->num_subscribed_keys; i++) {
             if (strcmp(client_data->subscribed_keys[i], key) == 0) {
               result = 0; // Subscrição existia e foi removida
               for (int j = i; j < client_data->num_subscribed_keys - 1; j++) {
-                strncpy(client_data->subscribed_keys[j], client_data->subscribed_keys[j + 1], MAX_STRING_SIZE);
+                strcpy(client_data->subscribed_keys[j], client_data->subscribed_keys[j + 1]);
               }
               client_data->num_subscribed_keys--;
               break;
@@ -650,15 +823,58 @@ void *client_listener(void *arg) {
         return NULL;
     }
 
-void notify_clients(const char *key, const char *value) {
+// Writes a notification to a client. The pipe does not block, so a client
+// that stopped reading does not stall the writers: a notification that does
+// not fit is dropped, unless part of it was already written, in which case
+// it waits (a little) for the client to make room for the rest.
+// @return 0 if the notification was written, 1 otherwise.
+static int write_notification(int fd, const char *notification, size_t len) {
+  size_t written = 0;
+  while (written < len) {
+    ssize_t result = write(fd, notification + written, len - written);
+    if (result >= 0) {
+      written += (size_t)result;
+      continue;
+    }
+    if (errno == EINTR) {
+      continue;
+    }
+
+    struct pollfd pfd = {.fd = fd, .events = POLLOUT, .revents = 0};
+    if ((errno != EAGAIN && errno != EWOULDBLOCK) || written == 0 ||
+        poll(&pfd, 1, NOTIFICATION_TIMEOUT_MS) <= 0) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+void notify_clients(const char *key, const char *value, size_t len) {
     pthread_mutex_lock(&clients_mutex);
 
+    char *notification = NULL;
+    size_t size = 0;
     for (size_t i = 0; i < num_clients; i++) {
         for (int j = 0; j < clients[i].num_subscribed_keys; j++) {
             if (strcmp(clients[i].subscribed_keys[j], key) == 0) {
-                char notification[MAX_STRING_SIZE * 2 + 3];
-                snprintf(notification, sizeof(notification), "(%s,%s)\n", key, value);
-                if (write(clients[i].notif_fd, notification, strlen(notification)) == -1) {
+                // "(key,value)\n", formatted once for every client
+                if (notification == NULL) {
+                    size_t key_len = strlen(key);
+                    notification = malloc(encoded_size(key, key_len) +
+                                          encoded_size(value, len) + 4);
+                    if (notification == NULL) {
+                        perror("Failed to allocate notification");
+                        pthread_mutex_unlock(&clients_mutex);
+                        return;
+                    }
+                    notification[size++] = '(';
+                    size += encode_str(notification + size, key, key_len);
+                    notification[size++] = ',';
+                    size += encode_str(notification + size, value, len);
+                    notification[size++] = ')';
+                    notification[size++] = '\n';
+                }
+                if (write_notification(clients[i].notif_fd, notification, size) != 0) {
                     perror("Failed to write notification");
                 }
             }
@@ -666,26 +882,184 @@ void notify_clients(const char *key, const char *value) {
     }
 
     pthread_mutex_unlock(&clients_mutex);
+    free(notification);
 }
 
 
+// Parses a number of bytes, with an optional K, M or G suffix.
+// @param str String to parse.
+// @param size Pointer to store the number of bytes in.
+// @return 0 if successful, 1 otherwise.
+static int parse_size(const char *str, size_t *size) {
+  char *end;
+  unsigned long long value = strtoull(str, &end, 10);
+  if (end == str) {
+    return 1;
+  }
+
+  switch (*end) {
+  case 'G':
+    value *= 1024;
+    // fall through
+  case 'M':
+    value *= 1024;
+    // fall through
+  case 'K':
+    value *= 1024;
+    end++;
+    break;
+  default:
+    break;
+  }
+
+  if (*end != '\0') {
+    return 1;
+  }
+  *size = (size_t)value;
+  return 0;
+}
+
 int main(int argc, char *argv[]) {
-  if (argc < 5) {
-    fprintf(stderr, "Usage: %s <jobs_directory> <max_threads> <backups_max> <register_fifo>\n", argv[0]);
+  // By default the table has a few shards per core, and large batches are
+  // split among one worker per core (the job thread runs a part too)
+  long num_cores = sysconf(_SC_NPROCESSORS_ONLN);
+  if (num_cores < 1) {
+    num_cores = 1;
+  }
+  size_t num_shards = (size_t)num_cores * SHARDS_PER_CORE;
+  if (num_shards > MAX_SHARDS) {
+    num_shards = MAX_SHARDS;
+  }
+  size_t num_workers = (size_t)num_cores - 1;
+  size_t max_memory = 0;
+  size_t full_backup_interval = 1;
+  // Without -l nothing is logged, the state only lives in memory
+  const char *log_path = NULL;
+  // Synced every interval unless -y always, which makes each batch wait for
+  // its own sync (see WalSync)
+  WalSync log_sync = WAL_SYNC_PERIODIC;
+  unsigned int log_interval_ms = WAL_INTERVAL_MS;
+  // With -b the table starts with the pairs of the latest backup
+  int warm_start = 0;
+  int opt;
+  while ((opt = getopt(argc, argv, "s:w:m:HFd:l:y:bp")) != -1) {
+    switch (opt) {
+    case 's':
+      // The batches sort their keys by shard on the stack
+      num_shards = (size_t)atoi(optarg);
+      if (num_shards > MAX_SHARDS) {
+        num_shards = 0;
+      }
+      break;
+    case 'w':
+      num_workers = (size_t)atoi(optarg);
+      break;
+    case 'm':
+      if (parse_size(optarg, &max_memory)) {
+        num_shards = 0;
+      }
+      break;
+    case 'H':
+      slab_set_huge_pages(1);
+      break;
+    case 'F':
+      fork_backups = 1;
+      break;
+    case 'd':
+      // Every full_backup_interval-th backup is full, the others deltas
+      full_backup_interval = (size_t)atoi(optarg);
+      if (full_backup_interval == 0) {
+        num_shards = 0;
+      }
+      break;
+    case 'l':
+      log_path = optarg;
+      break;
+    case 'y':
+      // "always", "none", or the milliseconds between periodic syncs
+      if (strcmp(optarg, "always") == 0) {
+        log_sync = WAL_SYNC_ALWAYS;
+      } else if (strcmp(optarg, "none") == 0) {
+        log_sync = WAL_SYNC_NONE;
+      } else if (atoi(optarg) > 0) {
+        log_sync = WAL_SYNC_PERIODIC;
+        log_interval_ms = (unsigned int)atoi(optarg);
+      } else {
+        num_shards = 0;
+      }
+      break;
+    case 'b':
+      warm_start = 1;
+      break;
+    case 'p':
+      pipeline_jobs = 1;
+      break;
+    default:
+      num_shards = 0;
+      break;
+    }
+  }
+
+  if (argc - optind < 4 || num_shards == 0) {
+    fprintf(stderr,
+            "Usage: %s [-s num_shards] [-w num_workers] [-m max_memory] [-H] "
+            "[-F] [-d full_backup_interval] [-l log_file] "
+            "[-y always|none|sync_interval_ms] [-b] [-p] "
+            "<jobs_directory> <max_threads> <backups_max> <register_fifo>\n",
+            argv[0]);
+    return 1;
+  }
+  // The log has every change since it was started, a backup under it would
+  // have some of them applied twice
+  if (warm_start && log_path != NULL) {
+    fprintf(stderr, "A log cannot be combined with a start from a backup\n");
     return 1;
   }
+  // The pairs evicted to stay under the memory limit are not logged, a
+  // replay would bring them back
+  if (max_memory > 0 && log_path != NULL) {
+    fprintf(stderr, "A log cannot be combined with a memory limit\n");
+    return 1;
+  }
+  // On a single CPU the parser and the job could only take turns, paying a
+  // switch between them for every command
+  if (pipeline_jobs && sysconf(_SC_NPROCESSORS_ONLN) < 2) {
+    fprintf(stderr, "A single CPU, jobs are parsed as they run\n");
+    pipeline_jobs = 0;
+  }
 
-  jobs_directory = argv[1];
-  max_threads = (size_t)atoi(argv[2]);
-  max_backups = (size_t)atoi(argv[3]);
-  const char *register_pipe_path = argv[4];
+  jobs_directory = argv[optind];
+  max_threads = (size_t)atoi(argv[optind + 1]);
+  max_backups = (size_t)atoi(argv[optind + 2]);
+  const char *register_pipe_path = argv[optind + 3];
 
   // Inicializar o KVS
-  kvs_table = kvs_init(); // Initialize kvs_table
+  // Initialize kvs_table
+  // backups_max backup threads write the backups, or with -F wait for the
+  // child processes that write them
+  kvs_table = kvs_init(num_shards, num_workers, max_memory,
+                       max_backups > 0 ? max_backups : 1, fork_backups);
   if (kvs_table == NULL) {
     fprintf(stderr, "Failed to initialize KVS\n");
     return 1;
   }
+  kvs_set_full_backup_interval(full_backup_interval);
+  // Recovers the state the server had when it stopped
+  if (log_path != NULL &&
+      kvs_open_log(log_path, log_sync, log_interval_ms) != 0) {
+    fprintf(stderr, "Failed to recover the KVS from %s\n", log_path);
+    return 1;
+  }
+  if (warm_start) {
+    char backup_path[PATH_MAX];
+    if (backup_file_latest(jobs_directory, backup_path,
+                           sizeof(backup_path)) != 0) {
+      fprintf(stderr, "No backup in %s, starting empty\n", jobs_directory);
+    } else if (kvs_load_backup(backup_path) != 0) {
+      fprintf(stderr, "Failed to load the KVS from %s\n", backup_path);
+      return 1;
+    }
+  }
 
   // Remover named pipe existente, se houver
   unlink(register_pipe_path);
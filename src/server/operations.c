@@ -1,18 +1,81 @@
 #include "operations.h"
 
+#include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
+#include <stdatomic.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/stat.h>
 #include <sys/wait.h>
 #include <time.h>
 #include <unistd.h>
 
+#include "backup.h"
 #include "constants.h"
 #include "io.h"
 #include "kvs.h"
+#include "load.h"
+#include "pool.h"
+#include "wal.h"
+#include "wheel.h"
+#include "src/common/constants.h"
+
+// Number of lock-free attempts of a READ batch before it takes the locks
+#define READ_RETRIES 3
+// Minimum number of pairs of each part of a batch split among the workers,
+// smaller batches are not worth the hand-off
+#define PARALLEL_MIN_PAIRS 32
+// Length of a tick of the expiry clock, in milliseconds
+#define EXPIRY_TICK_MS 10
+// Maximum number of pairs expired while holding the locks of their shards
+#define EXPIRY_BATCH 32
+// How far back the clock is set for the batches of the log, a quarter of the
+// range of the ticks (about 124 days)
+#define REPLAY_MAX_TICKS (UINT32_MAX / 4)
 
 static struct HashTable *kvs_table = NULL;
+static ThreadPool *kvs_pool = NULL;
+// Threads writing the backups, as many as may be written at once
+static BackupPool *kvs_backups = NULL;
+// Whether each backup is written by a child process of its backup thread
+static int fork_backups = 0;
+// Log of the batches that change the table, NULL if they are not logged
+static Wal *kvs_wal = NULL;
+// Thread rewriting the log once it has grown, joined before the next one
+static pthread_mutex_t rewrite_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_t rewrite_thread;
+static int rewrite_started = 0;
+
+// Timers of the pairs written with a TTL, advanced by the expiry thread
+static TimingWheel kvs_wheel;
+static pthread_t expiry_thread;
+static atomic_int expiry_stop = 0;
+// Held while the clock advances, and while the log is replayed: the clock
+// stands still then, so the pairs that expired meanwhile are still there for
+// the batches logged after them
+static pthread_mutex_t expiry_lock = PTHREAD_MUTEX_INITIALIZER;
+// When the clock started, tick 0
+static struct timespec expiry_start;
+
+// A batch split among the workers. The pairs are grouped by shard and every
+// part has whole shards, so the pairs of a key are handled in order by the
+// same thread.
+typedef struct Batch {
+  char **keys;
+  const Value *values;  // Values written
+  Value *read;          // Values read
+  char (*buffers)[LARGE_VALUE_SIZE]; // Where small values read are copied
+  uint32_t expires;     // Tick when the written pairs expire, 0 if never
+  int *results;         // Result of each pair, 0 if it succeeded
+  const size_t *order;  // Indexes of the pairs, grouped by shard
+  const size_t *bounds; // Part i has the pairs order[bounds[i]..bounds[i+1]]
+} Batch;
+
+// Small values copied by the READ batches of each thread, reused so reads
+// never allocate memory. Large values are not copied, only referenced.
+static _Thread_local char read_buffers[MAX_WRITE_SIZE][LARGE_VALUE_SIZE];
 
 /// Calculates a timespec from a delay in milliseconds.
 /// @param delay_ms Delay in milliseconds.
@@ -21,13 +84,129 @@ static struct timespec delay_to_timespec(unsigned int delay_ms) {
   return (struct timespec){delay_ms / 1000, (delay_ms % 1000) * 1000000};
 }
 
-HashTable *kvs_init() {
+/// Gets the wall clock time, which unlike the expiry clock goes on across
+/// runs of the server.
+/// @return Milliseconds since the epoch.
+static uint64_t wall_clock_ms(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_REALTIME, &now);
+  return (uint64_t)now.tv_sec * 1000 + (uint64_t)now.tv_nsec / 1000000;
+}
+
+/// Gets the tick of the expiry clock when a pair written now with a TTL
+/// expires.
+/// @param ttl_ms Milliseconds until the pair expires, more than 0.
+/// @return The tick, never 0 (which means the pair never expires).
+static uint32_t expiry_tick(unsigned int ttl_ms) {
+  // Rounded up, plus the part of the current tick already gone, so pairs
+  // never expire early
+  uint32_t expires = atomic_load(&kvs_table->now) +
+                     (ttl_ms + EXPIRY_TICK_MS - 1) / EXPIRY_TICK_MS + 1;
+  return expires != 0 ? expires : 1;
+}
+
+/// Removes the pairs of a list of fired timers, a few at a time so the
+/// locks of their shards are only held briefly. Frees the timers.
+/// @param fired List of timers.
+static void expire_timers(Timer *fired) {
+  while (fired != NULL) {
+    Timer *timers[EXPIRY_BATCH];
+    size_t shards[EXPIRY_BATCH];
+    size_t count = 0;
+    for (; fired != NULL && count < EXPIRY_BATCH; fired = fired->next) {
+      timers[count] = fired;
+      shards[count++] = shard_of(kvs_table, fired->key);
+    }
+
+    size_t num_shards = lock_shards(kvs_table, shards, count, 1);
+    for (size_t i = 0; i < count; i++) {
+      expire_pair(kvs_table, timers[i]->key, timers[i]->expires);
+    }
+    unlock_shards(kvs_table, shards, num_shards);
+
+    for (size_t i = 0; i < count; i++) {
+      free(timers[i]);
+    }
+  }
+}
+
+/// Advances the expiry clock of the table to the current time and removes
+/// the pairs whose TTL ran out. Called with expiry_lock held.
+static void advance_clock(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  long long elapsed_ms = (now.tv_sec - expiry_start.tv_sec) * 1000LL +
+                         (now.tv_nsec - expiry_start.tv_nsec) / 1000000;
+  uint32_t target = (uint32_t)(elapsed_ms / EXPIRY_TICK_MS);
+
+  // Catches up one tick at a time if the clock was delayed
+  while (kvs_wheel.now != target) {
+    Timer *fired = wheel_advance(&kvs_wheel);
+    // Readers treat the pairs as missing from now on
+    atomic_store(&kvs_table->now, kvs_wheel.now);
+    expire_timers(fired);
+  }
+}
+
+/// Advances the expiry clock of the table every tick.
+static void *expire_pairs(void *arg) {
+  (void)arg;
+  struct timespec tick = delay_to_timespec(EXPIRY_TICK_MS);
+
+  while (!atomic_load(&expiry_stop)) {
+    nanosleep(&tick, NULL);
+    pthread_mutex_lock(&expiry_lock);
+    advance_clock();
+    pthread_mutex_unlock(&expiry_lock);
+  }
+
+  return NULL;
+}
+
+HashTable *kvs_init(size_t num_shards, size_t num_workers, size_t max_memory,
+                    size_t max_backups, int fork) {
   if (kvs_table != NULL) {
     fprintf(stderr, "KVS state has already been initialized\n");
     return NULL;
   }
+  if (num_shards > MAX_SHARDS) {
+    fprintf(stderr, "At most %d shards\n", MAX_SHARDS);
+    return NULL;
+  }
 
-  kvs_table = create_hash_table();
+  kvs_pool = pool_create(num_workers);
+  if (kvs_pool == NULL) {
+    return NULL;
+  }
+  kvs_table = create_hash_table(num_shards, max_memory);
+  if (kvs_table == NULL) {
+    pool_destroy(kvs_pool);
+    kvs_pool = NULL;
+    return NULL;
+  }
+  if ((kvs_backups = backup_pool_create(max_backups)) == NULL) {
+    free_table(kvs_table);
+    kvs_table = NULL;
+    pool_destroy(kvs_pool);
+    kvs_pool = NULL;
+    return NULL;
+  }
+
+  fork_backups = fork;
+
+  wheel_init(&kvs_wheel, 0);
+  clock_gettime(CLOCK_MONOTONIC, &expiry_start);
+  atomic_store(&expiry_stop, 0);
+  if (pthread_create(&expiry_thread, NULL, expire_pairs, NULL) != 0) {
+    fprintf(stderr, "Failed to create expiry thread\n");
+    wheel_destroy(&kvs_wheel);
+    backup_pool_destroy(kvs_backups);
+    kvs_backups = NULL;
+    free_table(kvs_table);
+    kvs_table = NULL;
+    pool_destroy(kvs_pool);
+    kvs_pool = NULL;
+  }
   return kvs_table;
 }
 
@@ -37,146 +216,1151 @@ int kvs_terminate() {
     return 1;
   }
 
+  // The backups in progress still use the table
+  backup_pool_destroy(kvs_backups);
+  kvs_backups = NULL;
+  int result = 0;
+  if (kvs_wal != NULL) {
+    pthread_mutex_lock(&rewrite_lock);
+    if (rewrite_started) {
+      pthread_join(rewrite_thread, NULL);
+      rewrite_started = 0;
+    }
+    pthread_mutex_unlock(&rewrite_lock);
+    result = wal_close(kvs_wal);
+    kvs_wal = NULL;
+  }
+  atomic_store(&expiry_stop, 1);
+  pthread_join(expiry_thread, NULL);
+  wheel_destroy(&kvs_wheel);
+  pool_destroy(kvs_pool);
+  kvs_pool = NULL;
   free_table(kvs_table);
   kvs_table = NULL;
+  return result;
+}
+
+/// Gets the shards of a batch of keys.
+/// @param key_shards Array to store the shard of each key.
+static void shard_keys(size_t num_keys, char *keys[], size_t *key_shards) {
+  for (size_t i = 0; i < num_keys; i++) {
+    key_shards[i] = shard_of(kvs_table, keys[i]);
+  }
+}
+
+/// Locks the shards of a batch of keys.
+/// @param key_shards Shard of each key.
+/// @param shards Array to store the indexes of the locked shards.
+/// @return Number of shards locked.
+static size_t lock_keys(size_t num_keys, const size_t *key_shards,
+                        size_t *shards, int write) {
+  memcpy(shards, key_shards, num_keys * sizeof(size_t));
+  return lock_shards(kvs_table, shards, num_keys, write);
+}
+
+/// Splits a batch into parts of whole shards with about the same number of
+/// pairs, one for each worker and one for the calling thread.
+/// @param key_shards Shard of each key.
+/// @param order Array to store the indexes of the pairs, grouped by shard.
+/// @param bounds Array of num_pairs + 1 to store where each part starts.
+/// @return Number of parts.
+static size_t split_batch(size_t num_pairs, const size_t *key_shards,
+                          size_t *order, size_t *bounds) {
+  size_t num_parts = kvs_pool->num_threads + 1;
+  if (num_parts > num_pairs / PARALLEL_MIN_PAIRS) {
+    num_parts = num_pairs / PARALLEL_MIN_PAIRS;
+  }
+  if (num_parts <= 1) {
+    for (size_t i = 0; i < num_pairs; i++) {
+      order[i] = i;
+    }
+    bounds[0] = 0;
+    bounds[1] = num_pairs;
+    return 1;
+  }
+
+  // Counting sort by shard, keeps the order of the pairs of each shard. At
+  // most MAX_SHARDS, the counts fit on the stack
+  size_t num_shards = kvs_table->num_shards;
+  size_t starts[num_shards + 1];
+  memset(starts, 0, sizeof(starts));
+  for (size_t i = 0; i < num_pairs; i++) {
+    starts[key_shards[i] + 1]++;
+  }
+  for (size_t s = 0; s < num_shards; s++) {
+    starts[s + 1] += starts[s];
+  }
+  size_t next[num_shards];
+  memcpy(next, starts, sizeof(next));
+  for (size_t i = 0; i < num_pairs; i++) {
+    order[next[key_shards[i]]++] = i;
+  }
+
+  // Cuts at the first shard boundary after each equal share
+  size_t parts = 0;
+  bounds[parts++] = 0;
+  for (size_t s = 1; s < num_shards && parts < num_parts; s++) {
+    if (starts[s] >= parts * num_pairs / num_parts &&
+        starts[s] > bounds[parts - 1]) {
+      bounds[parts++] = starts[s];
+    }
+  }
+  bounds[parts] = num_pairs;
+  return parts;
+}
+
+// A pair fails to be written when there is no memory for it (or no room,
+// under a memory limit).
+static void write_part(void *arg, size_t part) {
+  Batch *batch = arg;
+  for (size_t j = batch->bounds[part]; j < batch->bounds[part + 1]; j++) {
+    size_t i = batch->order[j];
+    batch->results[i] = write_pair(kvs_table, batch->keys[i],
+                                   &batch->values[i], batch->expires) != 0;
+  }
+}
+
+static void read_part(void *arg, size_t part) {
+  Batch *batch = arg;
+  for (size_t j = batch->bounds[part]; j < batch->bounds[part + 1]; j++) {
+    size_t i = batch->order[j];
+    batch->results[i] = read_pair_into(kvs_table, batch->keys[i],
+                                       batch->buffers[i], &batch->read[i]);
+  }
+}
+
+static void delete_part(void *arg, size_t part) {
+  Batch *batch = arg;
+  for (size_t j = batch->bounds[part]; j < batch->bounds[part + 1]; j++) {
+    size_t i = batch->order[j];
+    batch->results[i] = delete_pair(kvs_table, batch->keys[i]) != 0;
+  }
+}
+
+// The new value of each key of an INCR is formatted in its read buffer.
+static void incr_part(void *arg, size_t part) {
+  Batch *batch = arg;
+  for (size_t j = batch->bounds[part]; j < batch->bounds[part + 1]; j++) {
+    size_t i = batch->order[j];
+    long long delta, result;
+    batch->results[i] = parse_integer(batch->values[i].data,
+                                      batch->values[i].len, &delta) != 0 ||
+                        incr_pair(kvs_table, batch->keys[i], delta,
+                                  &result) != 0;
+    if (!batch->results[i]) {
+      int len = snprintf(batch->buffers[i], LARGE_VALUE_SIZE, "%lld", result);
+      batch->read[i] = (Value){batch->buffers[i], (size_t)len, NULL};
+    }
+  }
+}
+
+static void append_part(void *arg, size_t part) {
+  Batch *batch = arg;
+  for (size_t j = batch->bounds[part]; j < batch->bounds[part + 1]; j++) {
+    size_t i = batch->order[j];
+    batch->results[i] = append_pair(kvs_table, batch->keys[i],
+                                    &batch->values[i]) != 0;
+  }
+}
+
+// The expected and new values of key i are values 2i and 2i + 1.
+static void cas_part(void *arg, size_t part) {
+  Batch *batch = arg;
+  for (size_t j = batch->bounds[part]; j < batch->bounds[part + 1]; j++) {
+    size_t i = batch->order[j];
+    batch->results[i] = cas_pair(kvs_table, batch->keys[i],
+                                 &batch->values[2 * i],
+                                 &batch->values[2 * i + 1]);
+  }
+}
+
+static void start_rewrite(void);
+
+/// Sets the result of every key of a batch that was not run to -1.
+static void fail_batch(size_t num_pairs, Batch *batch) {
+  for (size_t i = 0; i < num_pairs && batch->results != NULL; i++) {
+    batch->results[i] = -1;
+  }
+}
+
+/// Runs a batch that changes the table, split among the workers, with the
+/// shards of its keys locked for writing by this thread, so each key of the
+/// batch is read and written in a single critical section.
+/// @param batch The batch, its order and bounds are set here.
+/// @param run Function running a part of the batch.
+/// @param record The batch as it is logged, NULL if it is not.
+/// @return 0 if successful, 1 if the batch could not be logged. A batch that
+/// could not be added to the log is not run: the result of each of its keys
+/// is then -1, which the callers answer with KVSERROR.
+static int run_write_batch(size_t num_pairs, Batch *batch,
+                           void (*run)(void *arg, size_t part),
+                           const WalRecord *record) {
+  size_t key_shards[num_pairs], shards[num_pairs];
+  size_t order[num_pairs], bounds[num_pairs + 1];
+  shard_keys(num_pairs, batch->keys, key_shards);
+  size_t num_parts = split_batch(num_pairs, key_shards, order, bounds);
+  batch->order = order;
+  batch->bounds = bounds;
+
+  char *entry = NULL;
+  size_t entry_len = 0;
+  if (kvs_wal != NULL && record != NULL) {
+    entry = wal_encode(record, &entry_len);
+    if (entry == NULL) {
+      fail_batch(num_pairs, batch);
+      return 1;
+    }
+    wal_throttle(kvs_wal);
+  }
+
+  size_t num_shards = lock_keys(num_pairs, key_shards, shards, 1);
+  uint64_t position = 0;
+  // A batch that is not in the log is not run either, or a replay would not
+  // bring the table back to what readers saw
+  if (entry != NULL && wal_append(kvs_wal, entry, entry_len, &position)) {
+    unlock_shards(kvs_table, shards, num_shards);
+    free(entry);
+    fail_batch(num_pairs, batch);
+    return 1;
+  }
+  pool_run(kvs_pool, num_parts, run, batch);
+  unlock_shards(kvs_table, shards, num_shards);
+
+  // The batch is only answered once it is durable, the batches of other
+  // threads logged meanwhile are synced along with it
+  if (entry == NULL) {
+    return 0;
+  }
+  free(entry);
+  if (wal_rewrite_due(kvs_wal)) {
+    start_rewrite();
+  }
+  return wal_commit(kvs_wal, position);
+}
+
+/// Writes the keys of a batch that failed, as [(key,error)...], nothing if
+/// none did.
+/// @param errors Error of each key, NULL for the ones that succeeded.
+static void write_errors(int fd, size_t num_pairs, char *keys[],
+                         const char *errors[]) {
+  Output out;
+  output_begin(&out, fd);
+  for (size_t i = 0; i < num_pairs; i++) {
+    if (errors[i] != NULL) {
+      if (out.used == 0) {
+        output_str(&out, "[");
+      }
+      output_pair(&out, keys[i], errors[i], strlen(errors[i]), ",", "");
+    }
+  }
+  if (out.used > 0) {
+    output_str(&out, "]\n");
+  }
+  output_flush(&out);
+}
+
+/// Runs a batch of the log again, the way it was run, without logging or
+/// answering it. The clock of the table is set back to when the batch was
+/// run, so it sees the pairs with a TTL that were there then and its own TTL
+/// counts from then.
+/// @param arg Pointer to the wall clock time of the start of the replay.
+static void replay_record(const WalRecord *record, void *arg) {
+  uint64_t start = *(const uint64_t *)arg;
+  long long ticks_ago = record->time < start
+                            ? (long long)(start - record->time) / EXPIRY_TICK_MS
+                            : 0;
+  // Ticks are compared by difference, older records count as old enough
+  if (ticks_ago > REPLAY_MAX_TICKS) {
+    ticks_ago = REPLAY_MAX_TICKS;
+  }
+  atomic_store(&kvs_table->now, kvs_wheel.now - (uint32_t)ticks_ago);
+
+  size_t num_pairs = record->num_keys;
+  Value values[num_pairs];
+  int results[num_pairs];
+  Batch batch = {record->keys, record->values, values, read_buffers, 0,
+                 results,      NULL,           NULL};
+
+  switch (record->type) {
+  case WAL_WRITE:
+    kvs_write(num_pairs, record->keys, record->values, record->ttl_ms, -1);
+    break;
+  case WAL_DELETE:
+    run_write_batch(num_pairs, &batch, delete_part, NULL);
+    break;
+  case WAL_INCR:
+    run_write_batch(num_pairs, &batch, incr_part, NULL);
+    break;
+  case WAL_APPEND:
+    run_write_batch(num_pairs, &batch, append_part, NULL);
+    break;
+  case WAL_CAS:
+    run_write_batch(num_pairs, &batch, cas_part, NULL);
+    break;
+  default:
+    break;
+  }
+}
+
+/// Gets the position of the log, with every shard locked.
+/// @param arg Pointer to store the position in.
+static void log_position(void *arg) {
+  *(uint64_t *)arg = wal_position(kvs_wal);
+}
+
+/// Writes the pairs of a snapshot as WRITE records, for the log to be
+/// rewritten. The pairs with a TTL are written with what is left of it, in
+/// records of their own unless their neighbors have the same.
+/// @param fd File of the new log.
+/// @param arg The snapshot.
+/// @return 0 if successful, 1 otherwise.
+static int write_log_state(int fd, void *arg) {
+  Scan scan;
+  if (scan_begin(kvs_table, &scan, arg, NULL, NULL) != 0) {
+    return 1;
+  }
+  char *keys[MAX_WRITE_SIZE];
+  Value values[MAX_WRITE_SIZE];
+  WalRecord record = {WAL_WRITE, 0, 0, 0, keys, values};
+  int failed = 0;
+  KeyNode *keyNode;
+  while (!failed && (keyNode = scan_next(&scan)) != NULL) {
+    unsigned int ttl_ms = 0;
+    uint32_t expires = atomic_load(&keyNode->expires);
+    if (expires != 0) {
+      // Ticks are compared by difference, the clock went on since the
+      // snapshot. The tick a write adds is taken back.
+      int32_t left = (int32_t)(expires - atomic_load(&kvs_table->now)) - 1;
+      if (left < 0) {
+        continue; // The pair expired meanwhile, the replay would drop it
+      }
+      ttl_ms = left > 0 ? (unsigned int)left * EXPIRY_TICK_MS : 1;
+    }
+    if (record.num_keys == MAX_WRITE_SIZE ||
+        (record.num_keys > 0 && ttl_ms != record.ttl_ms)) {
+      failed = wal_write_record(fd, &record);
+      record.num_keys = 0;
+    }
+    record.ttl_ms = ttl_ms;
+    size_t len;
+    const char *data =
+        node_value(keyNode, read_buffers[record.num_keys], &len);
+    keys[record.num_keys] = keyNode->key;
+    values[record.num_keys++] = (Value){data, len, NULL};
+  }
+  if (!failed && record.num_keys > 0) {
+    failed = wal_write_record(fd, &record);
+  }
+  scan_end(&scan);
+  return failed;
+}
+
+/// Rewrites the log from a snapshot of the table, in its own thread.
+static void *rewrite_log(void *arg) {
+  (void)arg;
+  Snapshot snapshot;
+  uint64_t position;
+  snapshot_begin_with(kvs_table, &snapshot, log_position, &position);
+  if (wal_rewrite(kvs_wal, position, write_log_state, &snapshot) != 0) {
+    fprintf(stderr, "Failed to rewrite the log\n");
+  }
+  snapshot_end(kvs_table, &snapshot);
+  return NULL;
+}
+
+/// Starts rewriting the log. The previous rewrite is over by now, the log is
+/// not due again until it ends.
+static void start_rewrite(void) {
+  pthread_mutex_lock(&rewrite_lock);
+  if (rewrite_started) {
+    pthread_join(rewrite_thread, NULL);
+  }
+  rewrite_started =
+      pthread_create(&rewrite_thread, NULL, rewrite_log, NULL) == 0;
+  if (!rewrite_started) {
+    fprintf(stderr, "Failed to create the thread rewriting the log\n");
+  }
+  pthread_mutex_unlock(&rewrite_lock);
+}
+
+int kvs_open_log(const char *path, WalSync sync, unsigned int interval_ms) {
+  if (kvs_table == NULL || kvs_wal != NULL) {
+    fprintf(stderr, "KVS state must be initialized, without a log\n");
+    return 1;
+  }
+
+  pthread_mutex_lock(&expiry_lock);
+  uint64_t start = wall_clock_ms();
+  int result = wal_replay(path, replay_record, &start);
+  // The pairs that expired while the server was down go before any job runs
+  atomic_store(&kvs_table->now, kvs_wheel.now);
+  advance_clock();
+  pthread_mutex_unlock(&expiry_lock);
+  if (result != 0) {
+    fprintf(stderr, "Failed to replay log %s\n", path);
+    return 1;
+  }
+
+  kvs_wal = wal_open(path, sync, interval_ms);
+  return kvs_wal == NULL;
+}
+
+// A backup loaded in parallel: part i has the lines starting at bounds[i]
+// up to bounds[i + 1]
+typedef struct LoadBatch {
+  const BackupFile *file;
+  const size_t *bounds;
+  uint64_t now_ms; // Wall clock time of the load, to tell what is left of TTLs
+  atomic_int failed;
+} LoadBatch;
+
+/// Writes the pairs of some lines of a backup, and deletes the keys removed
+/// by a delta, MAX_WRITE_SIZE lines at a time. A pair with a TTL gets what is
+/// left of it, one that expired meanwhile is removed like a key of a delta. The lines of each shard are
+/// written under its lock alone: the lines of a batch are spread over every
+/// shard, holding all their locks at once would have the parts run one after
+/// the other. The lines were checked when the backup was split.
+static void load_part(void *arg, size_t part) {
+  LoadBatch *load = arg;
+  // The keys of a batch, null terminated one after the other: keys can be
+  // up to MAX_KEY_SIZE long, too large to keep a batch of them on the stack
+  char *key_data = NULL;
+  size_t key_capacity = 0;
+  size_t key_offsets[MAX_WRITE_SIZE];
+  char *keys[MAX_WRITE_SIZE];
+  Value values[MAX_WRITE_SIZE];
+  uint32_t expires[MAX_WRITE_SIZE];
+  size_t key_shards[MAX_WRITE_SIZE];
+  size_t order[MAX_WRITE_SIZE];
+  // Where each shard starts in the order, allocated once for the whole part
+  size_t num_shards = kvs_table->num_shards;
+  size_t *starts = malloc((num_shards + 1) * sizeof(size_t));
+  if (starts == NULL) {
+    atomic_store(&load->failed, 1);
+    return;
+  }
+
+  size_t pos = load->bounds[part];
+  while (pos < load->bounds[part + 1]) {
+    size_t num_pairs = 0;
+    size_t key_size = 0;
+    while (num_pairs < MAX_WRITE_SIZE && pos < load->bounds[part + 1]) {
+      BackupLine line;
+      pos = backup_file_parse(load->file, pos, &line);
+      if (key_size + line.key_len + 1 > key_capacity) {
+        size_t capacity = key_capacity * 2;
+        if (capacity < key_size + line.key_len + 1) {
+          capacity = key_size + MAX_KEY_SIZE;
+        }
+        char *grown = realloc(key_data, capacity);
+        if (grown == NULL) {
+          atomic_store(&load->failed, 1);
+          free(key_data);
+          free(starts);
+          return;
+        }
+        key_data = grown;
+        key_capacity = capacity;
+      }
+      memcpy(key_data + key_size, line.key, line.key_len);
+      key_data[key_size + line.key_len] = '\0';
+      key_offsets[num_pairs] = key_size;
+      key_size += line.key_len + 1;
+      values[num_pairs] = (Value){line.value, line.value_len, NULL};
+      expires[num_pairs] = 0;
+      if (line.expires_ms != 0 && line.expires_ms <= load->now_ms) {
+        values[num_pairs].data = NULL;
+      } else if (line.expires_ms != 0) {
+        uint64_t left_ms = line.expires_ms - load->now_ms;
+        expires[num_pairs] =
+            expiry_tick(left_ms < UINT_MAX ? (unsigned int)left_ms : UINT_MAX);
+      }
+      num_pairs++;
+    }
+    // Only now, the keys may have moved while the batch grew
+    for (size_t i = 0; i < num_pairs; i++) {
+      keys[i] = key_data + key_offsets[i];
+    }
+
+    // Counting sort by shard
+    shard_keys(num_pairs, keys, key_shards);
+    memset(starts, 0, (num_shards + 1) * sizeof(size_t));
+    for (size_t i = 0; i < num_pairs; i++) {
+      starts[key_shards[i] + 1]++;
+    }
+    for (size_t s = 0; s < num_shards; s++) {
+      starts[s + 1] += starts[s];
+    }
+    for (size_t i = 0; i < num_pairs; i++) {
+      order[starts[key_shards[i]]++] = i;
+    }
+
+    // Each shard now starts where the previous one ends
+    size_t start = 0;
+    for (size_t s = 0; s < num_shards; s++) {
+      if (starts[s] == start) {
+        continue;
+      }
+      size_t shard = s;
+      lock_shards(kvs_table, &shard, 1, 1);
+      for (size_t j = start; j < starts[s]; j++) {
+        size_t i = order[j];
+        // A key removed by a delta may be missing already, that is fine
+        if (values[i].data == NULL) {
+          delete_pair(kvs_table, keys[i]);
+        } else if (write_pair(kvs_table, keys[i], &values[i],
+                              expires[i]) != 0) {
+          atomic_store(&load->failed, 1);
+        }
+      }
+      unlock_shards(kvs_table, &shard, 1);
+      start = starts[s];
+    }
+
+    for (size_t i = 0; i < num_pairs; i++) {
+      if (expires[i] != 0 && values[i].data != NULL &&
+          wheel_add(&kvs_wheel, keys[i], expires[i]) != 0) {
+        atomic_store(&load->failed, 1);
+      }
+    }
+  }
+  free(key_data);
+  free(starts);
+}
+
+/// Loads the lines of a backup in parallel. A first pass checks the lines
+/// and counts them, to split the backup into parts of about the same size at
+/// line boundaries (a value may hold a newline, so only parsing the lines
+/// tells where they start) and to size the table for them.
+/// @return 0 if successful, 1 otherwise.
+static int load_file(const BackupFile *file, const char *path) {
+  size_t num_parts = kvs_pool->num_threads + 1;
+  size_t bounds[num_parts + 1];
+  size_t parts = 0;
+  bounds[parts++] = file->start;
+  size_t num_lines = 0;
+  size_t pos = file->start;
+  while (pos < file->size) {
+    BackupLine line;
+    size_t next = backup_file_parse(file, pos, &line);
+    // A key may be empty, as the parser takes it: "(, value)"
+    if (next == 0 || line.key_len >= MAX_KEY_SIZE ||
+        line.value_len > MAX_VALUE_SIZE ||
+        memchr(line.key, '\0', line.key_len) != NULL) {
+      fprintf(stderr, "Invalid line %zu of %s\n", num_lines + 1, path);
+      return 1;
+    }
+    num_lines++;
+    pos = next;
+    if (parts < num_parts &&
+        pos - file->start >= parts * (file->size - file->start) / num_parts) {
+      bounds[parts++] = pos;
+    }
+  }
+  while (parts <= num_parts) {
+    bounds[parts++] = file->size;
+  }
+
+  // Only a hint, the table grows anyway if it cannot be reserved
+  reserve_pairs(kvs_table, num_lines);
+  LoadBatch load = {file, bounds, wall_clock_ms(), 0};
+  pool_run(kvs_pool, num_parts, load_part, &load);
+  if (atomic_load(&load.failed)) {
+    fprintf(stderr, "Failed to write the pairs of %s\n", path);
+    return 1;
+  }
   return 0;
 }
 
-int kvs_write(size_t num_pairs, char keys[][MAX_STRING_SIZE],
-              char values[][MAX_STRING_SIZE]) {
+int kvs_load_backup(const char *path) {
+  if (kvs_table == NULL) {
+    fprintf(stderr, "KVS state must be initialized\n");
+    return 1;
+  }
+
+  BackupChain chain;
+  if (backup_chain_map(path, &chain) != 0) {
+    return 1;
+  }
+
+  // The full backup first, then each delta on top of the previous one
+  int failed = 0;
+  for (size_t i = chain.length; i > 0 && !failed; i--) {
+    failed = load_file(&chain.files[i - 1],
+                       i > 1 ? chain.files[i - 2].base : path);
+  }
+
+  backup_chain_unmap(&chain);
+  return failed;
+}
+
+int kvs_write(size_t num_pairs, char *keys[], const Value values[],
+              unsigned int ttl_ms, int fd) {
   if (kvs_table == NULL) {
     fprintf(stderr, "KVS state must be initialized\n");
     return 1;
   }
 
-  pthread_rwlock_wrlock(&kvs_table->tablelock);
+  uint32_t expires = ttl_ms > 0 ? expiry_tick(ttl_ms) : 0;
+
+  int failed[num_pairs];
+  WalRecord record = {WAL_WRITE, 0, ttl_ms, num_pairs, keys, values};
+  Batch batch = {keys, values, NULL, NULL, expires, failed, NULL, NULL};
+  int result = run_write_batch(num_pairs, &batch, write_part, &record);
 
+  const char *errors[num_pairs];
   for (size_t i = 0; i < num_pairs; i++) {
-    if (write_pair(kvs_table, keys[i], values[i]) != 0) {
-      fprintf(stderr, "Failed to write key pair (%s,%s)\n", keys[i], values[i]);
+    errors[i] = failed[i] ? "KVSERROR" : NULL;
+    result |= failed[i] != 0;
+    // A timer per pair, the pairs written again before it fires are kept
+    if (!failed[i] && expires != 0 &&
+        wheel_add(&kvs_wheel, keys[i], expires) != 0) {
+      fprintf(stderr, "Failed to set the TTL of key %s\n", keys[i]);
+    }
+  }
+  if (fd >= 0) {
+    write_errors(fd, num_pairs, keys, errors);
+  }
+  return result;
+}
+
+// Releases the blobs of the values found by a READ batch.
+static void release_values(size_t num_pairs, const int *missing,
+                           Value *values) {
+  for (size_t i = 0; i < num_pairs; i++) {
+    if (!missing[i]) {
+      blob_release(values[i].blob);
+    }
+  }
+}
+
+int kvs_read(size_t num_pairs, char *keys[], int fd) {
+  if (kvs_table == NULL) {
+    fprintf(stderr, "KVS state must be initialized\n");
+    return 1;
+  }
+
+  // The keys are read without locks and the batch is retried if a writer
+  // touched any of their shards meanwhile, so it sees a consistent state of
+  // the table. After READ_RETRIES failed attempts it takes the read locks.
+  size_t shards[num_pairs];
+  unsigned int seqs[num_pairs];
+  Value values[num_pairs];
+  int missing[num_pairs];
+  size_t order[num_pairs], bounds[num_pairs + 1];
+  shard_keys(num_pairs, keys, shards);
+  size_t num_parts = split_batch(num_pairs, shards, order, bounds);
+  Batch batch = {keys,    NULL,    values, read_buffers, 0,
+                 missing, order, bounds};
+
+  int consistent = 0;
+  for (int attempt = 0; attempt < READ_RETRIES && !consistent; attempt++) {
+    for (size_t i = 0; i < num_pairs; i++) {
+      seqs[i] = read_begin_shard(kvs_table, shards[i]);
+    }
+    pool_run(kvs_pool, num_parts, read_part, &batch);
+
+    consistent = 1;
+    for (size_t i = 0; i < num_pairs && consistent; i++) {
+      consistent = validate_shard(kvs_table, shards[i], seqs[i]);
+    }
+    if (!consistent) {
+      release_values(num_pairs, missing, values);
     }
   }
 
-  pthread_rwlock_unlock(&kvs_table->tablelock);
+  if (!consistent) {
+    size_t num_shards = lock_shards(kvs_table, shards, num_pairs, 0);
+    pool_run(kvs_pool, num_parts, read_part, &batch);
+    unlock_shards(kvs_table, shards, num_shards);
+  }
+
+  // The whole response is formatted first and written at once
+  Output out;
+  output_begin(&out, fd);
+  output_str(&out, "[");
+  for (size_t i = 0; i < num_pairs; i++) {
+    if (missing[i]) {
+      output_pair(&out, keys[i], "KVSERROR", 8, ",", "");
+    } else {
+      output_pair(&out, keys[i], values[i].data, values[i].len, ",", "");
+    }
+  }
+  output_str(&out, "]\n");
+  output_flush(&out);
+  release_values(num_pairs, missing, values);
   return 0;
 }
 
-int kvs_read(size_t num_pairs, char keys[][MAX_STRING_SIZE], int fd) {
+int kvs_delete(size_t num_pairs, char *keys[], int fd) {
+  if (kvs_table == NULL) {
+    fprintf(stderr, "KVS state must be initialized\n");
+    return 1;
+  }
+
+  int missing[num_pairs];
+  Batch batch = {keys, NULL, NULL, NULL, 0, missing, NULL, NULL};
+  WalRecord record = {WAL_DELETE, 0, 0, num_pairs, keys, NULL};
+  int result = run_write_batch(num_pairs, &batch, delete_part, &record);
+
+  const char *errors[num_pairs];
+  for (size_t i = 0; i < num_pairs; i++) {
+    errors[i] = missing[i] < 0   ? "KVSERROR"
+                : missing[i] ? "KVSMISSING"
+                             : NULL;
+  }
+  write_errors(fd, num_pairs, keys, errors);
+  return result;
+}
+
+int kvs_incr(size_t num_pairs, char *keys[], const Value deltas[], int fd) {
   if (kvs_table == NULL) {
     fprintf(stderr, "KVS state must be initialized\n");
     return 1;
   }
 
-  pthread_rwlock_rdlock(&kvs_table->tablelock);
+  Value values[num_pairs];
+  int failed[num_pairs];
+  Batch batch = {keys, deltas, values, read_buffers, 0, failed, NULL, NULL};
+  WalRecord record = {WAL_INCR, 0, 0, num_pairs, keys, deltas};
+  int result = run_write_batch(num_pairs, &batch, incr_part, &record);
 
-  write_str(fd, "[");
+  Output out;
+  output_begin(&out, fd);
+  output_str(&out, "[");
   for (size_t i = 0; i < num_pairs; i++) {
-    char *result = read_pair(kvs_table, keys[i]);
-    char aux[MAX_STRING_SIZE];
-    if (result == NULL) {
-      snprintf(aux, MAX_STRING_SIZE, "(%s,KVSERROR)", keys[i]);
+    if (failed[i]) {
+      output_pair(&out, keys[i], "KVSERROR", 8, ",", "");
     } else {
-      snprintf(aux, MAX_STRING_SIZE, "(%s,%s)", keys[i], result);
+      output_pair(&out, keys[i], values[i].data, values[i].len, ",", "");
     }
-    write_str(fd, aux);
-    free(result);
   }
-  write_str(fd, "]\n");
+  output_str(&out, "]\n");
+  output_flush(&out);
+  return result;
+}
 
-  pthread_rwlock_unlock(&kvs_table->tablelock);
-  return 0;
+int kvs_append(size_t num_pairs, char *keys[], const Value values[], int fd) {
+  if (kvs_table == NULL) {
+    fprintf(stderr, "KVS state must be initialized\n");
+    return 1;
+  }
+
+  int failed[num_pairs];
+  Batch batch = {keys, values, NULL, NULL, 0, failed, NULL, NULL};
+  WalRecord record = {WAL_APPEND, 0, 0, num_pairs, keys, values};
+  int result = run_write_batch(num_pairs, &batch, append_part, &record);
+
+  const char *errors[num_pairs];
+  for (size_t i = 0; i < num_pairs; i++) {
+    errors[i] = failed[i] ? "KVSERROR" : NULL;
+  }
+  write_errors(fd, num_pairs, keys, errors);
+  return result;
 }
 
-int kvs_delete(size_t num_pairs, char keys[][MAX_STRING_SIZE], int fd) {
+int kvs_cas(size_t num_pairs, char *keys[], const Value values[], int fd) {
   if (kvs_table == NULL) {
     fprintf(stderr, "KVS state must be initialized\n");
     return 1;
   }
 
-  pthread_rwlock_wrlock(&kvs_table->tablelock);
+  int results[num_pairs];
+  Batch batch = {keys, values, NULL, NULL, 0, results, NULL, NULL};
+  WalRecord record = {WAL_CAS, 0, 0, num_pairs, keys, values};
+  int result = run_write_batch(num_pairs, &batch, cas_part, &record);
 
-  int aux = 0;
+  const char *errors[num_pairs];
   for (size_t i = 0; i < num_pairs; i++) {
-    if (delete_pair(kvs_table, keys[i]) != 0) {
-      if (!aux) {
-        write_str(fd, "[");
-        aux = 1;
-      }
-      char str[MAX_STRING_SIZE];
-      snprintf(str, MAX_STRING_SIZE, "(%s,KVSMISSING)", keys[i]);
-      write_str(fd, str);
+    switch (results[i]) {
+    case 0:
+      errors[i] = NULL;
+      break;
+    case 1:
+      errors[i] = "KVSMISSING";
+      break;
+    case 2:
+      errors[i] = "KVSMISMATCH";
+      break;
+    default:
+      errors[i] = "KVSERROR";
+      break;
     }
   }
-  if (aux) {
-    write_str(fd, "]\n");
+  write_errors(fd, num_pairs, keys, errors);
+  return result;
+}
+
+/// Writes a pair as "(key, value)\n", the format of SHOW.
+/// @param keyNode Version of the pair seen by a scan.
+static void show_pair(Output *out, KeyNode *keyNode) {
+  char buffer[LARGE_VALUE_SIZE];
+  size_t len;
+  const char *value = node_value(keyNode, buffer, &len);
+  output_pair(out, keyNode->key, value, len, ", ", "\n");
+}
+
+void kvs_show(int fd) {
+  if (kvs_table == NULL) {
+    fprintf(stderr, "KVS state must be initialized\n");
+    return;
   }
 
-  pthread_rwlock_unlock(&kvs_table->tablelock);
+  // Writers carry on meanwhile, the snapshot keeps the versions it sees
+  Snapshot snapshot;
+  snapshot_begin(kvs_table, &snapshot);
+
+  Scan scan;
+  if (scan_begin(kvs_table, &scan, &snapshot, NULL, NULL) != 0) {
+    snapshot_end(kvs_table, &snapshot);
+    fprintf(stderr, "Failed to show the KVS\n");
+    return;
+  }
+  Output out;
+  output_begin(&out, fd);
+  KeyNode *keyNode;
+  while ((keyNode = scan_next(&scan)) != NULL) {
+    show_pair(&out, keyNode);
+  }
+  output_flush(&out);
+  scan_end(&scan);
+
+  snapshot_end(kvs_table, &snapshot);
+}
+
+int kvs_scan(const char *start, const char *end, int fd) {
+  if (kvs_table == NULL) {
+    fprintf(stderr, "KVS state must be initialized\n");
+    return 1;
+  }
+
+  Snapshot snapshot;
+  snapshot_begin(kvs_table, &snapshot);
+  Scan scan;
+  if (scan_begin(kvs_table, &scan, &snapshot, start, end) != 0) {
+    snapshot_end(kvs_table, &snapshot);
+    return 1;
+  }
+
+  // The range is never collected in memory, the output is written whenever
+  // its buffer fills up
+  char buffer[LARGE_VALUE_SIZE];
+  Output out;
+  output_begin(&out, fd);
+  output_str(&out, "[");
+  KeyNode *keyNode;
+  while ((keyNode = scan_next(&scan)) != NULL) {
+    size_t len;
+    const char *value = node_value(keyNode, buffer, &len);
+    output_pair(&out, keyNode->key, value, len, ",", "");
+  }
+  output_str(&out, "]\n");
+  output_flush(&out);
+  scan_end(&scan);
+
+  snapshot_end(kvs_table, &snapshot);
   return 0;
 }
 
-void kvs_show(int fd) {
+int kvs_key_exists(const char *key) {
+  if (kvs_table == NULL) {
+    fprintf(stderr, "KVS state must be initialized\n");
+    return 0;
+  }
+
+  return key_exists(kvs_table, key);
+}
+
+void kvs_stats(int fd) {
   if (kvs_table == NULL) {
     fprintf(stderr, "KVS state must be initialized\n");
     return;
   }
 
-  pthread_rwlock_rdlock(&kvs_table->tablelock);
-  char aux[MAX_STRING_SIZE];
+  FilterStats stats;
+  filter_stats(kvs_table, &stats);
+  size_t missing = stats.negatives + stats.false_positives;
+  double rate = missing > 0 ? (double)stats.false_positives / (double)missing
+                            : 0.0;
 
-  for (int i = 0; i < TABLE_SIZE; i++) {
-    KeyNode *keyNode = kvs_table->table[i]; // Get the next list head
-    while (keyNode != NULL) {
-      snprintf(aux, MAX_STRING_SIZE, "(%s, %s)\n", keyNode->key,
-               keyNode->value);
-      write_str(fd, aux);
-      keyNode = keyNode->next; // Move to the next node of the list
+  BackupStats backups;
+  backup_stats(kvs_backups, &backups);
+  // Latencies in milliseconds, averaged over the backups finished, and the
+  // waits for room in the queue over the backups that waited
+  double finished = backups.completed > 0 ? (double)backups.completed : 1.0;
+  double throttled = backups.throttled > 0 ? (double)backups.throttled : 1.0;
+
+  char buffer[768];
+  snprintf(buffer, sizeof(buffer),
+           "[(filter_negatives,%zu)(filter_false_positives,%zu)"
+           "(filter_false_positive_rate,%.4f)"
+           "(backups_queued,%zu)(backups_running,%zu)"
+           "(backups_completed,%zu)(backups_failed,%zu)"
+           "(backup_wait_ms_avg,%.3f)(backup_wait_ms_max,%.3f)"
+           "(backup_run_ms_avg,%.3f)(backup_run_ms_max,%.3f)"
+           "(backups_throttled,%zu)(backup_throttle_ms_avg,%.3f)"
+           "(backup_throttle_ms_max,%.3f)]\n",
+           stats.negatives, stats.false_positives, rate, backups.queued,
+           backups.running, backups.completed, backups.failed,
+           (double)backups.wait_us / finished / 1000.0,
+           (double)backups.max_wait_us / 1000.0,
+           (double)backups.run_us / finished / 1000.0,
+           (double)backups.max_run_us / 1000.0, backups.throttled,
+           (double)backups.throttle_us / throttled / 1000.0,
+           (double)backups.max_throttle_us / 1000.0);
+  write_str(fd, buffer);
+}
+
+// A backup being written, by a backup thread or a child process. Its snapshot
+// is taken by the job that asked for it, so it holds the state of the table
+// at the BACKUP command.
+typedef struct BackupJob {
+  Snapshot snapshot;
+  int delta;       // 1 if only the changes since the base are written
+  Changes changes; // Keys written or removed since the base
+  struct timespec taken;        // When the snapshot was taken, in order
+  char base[NAME_MAX + 1];      // File name of the previous backup
+  char name[NAME_MAX + 1];      // File name of the backup
+  char path[PATH_MAX];         // Name of the backup
+  char tmp_path[PATH_MAX + 4]; // Name while it is being written
+} BackupJob;
+
+// Backups are full every full_backup_interval backups, deltas of the previous
+// backup in between. The order of the backups is the one of their
+// checkpoints, which the lock keeps in step with the chain.
+static pthread_mutex_t backup_chain_lock = PTHREAD_MUTEX_INITIALIZER;
+static size_t full_backup_interval = 1;
+static size_t backups_taken = 0;
+static char last_backup[NAME_MAX + 1]; // File name of the last backup
+static struct timespec last_taken;     // When its snapshot was taken
+
+void kvs_set_full_backup_interval(size_t interval) {
+  pthread_mutex_lock(&backup_chain_lock);
+  full_backup_interval = interval > 0 ? interval : 1;
+  pthread_mutex_unlock(&backup_chain_lock);
+}
+
+/// Takes the snapshot of a backup, a checkpoint if delta backups are used,
+/// and links the backup to the previous one.
+/// @return 0 if successful, 1 otherwise.
+static int begin_backup(BackupJob *job) {
+  job->delta = 0;
+  job->changes = (Changes){NULL, 0, 0};
+  pthread_mutex_lock(&backup_chain_lock);
+  if (full_backup_interval == 1) {
+    // Without deltas, the changes are not even recorded
+    snapshot_begin(kvs_table, &job->snapshot);
+  } else {
+    if (checkpoint_begin(kvs_table, &job->snapshot, &job->changes) != 0) {
+      pthread_mutex_unlock(&backup_chain_lock);
+      return 1;
+    }
+    // A delta needs every change since the previous backup
+    job->delta = backups_taken % full_backup_interval != 0 &&
+                 job->changes.complete;
+    if (!job->delta) {
+      changes_free(&job->changes);
     }
+    memcpy(job->base, last_backup, sizeof(last_backup));
+    memcpy(last_backup, job->name, sizeof(last_backup));
   }
+  backups_taken++;
 
-  pthread_rwlock_unlock(&kvs_table->tablelock);
+  // The backups may be written in any order, their modification time is set
+  // to when their snapshot was taken so a warm start finds the latest one
+  clock_gettime(CLOCK_REALTIME, &job->taken);
+  if (job->taken.tv_sec < last_taken.tv_sec ||
+      (job->taken.tv_sec == last_taken.tv_sec &&
+       job->taken.tv_nsec <= last_taken.tv_nsec)) {
+    job->taken = last_taken;
+    if (++job->taken.tv_nsec == 1000000000) {
+      job->taken.tv_sec++;
+      job->taken.tv_nsec = 0;
+    }
+  }
+  last_taken = job->taken;
+  pthread_mutex_unlock(&backup_chain_lock);
+  return 0;
 }
 
-int kvs_backup(size_t num_backup, char *job_filename, char *directory) {
-  pid_t pid;
-  char bck_name[50];
-  snprintf(bck_name, sizeof(bck_name), "%s/%s-%ld.bck", directory,
-           strtok(job_filename, "."), num_backup);
+/// Starts the scan of the pairs a backup writes: every pair, or the changed
+/// ones for a delta.
+/// @return 0 if successful, 1 otherwise.
+static int begin_backup_scan(BackupJob *job, Scan *scan) {
+  if (job->delta) {
+    scan_keys_begin(kvs_table, scan, &job->snapshot, job->changes.keys,
+                    job->changes.count);
+    return 0;
+  }
+  return scan_begin(kvs_table, scan, &job->snapshot, NULL, NULL);
+}
 
-  pthread_rwlock_rdlock(&kvs_table->tablelock);
-  pid = fork();
-  pthread_rwlock_unlock(&kvs_table->tablelock);
+/// Ends a backup, once it has been written.
+static void end_backup(BackupJob *job) {
+  snapshot_end(kvs_table, &job->snapshot);
+  changes_free(&job->changes);
+  free(job);
+}
+
+/// Writes a pair of a backup as SHOW does, followed by " <ms>" if it has a
+/// TTL, ms being the wall clock time it expires at (see load.h): unlike the
+/// ticks of the expiry clock, it still means the same once the server starts
+/// again. Async signal safe.
+/// @param now_ms Wall clock time at the tick now.
+static void backup_pair(Output *out, KeyNode *keyNode, uint64_t now_ms,
+                        uint32_t now) {
+  char buffer[LARGE_VALUE_SIZE];
+  size_t len;
+  const char *value = node_value(keyNode, buffer, &len);
+  uint32_t expires = atomic_load(&keyNode->expires);
+  if (expires == 0) {
+    output_pair(out, keyNode->key, value, len, ", ", "\n");
+    return;
+  }
+  // A pair expired already but not removed yet expires now, the load drops
+  // it
+  int32_t left = (int32_t)(expires - now);
+  output_pair(out, keyNode->key, value, len, ", ", " ");
+  output_uint(out, now_ms + (left > 0 ? (uint64_t)left * EXPIRY_TICK_MS : 0));
+  output_str(out, "\n");
+}
+
+/// Writes the pairs of a backup scan to its file, under its temporary name
+/// until it is complete, so the backup file is never seen half written. A
+/// delta starts with "DELTA <base>" and then has the changed keys in order:
+/// the pairs written as in a full backup and the keys removed as "(key)".
+/// Async signal safe, so the backup child can use it.
+/// @return 0 if successful, 1 otherwise.
+static int write_backup(Scan *scan, const BackupJob *job) {
+  int fd = open(job->tmp_path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+  if (fd < 0) {
+    return 1;
+  }
+  uint64_t now_ms = wall_clock_ms();
+  uint32_t now = atomic_load(&kvs_table->now);
+  Output out;
+  output_begin(&out, fd);
+  KeyNode *keyNode = scan_next(scan);
+  if (job->delta) {
+    output_str(&out, "DELTA ");
+    output_str(&out, job->base);
+    output_str(&out, "\n");
+    // The scan returns the keys still there, in the same order
+    for (size_t i = 0; i < job->changes.count; i++) {
+      const char *key = job->changes.keys[i];
+      if (keyNode != NULL && strcmp(keyNode->key, key) == 0) {
+        backup_pair(&out, keyNode, now_ms, now);
+        keyNode = scan_next(scan);
+      } else {
+        output_str(&out, "(");
+        output_encoded(&out, key, strlen(key));
+        output_str(&out, ")\n");
+      }
+    }
+  } else {
+    for (; keyNode != NULL; keyNode = scan_next(scan)) {
+      backup_pair(&out, keyNode, now_ms, now);
+    }
+  }
+  output_flush(&out);
+  struct timespec times[2] = {{0, UTIME_OMIT}, job->taken};
+  if (futimens(fd, times) != 0 || close(fd) != 0 ||
+      rename(job->tmp_path, job->path) != 0) {
+    unlink(job->tmp_path);
+    return 1;
+  }
+  return 0;
+}
+
+/// Writes a backup in the backup thread.
+/// @return 0 if successful, 1 otherwise.
+static int run_backup(void *arg) {
+  BackupJob *job = arg;
+  Scan scan;
+  int failed = begin_backup_scan(job, &scan);
+  if (!failed) {
+    failed = write_backup(&scan, job);
+    scan_end(&scan);
+  }
+  if (failed) {
+    fprintf(stderr, "Failed to write backup %s\n", job->path);
+  }
+  end_backup(job);
+  return failed;
+}
+
+/// Has a child process write a backup, and waits for it in the backup
+/// thread: the thread reaps its own child only, and the slot of the backup
+/// is only free again once the child is done.
+/// @return 0 if successful, 1 otherwise.
+static int fork_backup(void *arg) {
+  BackupJob *job = arg;
+  char path[PATH_MAX];
+  memcpy(path, job->path, sizeof(path));
+
+  // The scan is started before the fork, the child can only use async
+  // signal safe functions. It walks its own copy of the snapshot, so the
+  // parent ends it right after the fork.
+  Scan scan;
+  if (begin_backup_scan(job, &scan) != 0) {
+    fprintf(stderr, "Failed to write backup %s\n", path);
+    end_backup(job);
+    return 1;
+  }
+  pid_t pid = fork();
   if (pid == 0) {
     // functions used here have to be async signal safe, since this
     // fork happens in a multi thread context (see man fork)
-    int fd = open(bck_name, O_WRONLY | O_CREAT | O_TRUNC, 0666);
-    for (int i = 0; i < TABLE_SIZE; i++) {
-      KeyNode *keyNode = kvs_table->table[i]; // Get the next list head
-      while (keyNode != NULL) {
-        char aux[MAX_STRING_SIZE];
-        aux[0] = '(';
-        size_t num_bytes_copied = 1; // the "("
-        // the - 1 are all to leave space for the '/0'
-        num_bytes_copied += strn_memcpy(aux + num_bytes_copied, keyNode->key,
-                                        MAX_STRING_SIZE - num_bytes_copied - 1);
-        num_bytes_copied += strn_memcpy(aux + num_bytes_copied, ", ",
-                                        MAX_STRING_SIZE - num_bytes_copied - 1);
-        num_bytes_copied += strn_memcpy(aux + num_bytes_copied, keyNode->value,
-                                        MAX_STRING_SIZE - num_bytes_copied - 1);
-        num_bytes_copied += strn_memcpy(aux + num_bytes_copied, ")\n",
-                                        MAX_STRING_SIZE - num_bytes_copied - 1);
-        aux[num_bytes_copied] = '\0';
-        write_str(fd, aux);
-        keyNode = keyNode->next; // Move to the next node of the list
-      }
+    _exit(write_backup(&scan, job));
+  }
+  scan_end(&scan);
+  end_backup(job);
+
+  int status = 0;
+  pid_t reaped = -1;
+  if (pid > 0) {
+    while ((reaped = waitpid(pid, &status, 0)) < 0 && errno == EINTR) {
     }
-    exit(1);
-  } else if (pid < 0) {
+  }
+  if (reaped != pid || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+    fprintf(stderr, "Failed to write backup %s\n", path);
+    return 1;
+  }
+  return 0;
+}
+
+int kvs_backup(size_t num_backup, char *job_filename, char *directory) {
+  BackupJob *job = malloc(sizeof(BackupJob));
+  if (job == NULL) {
+    return -1;
+  }
+  // Waits here, before the snapshot, while the queue is full
+  BackupTask *task = backup_reserve(kvs_backups);
+  if (task == NULL) {
+    free(job);
     return -1;
   }
+  snprintf(job->name, sizeof(job->name), "%s-%zu.bck",
+           strtok(job_filename, "."), num_backup);
+  snprintf(job->path, sizeof(job->path), "%s/%s", directory, job->name);
+  snprintf(job->tmp_path, sizeof(job->tmp_path), "%s.tmp", job->path);
+  if (begin_backup(job) != 0) {
+    backup_cancel(kvs_backups, task);
+    free(job);
+    return -1;
+  }
+
+  // Writers carry on meanwhile, the backup walks the snapshot. The job goes
+  // on too, the backup waits in the queue if every backup thread is busy.
+  backup_submit(kvs_backups, task, fork_backups ? fork_backup : run_backup,
+                job);
   return 0;
 }
 
+void kvs_wait_backup() {
+  backup_wait(kvs_backups);
+}
+
 void kvs_wait(unsigned int delay_ms) {
   struct timespec delay = delay_to_timespec(delay_ms);
   nanosleep(&delay, NULL);
@@ -5,10 +5,40 @@
 
 #include "constants.h"
 #include "kvs.h"
+#include "wal.h"
 
 /// Initializes the KVS state.
-/// @return 0 if the KVS state was initialized successfully, 1 otherwise.
-HashTable *kvs_init();
+/// @param num_shards Number of independently locked shards of the table, at
+/// most MAX_SHARDS.
+/// @param num_workers Number of threads that run the parts of large batches
+/// in parallel.
+/// @param max_memory Bytes the table may use before pairs are evicted, 0 for
+/// no limit.
+/// @param max_backups Most backups written at once, each by a backup thread,
+/// at least 1.
+/// @param fork_backups 1 to have each backup written by a child process
+/// forked by its backup thread, 0 to have the thread write it.
+/// @return The KVS table, NULL if it could not be initialized.
+HashTable *kvs_init(size_t num_shards, size_t num_workers, size_t max_memory,
+                    size_t max_backups, int fork_backups);
+
+/// Replays a write-ahead log to restore the state it has, then logs every
+/// batch that changes the table to it from then on. Called once, after
+/// kvs_init and before any batch is run.
+/// @param path Path of the log, created if it does not exist.
+/// @param sync How the log is synced to disk.
+/// @param interval_ms Time between writes (and syncs) of the log, unless it
+/// is synced always.
+/// @return 0 if successful, 1 otherwise.
+int kvs_open_log(const char *path, WalSync sync, unsigned int interval_ms);
+
+/// Loads the pairs of a backup, following the chain of a delta back to its
+/// full backup. The backup is mapped in memory and split among the workers.
+/// Backups have no TTLs, the pairs loaded never expire. Called once, after
+/// kvs_init and before any batch is run.
+/// @param path Path of the backup.
+/// @return 0 if successful, 1 otherwise.
+int kvs_load_backup(const char *path);
 
 /// Destroys the KVS state.
 /// @return 0 if the KVS state was terminated successfully, 1 otherwise.
@@ -17,34 +47,96 @@ int kvs_terminate();
 /// Writes a key value pair to the KVS. If key already exists it is updated.
 /// @param num_pairs Number of pairs being written.
 /// @param keys Array of keys' strings.
-/// @param values Array of values' strings.
+/// @param values Array of values, the blobs of large values are kept by the
+/// KVS instead of copied.
+/// @param ttl_ms Milliseconds until the pairs expire, 0 if they never do.
+/// @param fd File descriptor to write the keys that could not be written to
+/// (KVSERROR), -1 to only return whether they were.
 /// @return 0 if the pairs were written successfully, 1 otherwise.
-int kvs_write(size_t num_pairs, char keys[][MAX_STRING_SIZE],
-              char values[][MAX_STRING_SIZE]);
+int kvs_write(size_t num_pairs, char *keys[], const Value values[],
+              unsigned int ttl_ms, int fd);
 
 /// Reads values from the KVS.
 /// @param num_pairs Number of pairs to read.
 /// @param keys Array of keys' strings.
 /// @param fd File descriptor to write the (successful) output.
 /// @return 0 if the key reading, 1 otherwise.
-int kvs_read(size_t num_pairs, char keys[][MAX_STRING_SIZE], int fd);
+int kvs_read(size_t num_pairs, char *keys[], int fd);
 
 /// Deletes key value pairs from the KVS.
 /// @param num_pairs Number of pairs to read.
 /// @param keys Array of keys' strings.
 /// @return 0 if the pairs were deleted successfully, 1 otherwise.
-int kvs_delete(size_t num_pairs, char keys[][MAX_STRING_SIZE], int fd);
+int kvs_delete(size_t num_pairs, char *keys[], int fd);
+
+/// Adds to the integer values of keys, as a single read and write of each
+/// key. A missing key counts from 0.
+/// @param num_pairs Number of keys.
+/// @param keys Array of keys' strings.
+/// @param deltas Array of amounts to add, as decimal integers.
+/// @param fd File descriptor to write the new values (or KVSERROR if a value
+/// or amount is not an integer).
+/// @return 0 if the batch was run, 1 otherwise.
+int kvs_incr(size_t num_pairs, char *keys[], const Value deltas[], int fd);
+
+/// Appends to the values of keys, as a single read and write of each key. A
+/// missing key is written with the suffix as its value.
+/// @param num_pairs Number of keys.
+/// @param keys Array of keys' strings.
+/// @param values Array of suffixes.
+/// @param fd File descriptor to write the keys that could not be appended to.
+/// @return 0 if the batch was run, 1 otherwise.
+int kvs_append(size_t num_pairs, char *keys[], const Value values[], int fd);
+
+/// Replaces the values of keys that have the expected ones, as a single read
+/// and write of each key.
+/// @param num_pairs Number of keys.
+/// @param keys Array of keys' strings.
+/// @param values Array with the expected value of key i at 2i and its new
+/// value at 2i + 1.
+/// @param fd File descriptor to write the keys that were not replaced
+/// (KVSMISSING or KVSMISMATCH).
+/// @return 0 if the batch was run, 1 otherwise.
+int kvs_cas(size_t num_pairs, char *keys[], const Value values[], int fd);
+
+/// Writes the pairs with start <= key <= end, sorted by key.
+/// @param start First key of the range.
+/// @param end Last key of the range.
+/// @param fd File descriptor to write the output.
+/// @return 0 if the range was scanned successfully, 1 otherwise.
+int kvs_scan(const char *start, const char *end, int fd);
+
+/// Checks if a key is in the KVS.
+/// @param key Key to look for.
+/// @return 1 if the key exists, 0 otherwise.
+int kvs_key_exists(const char *key);
 
 /// Writes the state of the KVS.
 /// @param fd File descriptor to write the output.
 void kvs_show(int fd);
 
+/// Writes the statistics of the KVS: the lookups of missing keys answered by
+/// the Bloom filters, the ones that got past them and the false positive
+/// rate of the filters, then the backups queued, being written and finished,
+/// and how long they waited in the queue and took to be written.
+/// @param fd File descriptor to write the output.
+void kvs_stats(int fd);
+
 /// Creates a backup of the KVS state and stores it in the correspondent
-/// backup file
-/// @return 0 if the backup was successful, 1 otherwise.
+/// backup file. The state is the one of the call, the file is written in the
+/// background (by a backup thread, or by a child process) under a temporary
+/// name and renamed once complete. Never waits for other backups: if as many
+/// as allowed are being written, the backup is queued.
+/// @return 0 if the backup was queued, -1 otherwise.
 int kvs_backup(size_t num_backup, char *job_filename, char *directory);
 
-/// Waits for the last backup to be called.
+/// Sets how often backups are full: every interval backups (counted across
+/// all jobs), the ones in between are deltas of the previous backup.
+/// @param interval Backups per full backup, 1 (the default) for only full
+/// backups.
+void kvs_set_full_backup_interval(size_t interval);
+
+/// Waits for the backups queued and being written.
 void kvs_wait_backup();
 
 /// Waits for a given amount of time.
@@ -1,65 +1,391 @@
 #include "parser.h"
 
+#include <errno.h>
 #include <limits.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <unistd.h>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 
 #include "constants.h"
 #include "io.h"
+#include "src/common/constants.h"
+
+int reader_init(JobReader *reader, int fd) {
+  *reader = (JobReader){fd, NULL, 0, 0, 0, NULL};
+  struct stat st;
+  if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+    void *data = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (data != MAP_FAILED) {
+      posix_madvise(data, (size_t)st.st_size, POSIX_MADV_SEQUENTIAL);
+      reader->data = data;
+      reader->len = (size_t)st.st_size;
+      reader->map_size = (size_t)st.st_size;
+      return 0;
+    }
+  }
+
+  // Not a regular file, or it could not be mapped
+  reader->buffer = malloc(JOB_BUFFER_SIZE);
+  if (reader->buffer == NULL) {
+    return 1;
+  }
+  reader->data = reader->buffer;
+  return 0;
+}
+
+void reader_destroy(JobReader *reader) {
+  if (reader->map_size > 0) {
+    munmap((void *)reader->data, reader->map_size);
+  }
+  free(reader->buffer);
+  *reader = (JobReader){-1, NULL, 0, 0, 0, NULL};
+}
+
+// Reads the next bytes of a job into the buffer, once it was all parsed.
+// @param reader Input of the job.
+// @return 1 if there are bytes to parse, 0 at the end of the job.
+static int refill(JobReader *reader) {
+  if (reader->map_size > 0) {
+    return 0;
+  }
+  ssize_t n;
+  while ((n = read(reader->fd, reader->buffer, JOB_BUFFER_SIZE)) < 0 &&
+         errno == EINTR) {
+  }
+  reader->pos = 0;
+  reader->len = n > 0 ? (size_t)n : 0;
+  return n > 0;
+}
+
+// Takes the next byte of a job.
+// @param reader Input of the job.
+// @param ch To store the byte in.
+// @return 1 if successful, 0 at the end of the job.
+static int next_char(JobReader *reader, char *ch) {
+  if (reader->pos == reader->len && !refill(reader)) {
+    return 0;
+  }
+  *ch = reader->data[reader->pos++];
+  return 1;
+}
+
+// Takes the next bytes of a job, like read(2) on the job file would.
+// @param reader Input of the job.
+// @param dest To copy the bytes to.
+// @param n Number of bytes.
+// @return Number of bytes copied, less than n at the end of the job.
+static size_t read_bytes(JobReader *reader, char *dest, size_t n) {
+  size_t done = 0;
+  while (done < n && (reader->pos < reader->len || refill(reader))) {
+    size_t chunk = reader->len - reader->pos;
+    if (chunk > n - done) {
+      chunk = n - done;
+    }
+    memcpy(dest + done, reader->data + reader->pos, chunk);
+    reader->pos += chunk;
+    done += chunk;
+  }
+  return done;
+}
+
+// Reads the length of a length prefixed string, after its '$'.
+// @param reader Input of the job.
+// @param max Maximum length.
+// @param len Pointer to store the length in.
+// @return 0 if successful, 1 otherwise.
+static int read_length(JobReader *reader, size_t max, size_t *len) {
+  char ch;
+  size_t digits = 0;
+  *len = 0;
+  while (next_char(reader, &ch)) {
+    if (ch == ':') {
+      return digits == 0;
+    }
+    if (ch < '0' || ch > '9') {
+      return 1;
+    }
+    *len = *len * 10 + (size_t)(ch - '0');
+    if (*len > max) {
+      return 1;
+    }
+    digits++;
+  }
+  return 1;
+}
+
+// Maps a delimiter to the value read_token returns for it.
+static int delimiter(char ch) {
+  switch (ch) {
+  case ',':
+    return 0;
+  case ')':
+    return 1;
+  case ']':
+    return 2;
+  default:
+    return -1;
+  }
+}
 
 // Reads a string and indicates the position from where it was
-// extracted, based on the KVS specification.
-// @param fd File to read from.
-// @param buffer To write the string in.
-// @param max Maximum string size.
-static int read_string(int fd, char *buffer, size_t max) {
-  ssize_t bytes_read;
+// extracted, based on the KVS specification. The string is either ended by
+// a delimiter or length prefixed.
+// @param reader Input of the job.
+// @param buffer To write the string in, null terminated.
+// @param max Maximum string length (the buffer has max + 1 bytes).
+// @param len Pointer to store the length of the string in.
+// @param blob If not NULL, a length prefixed string of at least
+// LARGE_VALUE_SIZE bytes is read straight into a new blob, stored here.
+static int read_token(JobReader *reader, char *buffer, size_t max, size_t *len,
+                       Blob **blob) {
   char ch;
   size_t i = 0;
   int value = -1;
 
-  while (i < max) {
-    bytes_read = read(fd, &ch, 1);
+  if (!next_char(reader, &ch)) {
+    return -1;
+  }
 
-    if (bytes_read <= 0) {
+  if (ch == '$') {
+    if (read_length(reader, max, len) != 0) {
       return -1;
     }
 
+    char *dest = buffer;
+    if (blob != NULL && *len >= LARGE_VALUE_SIZE) {
+      if ((*blob = blob_create(*len)) == NULL) {
+        return -1;
+      }
+      dest = (*blob)->data;
+    }
+    if (read_bytes(reader, dest, *len) != *len || !next_char(reader, &ch) ||
+        (value = delimiter(ch)) < 0) {
+      if (blob != NULL) {
+        blob_release(*blob);
+        *blob = NULL;
+      }
+      return -1;
+    }
+    dest[*len] = '\0';
+    return value;
+  }
+
+  while (1) {
     if (ch == ' ') {
       return -1;
     }
 
-    if (ch == ',') {
-      value = 0;
-      break;
-    } else if (ch == ')') {
-      value = 1;
-      break;
-    } else if (ch == ']') {
-      value = 2;
+    if ((value = delimiter(ch)) >= 0) {
       break;
     }
 
+    if (i == max) {
+      return -1;
+    }
     buffer[i++] = ch;
+
+    if (!next_char(reader, &ch)) {
+      return -1;
+    }
   }
 
   buffer[i] = '\0';
+  *len = i;
 
   return value;
 }
 
+// Finds the first byte that ends a plain string: a delimiter, or a space
+// (which is invalid in one). Strings are short, but a bracket list is walked
+// in a single pass, each search starting where the previous string ended.
+// @param p Start of the bytes to search.
+// @param end End of the bytes to search, not read.
+// @return The position of the byte, end if there is none.
+#if defined(__SSE2__)
+static const char *find_stop(const char *p, const char *end) {
+  const __m128i comma = _mm_set1_epi8(',');
+  const __m128i paren = _mm_set1_epi8(')');
+  const __m128i bracket = _mm_set1_epi8(']');
+  const __m128i space = _mm_set1_epi8(' ');
+  // 16 bytes at a time, never past end (the mapping may end with a page)
+  for (; end - p >= 16; p += 16) {
+    __m128i bytes = _mm_loadu_si128((const __m128i *)(const void *)p);
+    __m128i stops =
+        _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(bytes, comma),
+                                  _mm_cmpeq_epi8(bytes, paren)),
+                     _mm_or_si128(_mm_cmpeq_epi8(bytes, bracket),
+                                  _mm_cmpeq_epi8(bytes, space)));
+    unsigned int mask = (unsigned int)_mm_movemask_epi8(stops);
+    if (mask != 0) {
+      return p + __builtin_ctz(mask);
+    }
+  }
+  for (; p < end; p++) {
+    if (*p == ',' || *p == ')' || *p == ']' || *p == ' ') {
+      return p;
+    }
+  }
+  return end;
+}
+#else
+// Portable fallback, looks at the bytes one at a time
+static const char *find_stop(const char *p, const char *end) {
+  for (; p < end; p++) {
+    if (*p == ',' || *p == ')' || *p == ']' || *p == ' ') {
+      return p;
+    }
+  }
+  return end;
+}
+#endif
+
+// Reads a string of a mapped job in place, with the same rules and leaving
+// the reader at the same byte as read_token.
+// @param reader Input of the job, mapped.
+// @param max Maximum string length.
+// @param data Pointer to store the start of the string in, not terminated.
+// @param len Pointer to store the length of the string in.
+// @return The value of read_token.
+static int read_slice(JobReader *reader, size_t max, const char **data,
+                      size_t *len) {
+  const char *start = reader->data + reader->pos;
+  const char *end = reader->data + reader->len;
+  if (start == end) {
+    return -1;
+  }
+
+  if (*start == '$') {
+    reader->pos++;
+    if (read_length(reader, max, len) != 0) {
+      return -1;
+    }
+    if (reader->len - reader->pos <= *len) {
+      reader->pos = reader->len;
+      return -1;
+    }
+    *data = reader->data + reader->pos;
+    reader->pos += *len + 1;
+    return delimiter(reader->data[reader->pos - 1]);
+  }
+
+  // A string of max bytes is followed by its stop, a longer one is invalid
+  const char *limit = (size_t)(end - start) > max ? start + max + 1 : end;
+  const char *stop = find_stop(start, limit);
+  if (stop == limit) {
+    // Too long, or the job ended first
+    reader->pos += (size_t)(limit - start);
+    return -1;
+  }
+  reader->pos += (size_t)(stop - start) + 1;
+  if (*stop == ' ') {
+    return -1;
+  }
+  *data = start;
+  *len = (size_t)(stop - start);
+  return delimiter(*stop);
+}
+
+// Reads a key into the arena of the arguments of a command.
+// @param reader Input of the job.
+// @param args The arguments.
+// @param index Index of the key.
+// @return The value of read_token.
+static int read_key(JobReader *reader, Args *args, size_t index) {
+  char *key = args->arena + args->used;
+  size_t len;
+  int result;
+  if (reader->map_size > 0) {
+    // The table needs keys null terminated, so they are still copied
+    const char *data;
+    if ((result = read_slice(reader, MAX_KEY_SIZE - 1, &data, &len)) >= 0) {
+      memcpy(key, data, len);
+      key[len] = '\0';
+    }
+  } else {
+    result = read_token(reader, key, MAX_KEY_SIZE - 1, &len, NULL);
+  }
+  // Keys are null terminated strings
+  if (result < 0 || memchr(key, '\0', len) != NULL) {
+    return -1;
+  }
+
+  args->keys[index] = key;
+  args->used += len + 1;
+  return result;
+}
+
+// Reads a value into the arguments of a command. A small value of a mapped
+// job is left in place, one of a job read through the buffer ends up in the
+// arena (the buffer is refilled meanwhile), a large one in a blob.
+// @param reader Input of the job.
+// @param args The arguments.
+// @param index Index of the value.
+// @return The value of read_token.
+static int read_value(JobReader *reader, Args *args, size_t index) {
+  Value *value = &args->values[index];
+  Blob *blob = NULL;
+  size_t len;
+  int result;
+  if (reader->map_size > 0) {
+    const char *data;
+    if ((result = read_slice(reader, MAX_VALUE_SIZE, &data, &len)) < 0) {
+      return -1;
+    }
+    if (len >= LARGE_VALUE_SIZE) {
+      // The table keeps large values, not the job they were read from
+      if ((blob = blob_create(len)) == NULL) {
+        return -1;
+      }
+      memcpy(blob->data, data, len);
+      *value = (Value){blob->data, len, blob};
+    } else {
+      *value = (Value){data, len, NULL};
+    }
+    args->num_values = index + 1;
+    return result;
+  }
+
+  result = read_token(reader, args->scratch, MAX_VALUE_SIZE, &len, &blob);
+  if (result < 0) {
+    return -1;
+  }
+
+  if (blob == NULL && len >= LARGE_VALUE_SIZE) {
+    if ((blob = blob_create(len)) == NULL) {
+      return -1;
+    }
+    memcpy(blob->data, args->scratch, len);
+  }
+
+  if (blob != NULL) {
+    *value = (Value){blob->data, len, blob};
+  } else {
+    char *dest = args->arena + args->used;
+    memcpy(dest, args->scratch, len + 1);
+    args->used += len + 1;
+    *value = (Value){dest, len, NULL};
+  }
+  args->num_values = index + 1;
+  return result;
+}
+
 // Reads a number and stores it in an unsigned integer
 // variable.
-// @param fd File to read from.
+// @param reader Input of the job.
 // @param value To store the number in.
 // @param next Will point to the character succeding the number.
-static int read_uint(int fd, unsigned int *value, char *next) {
+// @return 0 if successful, 1 if the number does not fit.
+static int read_uint(JobReader *reader, unsigned int *value, char *next) {
   char buf[16];
 
-  int i = 0;
+  size_t i = 0;
   while (1) {
-    if (read(fd, buf + i, 1) == 0) {
+    if (!next_char(reader, buf + i)) {
       *next = '\0';
       break;
     }
@@ -67,12 +393,15 @@ static int read_uint(int fd, unsigned int *value, char *next) {
     *next = buf[i];
 
     if (buf[i] > '9' || buf[i] < '0') {
-      buf[i] = '\0';
       break;
     }
 
-    i++;
+    // Far more digits than UINT_MAX has, the number cannot fit
+    if (++i == sizeof(buf) - 1) {
+      return 1;
+    }
   }
+  buf[i] = '\0';
 
   unsigned long ul = strtoul(buf, NULL, 10);
 
@@ -85,25 +414,45 @@ static int read_uint(int fd, unsigned int *value, char *next) {
   return 0;
 }
 
-// Jumps file descriptor to next line.
-// @param fd File descriptor.
-static void cleanup(int fd) {
-  char ch;
-  while (read(fd, &ch, 1) == 1 && ch != '\n')
-    ;
+// Jumps to the next line.
+// @param reader Input of the job.
+static void cleanup(JobReader *reader) {
+  do {
+    const char *start = reader->data + reader->pos;
+    const char *end = memchr(start, '\n', reader->len - reader->pos);
+    if (end != NULL) {
+      reader->pos += (size_t)(end - start) + 1;
+      return;
+    }
+    reader->pos = reader->len;
+  } while (refill(reader));
 }
 
-enum Command get_next(int fd) {
+enum Command get_next(JobReader *reader) {
   char buf[16];
-  if (read(fd, buf, 1) != 1) {
+  if (read_bytes(reader, buf, 1) != 1) {
     return EOC;
   }
 
   switch (buf[0]) {
   case 'W':
-    if (read(fd, buf + 1, 4) != 4 || strncmp(buf, "WAIT ", 5) != 0) {
-      if (read(fd, buf + 5, 1) != 1 || strncmp(buf, "WRITE ", 6) != 0) {
-        cleanup(fd);
+    if (read_bytes(reader, buf + 1, 4) != 4 || strncmp(buf, "WAIT ", 5) != 0) {
+      if (read_bytes(reader, buf + 5, 1) != 1) {
+        cleanup(reader);
+        return CMD_INVALID;
+      }
+
+      if (strncmp(buf, "WRITET", 6) == 0) {
+        if (read_bytes(reader, buf + 6, 3) != 3 ||
+            strncmp(buf, "WRITETTL ", 9) != 0) {
+          cleanup(reader);
+          return CMD_INVALID;
+        }
+        return CMD_WRITE_TTL;
+      }
+
+      if (strncmp(buf, "WRITE ", 6) != 0) {
+        cleanup(reader);
         return CMD_INVALID;
       }
       return CMD_WRITE;
@@ -111,122 +460,209 @@ enum Command get_next(int fd) {
 
     return CMD_WAIT;
 
+  case 'I':
+    if (read_bytes(reader, buf + 1, 4) != 4 || strncmp(buf, "INCR ", 5) != 0) {
+      cleanup(reader);
+      return CMD_INVALID;
+    }
+
+    return CMD_INCR;
+
+  case 'A':
+    if (read_bytes(reader, buf + 1, 6) != 6 ||
+        strncmp(buf, "APPEND ", 7) != 0) {
+      cleanup(reader);
+      return CMD_INVALID;
+    }
+
+    return CMD_APPEND;
+
+  case 'C':
+    if (read_bytes(reader, buf + 1, 3) != 3 || strncmp(buf, "CAS ", 4) != 0) {
+      cleanup(reader);
+      return CMD_INVALID;
+    }
+
+    return CMD_CAS;
+
   case 'R':
-    if (read(fd, buf + 1, 4) != 4 || strncmp(buf, "READ ", 5) != 0) {
-      cleanup(fd);
+    if (read_bytes(reader, buf + 1, 4) != 4 || strncmp(buf, "READ ", 5) != 0) {
+      cleanup(reader);
       return CMD_INVALID;
     }
 
     return CMD_READ;
 
   case 'D':
-    if (read(fd, buf + 1, 6) != 6 || strncmp(buf, "DELETE ", 7) != 0) {
-      cleanup(fd);
+    if (read_bytes(reader, buf + 1, 6) != 6 ||
+        strncmp(buf, "DELETE ", 7) != 0) {
+      cleanup(reader);
       return CMD_INVALID;
     }
 
     return CMD_DELETE;
 
   case 'S':
-    if (read(fd, buf + 1, 3) != 3 || strncmp(buf, "SHOW", 4) != 0) {
-      cleanup(fd);
+    if (read_bytes(reader, buf + 1, 3) != 3) {
+      cleanup(reader);
       return CMD_INVALID;
     }
 
-    if (read(fd, buf + 4, 1) != 0 && buf[4] != '\n') {
-      cleanup(fd);
+    if (strncmp(buf, "SCAN", 4) == 0) {
+      if (read_bytes(reader, buf + 4, 1) != 1 || buf[4] != ' ') {
+        cleanup(reader);
+        return CMD_INVALID;
+      }
+
+      return CMD_SCAN;
+    }
+
+    if (strncmp(buf, "STAT", 4) == 0) {
+      if (read_bytes(reader, buf + 4, 1) != 1 || buf[4] != 'S') {
+        cleanup(reader);
+        return CMD_INVALID;
+      }
+
+      if (read_bytes(reader, buf + 5, 1) != 0 && buf[5] != '\n') {
+        cleanup(reader);
+        return CMD_INVALID;
+      }
+
+      return CMD_STATS;
+    }
+
+    if (strncmp(buf, "SHOW", 4) != 0) {
+      cleanup(reader);
+      return CMD_INVALID;
+    }
+
+    if (read_bytes(reader, buf + 4, 1) != 0 && buf[4] != '\n') {
+      cleanup(reader);
       return CMD_INVALID;
     }
 
     return CMD_SHOW;
 
   case 'B':
-    if (read(fd, buf + 1, 5) != 5 || strncmp(buf, "BACKUP", 6) != 0) {
-      cleanup(fd);
+    if (read_bytes(reader, buf + 1, 5) != 5 || strncmp(buf, "BACKUP", 6) != 0) {
+      cleanup(reader);
       return CMD_INVALID;
     }
 
-    if (read(fd, buf + 6, 1) != 0 && buf[6] != '\n') {
-      cleanup(fd);
+    if (read_bytes(reader, buf + 6, 1) != 0 && buf[6] != '\n') {
+      cleanup(reader);
       return CMD_INVALID;
     }
 
     return CMD_BACKUP;
 
   case 'H':
-    if (read(fd, buf + 1, 3) != 3 || strncmp(buf, "HELP", 4) != 0) {
-      cleanup(fd);
+    if (read_bytes(reader, buf + 1, 3) != 3 || strncmp(buf, "HELP", 4) != 0) {
+      cleanup(reader);
       return CMD_INVALID;
     }
 
-    if (read(fd, buf + 4, 1) != 0 && buf[4] != '\n') {
-      cleanup(fd);
+    if (read_bytes(reader, buf + 4, 1) != 0 && buf[4] != '\n') {
+      cleanup(reader);
       return CMD_INVALID;
     }
 
     return CMD_HELP;
 
   case '#':
-    cleanup(fd);
+    cleanup(reader);
     return CMD_EMPTY;
 
   case '\n':
     return CMD_EMPTY;
 
   default:
-    cleanup(fd);
+    cleanup(reader);
     return CMD_INVALID;
   }
 }
 
-// Parses a key value pair.
-// @param fd File decriptor to read from.
-// @param key Pointer where the key will be stored
-// @param value Pointer where the value will be stored
+int args_init(Args *args) {
+  args->num_values = 0;
+  args->used = 0;
+  args->arena = malloc(MAX_WRITE_SIZE * (MAX_KEY_SIZE + LARGE_VALUE_SIZE));
+  args->scratch = malloc(MAX_VALUE_SIZE + 1);
+  if (args->arena == NULL || args->scratch == NULL) {
+    args_destroy(args);
+    return 1;
+  }
+  return 0;
+}
+
+void args_clear(Args *args) {
+  for (size_t i = 0; i < args->num_values; i++) {
+    blob_release(args->values[i].blob);
+  }
+  args->num_values = 0;
+  args->used = 0;
+}
+
+void args_destroy(Args *args) {
+  args_clear(args);
+  free(args->arena);
+  free(args->scratch);
+  args->arena = NULL;
+  args->scratch = NULL;
+}
+
+// Parses a tuple of a key and its values.
+// @param reader Input of the job.
+// @param args Arguments to store the tuple in.
+// @param index Index of the tuple.
+// @param width Number of values of the tuple, stored from values[index *
+// width] on.
 // @return 1 if successful, 0 otherwise.
-int parse_pair(int fd, char *key, char *value) {
-  if (read_string(fd, key, MAX_STRING_SIZE) != 0) {
-    cleanup(fd);
+static int parse_tuple(JobReader *reader, Args *args, size_t index,
+                       size_t width) {
+  if (read_key(reader, args, index) != 0) {
+    cleanup(reader);
     return 0;
   }
 
-  if (read_string(fd, value, MAX_STRING_SIZE) != 1) {
-    cleanup(fd);
-    return 0;
+  // Every value but the last one is ended by a ','
+  for (size_t i = 0; i < width; i++) {
+    if (read_value(reader, args, index * width + i) != (i + 1 == width)) {
+      cleanup(reader);
+      return 0;
+    }
   }
 
   return 1;
 }
 
-size_t parse_write(int fd, char keys[][MAX_STRING_SIZE],
-                   char values[][MAX_STRING_SIZE], size_t max_pairs,
-                   size_t max_string_size) {
+// Parses a list of tuples, [(key,value,...)(key2,value2,...)...].
+// @param width Number of values of each tuple.
+// @return 0 if the command was not parsed successfully, otherwise the
+// number of tuples parsed.
+static size_t parse_tuples(JobReader *reader, Args *args, size_t max_pairs,
+                           size_t width) {
   char ch;
 
-  if (read(fd, &ch, 1) != 1 || ch != '[') {
-    cleanup(fd);
+  if (!next_char(reader, &ch) || ch != '[') {
+    cleanup(reader);
     return 0;
   }
 
-  if (read(fd, &ch, 1) != 1 || ch != '(') {
-    cleanup(fd);
+  if (!next_char(reader, &ch) || ch != '(') {
+    cleanup(reader);
     return 0;
   }
 
   size_t num_pairs = 0;
-  char key[max_string_size];
-  char value[max_string_size];
   while (num_pairs < max_pairs) {
-    if (parse_pair(fd, key, value) == 0) {
-      cleanup(fd);
+    if (parse_tuple(reader, args, num_pairs, width) == 0) {
+      cleanup(reader);
       return 0;
     }
+    num_pairs++;
 
-    strcpy(keys[num_pairs], key);
-    strcpy(values[num_pairs++], value);
-
-    if (read(fd, &ch, 1) != 1 || (ch != '(' && ch != ']')) {
-      cleanup(fd);
+    if (!next_char(reader, &ch) || (ch != '(' && ch != ']')) {
+      cleanup(reader);
       return 0;
     }
 
@@ -236,37 +672,42 @@ size_t parse_write(int fd, char keys[][MAX_STRING_SIZE],
   }
 
   if (num_pairs == max_pairs) {
-    cleanup(fd);
+    cleanup(reader);
     return 0;
   }
 
-  if (read(fd, &ch, 1) != 1 || (ch != '\n' && ch != '\0')) {
-    cleanup(fd);
+  if (!next_char(reader, &ch) || (ch != '\n' && ch != '\0')) {
+    cleanup(reader);
     return 0;
   }
 
   return num_pairs;
 }
 
-size_t parse_read_delete(int fd, char keys[][MAX_STRING_SIZE], size_t max_keys,
-                         size_t max_string_size) {
+size_t parse_write(JobReader *reader, Args *args, size_t max_pairs) {
+  return parse_tuples(reader, args, max_pairs, 1);
+}
+
+size_t parse_cas(JobReader *reader, Args *args, size_t max_triples) {
+  return parse_tuples(reader, args, max_triples, 2);
+}
+
+size_t parse_read_delete(JobReader *reader, Args *args, size_t max_keys) {
   char ch;
 
-  if (read(fd, &ch, 1) != 1 || ch != '[') {
-    cleanup(fd);
+  if (!next_char(reader, &ch) || ch != '[') {
+    cleanup(reader);
     return 0;
   }
 
   size_t num_keys = 0;
-  char key[max_string_size];
   while (num_keys < max_keys) {
-    int output = read_string(fd, key, max_string_size);
+    int output = read_key(reader, args, num_keys);
     if (output < 0 || output == 1) {
-      cleanup(fd);
+      cleanup(reader);
       return 0;
     }
-
-    strcpy(keys[num_keys++], key);
+    num_keys++;
 
     if (output == 2) {
       break;
@@ -274,34 +715,46 @@ size_t parse_read_delete(int fd, char keys[][MAX_STRING_SIZE], size_t max_keys,
   }
 
   if (num_keys == max_keys) {
-    cleanup(fd);
+    cleanup(reader);
     return 0;
   }
 
-  if (read(fd, &ch, 1) != 1 || (ch != '\n' && ch != '\0')) {
-    cleanup(fd);
+  if (!next_char(reader, &ch) || (ch != '\n' && ch != '\0')) {
+    cleanup(reader);
     return 0;
   }
 
   return num_keys;
 }
 
-int parse_wait(int fd, unsigned int *delay, unsigned int *thread_id) {
+int parse_ttl(JobReader *reader, unsigned int *ttl_ms) {
+  char ch;
+
+  if (read_uint(reader, ttl_ms, &ch) != 0 || ch != ' ' || *ttl_ms == 0) {
+    cleanup(reader);
+    return 1;
+  }
+
+  return 0;
+}
+
+int parse_wait(JobReader *reader, unsigned int *delay,
+               unsigned int *thread_id) {
   char ch;
 
-  if (read_uint(fd, delay, &ch) != 0) {
-    cleanup(fd);
+  if (read_uint(reader, delay, &ch) != 0) {
+    cleanup(reader);
     return -1;
   }
 
   if (ch == ' ') {
     if (thread_id == NULL) {
-      cleanup(fd);
+      cleanup(reader);
       return 0;
     }
 
-    if (read_uint(fd, thread_id, &ch) != 0 || (ch != '\n' && ch != '\0')) {
-      cleanup(fd);
+    if (read_uint(reader, thread_id, &ch) != 0 || (ch != '\n' && ch != '\0')) {
+      cleanup(reader);
       return -1;
     }
 
@@ -309,7 +762,57 @@ int parse_wait(int fd, unsigned int *delay, unsigned int *thread_id) {
   } else if (ch == '\n' || ch == '\0') {
     return 0;
   } else {
-    cleanup(fd);
+    cleanup(reader);
     return -1;
   }
 }
+
+void parse_command(JobReader *reader, Args *args, JobCommand *command) {
+  args_clear(args);
+  *command = (JobCommand){get_next(reader), 0, args->keys, args->values, 0};
+  size_t num_keys = 0;
+  switch (command->command) {
+  case CMD_WRITE:
+  case CMD_INCR:
+  case CMD_APPEND:
+    num_keys = parse_write(reader, args, MAX_WRITE_SIZE);
+    break;
+  case CMD_WRITE_TTL:
+    if (parse_ttl(reader, &command->number) == 0) {
+      num_keys = parse_write(reader, args, MAX_WRITE_SIZE);
+    }
+    break;
+  case CMD_CAS:
+    num_keys = parse_cas(reader, args, MAX_WRITE_SIZE / 2);
+    break;
+  case CMD_READ:
+  case CMD_DELETE:
+    num_keys = parse_read_delete(reader, args, MAX_WRITE_SIZE);
+    break;
+  case CMD_SCAN:
+    // The range is given as two keys, [start,end]
+    num_keys = parse_read_delete(reader, args, MAX_WRITE_SIZE);
+    if (num_keys != 2) {
+      num_keys = 0;
+    }
+    break;
+  case CMD_WAIT:
+    if (parse_wait(reader, &command->number, NULL) == -1) {
+      command->command = CMD_INVALID;
+    }
+    return;
+  case CMD_SHOW:
+  case CMD_STATS:
+  case CMD_BACKUP:
+  case CMD_HELP:
+  case CMD_EMPTY:
+  case CMD_INVALID:
+  case EOC:
+    return;
+  }
+
+  if (num_keys == 0) {
+    command->command = CMD_INVALID;
+  }
+  command->num_keys = num_keys;
+}
@@ -4,12 +4,19 @@
 #include <stddef.h>
 
 #include "constants.h"
+#include "value.h"
 
 enum Command {
   CMD_WRITE,
+  CMD_WRITE_TTL,
+  CMD_INCR,
+  CMD_APPEND,
+  CMD_CAS,
   CMD_READ,
   CMD_DELETE,
   CMD_SHOW,
+  CMD_SCAN,
+  CMD_STATS,
   CMD_WAIT,
   CMD_BACKUP,
   CMD_HELP,
@@ -18,41 +25,129 @@ enum Command {
   EOC // End of commands
 };
 
-// Parses input from the given file descriptor, according to
+// Size of the buffer a job is read through when it cannot be mapped
+#define JOB_BUFFER_SIZE (64 * 1024)
+
+// Input of a job. A regular file is mapped in memory and parsed in place,
+// anything else (a pipe) is read through a buffer a large read at a time.
+// Either way the parser takes its bytes from memory, not a read per byte.
+typedef struct JobReader {
+  int fd;
+  const char *data; // The mapped file, or the buffer
+  size_t pos;       // Next byte to parse
+  size_t len;       // Bytes in data
+  size_t map_size;  // Size of the mapping, 0 if read through the buffer
+  char *buffer;
+} JobReader;
+
+/// Sets up the input of a job.
+/// @param reader Reader to initialize.
+/// @param fd File descriptor of the job, still owned by the caller.
+/// @return 0 if successful, 1 otherwise.
+int reader_init(JobReader *reader, int fd);
+
+/// Releases the mapping or the buffer of the input of a job.
+/// @param reader The reader.
+void reader_destroy(JobReader *reader);
+
+// Parses input from the given reader, according to
 // KVS specification.
-// @param fd File descriptor of input.
+// @param reader Input of the job.
 // @return enum Command Command code.
-enum Command get_next(int fd);
+enum Command get_next(JobReader *reader);
+
+// Arguments of a command, reused by every command of a job and cleared, not
+// zeroed, between them. A small value of a mapped job points into the job
+// itself, nothing is copied; one read through the buffer is copied to an
+// arena, as are keys (the table needs them null terminated). A large value is
+// read into a blob of its own, which the table then keeps.
+typedef struct Args {
+  char *keys[MAX_WRITE_SIZE];
+  Value values[MAX_WRITE_SIZE];
+  size_t num_values; // Values parsed, their blobs are released by args_clear
+  char *arena;       // Room for MAX_WRITE_SIZE keys and small values
+  size_t used;
+  // Values read through the buffer are read here first, MAX_VALUE_SIZE + 1
+  char *scratch;
+} Args;
+
+/// Allocates the buffers of the arguments of a job.
+/// @param args Arguments to initialize.
+/// @return 0 if successful, 1 otherwise.
+int args_init(Args *args);
+
+/// Forgets the arguments of the last command, releasing its blobs.
+/// @param args The arguments.
+void args_clear(Args *args);
+
+/// Frees the arguments of a job.
+/// @param args The arguments.
+void args_destroy(Args *args);
+
+// A command of a job as it is run: parsed from the text of a job, or decoded
+// from a compiled one (see jobc.h).
+typedef struct JobCommand {
+  enum Command command; // CMD_INVALID if its arguments are not valid
+  size_t num_keys;
+  char **keys;
+  // Values of the keys: one per key, two for CAS (see parse_cas), none for
+  // READ, DELETE and SCAN
+  const Value *values;
+  unsigned int number; // TTL of WRITETTL, delay of WAIT
+} JobCommand;
+
+/// Parses the next command of a job with its arguments, checked the way the
+/// job threads run them (SCAN takes exactly two keys, for instance).
+/// @param reader Input of the job.
+/// @param args Arguments to store the keys and values in, those of the last
+/// command are cleared first.
+/// @param command To store the command in, its keys and values are in args.
+void parse_command(JobReader *reader, Args *args, JobCommand *command);
+
+// Keys and values are either plain strings, ended by the next delimiter, or
+// "$<length>:" followed by exactly that many bytes (which may be delimiters)
+// and then the delimiter.
 
 /// Parses a WRITE command.
-/// @param fd File descriptor to read from.
-/// @param keys Array to store the keys
-/// @param values Array to store the values
+/// @param reader Input of the job.
+/// @param args Arguments to store the keys and values in.
 /// @param max_pairs Maximum number of pairs it will write.
-/// @param max_string_size Maximum string size allowed.
 /// @return 0 if the command was not parsed successfully, otherwise return the
 //          of pairs parsed.
-size_t parse_write(int fd, char keys[][MAX_STRING_SIZE],
-                   char values[][MAX_STRING_SIZE], size_t max_pairs,
-                   size_t max_string_size);
+size_t parse_write(JobReader *reader, Args *args, size_t max_pairs);
+
+/// Parses a CAS command, a list of (key,expected,value) triples. The
+/// expected value of triple i is stored in values[2 * i] and its new value
+/// in values[2 * i + 1].
+/// @param reader Input of the job.
+/// @param args Arguments to store the keys and values in.
+/// @param max_triples Maximum number of triples it will parse.
+/// @return 0 if the command was not parsed successfully, otherwise the
+/// number of triples parsed.
+size_t parse_cas(JobReader *reader, Args *args, size_t max_triples);
 
-// Parses a READ or a DELETE command.
-// @param fd File descriptor to read from.
-// @param keys Array to store the keys
+// Parses a READ, DELETE or SCAN command.
+// @param reader Input of the job.
+// @param args Arguments to store the keys in.
 // @param max_pairs Maximum number of pairs it will write.
-// @param max_string_size Maximum string size allowed.
 // @return 0 if the command was not parsed successfully, otherwise return the
 //          of keys parsed
-size_t parse_read_delete(int fd, char keys[][MAX_STRING_SIZE], size_t max_keys,
-                         size_t max_string_size);
+size_t parse_read_delete(JobReader *reader, Args *args, size_t max_keys);
+
+/// Parses the TTL of a WRITETTL command, the pairs follow it.
+/// @param reader Input of the job.
+/// @param ttl_ms Pointer to the variable to store the TTL in.
+/// @return 0 if successful, 1 otherwise.
+int parse_ttl(JobReader *reader, unsigned int *ttl_ms);
 
 /// Parses a WAIT command.
-/// @param fd File descriptor to read from.
+/// @param reader Input of the job.
 /// @param delay Pointer to the variable to store the wait delay in.
 /// @param thread_id Pointer to the variable to store the thread ID in. May not
 /// be set.
 /// @return 0 if no thread was specified, 1 if a thread was specified, -1 on
 /// error.
-int parse_wait(int fd, unsigned int *delay, unsigned int *thread_id);
+int parse_wait(JobReader *reader, unsigned int *delay,
+               unsigned int *thread_id);
 
 #endif // KVS_PARSER_H
@@ -0,0 +1,159 @@
+#include "pool.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+// A batch lives in the stack of the thread that submitted it. It is only
+// accessed with the pool lock held, and it leaves the queue as soon as its
+// last task is claimed, so no worker touches it after it completes.
+struct PoolBatch {
+  size_t num_tasks;
+  size_t next_task; // Next task to be claimed
+  size_t done;      // Number of tasks completed
+  void (*run)(void *arg, size_t task);
+  void *arg;
+  PoolBatch *next;
+};
+
+// Claims the next task of the oldest batch. Called with the pool lock held.
+// @param batch Pointer to store the batch of the task in.
+// @return 1 if a task was claimed, 0 if the queue is empty.
+static int claim_task(ThreadPool *pool, PoolBatch **batch, size_t *task) {
+  PoolBatch *head = pool->head;
+  if (head == NULL) {
+    return 0;
+  }
+
+  *batch = head;
+  *task = head->next_task++;
+  if (head->next_task == head->num_tasks) {
+    pool->head = head->next;
+    if (pool->head == NULL) {
+      pool->tail = NULL;
+    }
+  }
+  return 1;
+}
+
+// Runs a claimed task. Called with the pool lock held, releases it while the
+// task runs.
+static void run_task(ThreadPool *pool, PoolBatch *batch, size_t task) {
+  pthread_mutex_unlock(&pool->lock);
+  batch->run(batch->arg, task);
+  pthread_mutex_lock(&pool->lock);
+
+  if (++batch->done == batch->num_tasks) {
+    pthread_cond_broadcast(&pool->done);
+  }
+}
+
+static void *worker(void *arg) {
+  ThreadPool *pool = arg;
+
+  pthread_mutex_lock(&pool->lock);
+  while (1) {
+    PoolBatch *batch;
+    size_t task;
+    if (claim_task(pool, &batch, &task)) {
+      run_task(pool, batch, task);
+    } else if (pool->stop) {
+      break;
+    } else {
+      pthread_cond_wait(&pool->work, &pool->lock);
+    }
+  }
+  pthread_mutex_unlock(&pool->lock);
+
+  return NULL;
+}
+
+ThreadPool *pool_create(size_t num_threads) {
+  ThreadPool *pool =
+      malloc(sizeof(ThreadPool) + num_threads * sizeof(pthread_t));
+  if (pool == NULL) {
+    return NULL;
+  }
+
+  pthread_mutex_init(&pool->lock, NULL);
+  pthread_cond_init(&pool->work, NULL);
+  pthread_cond_init(&pool->done, NULL);
+  pool->head = NULL;
+  pool->tail = NULL;
+  pool->stop = 0;
+
+  for (pool->num_threads = 0; pool->num_threads < num_threads;
+       pool->num_threads++) {
+    if (pthread_create(&pool->threads[pool->num_threads], NULL, worker,
+                       pool) != 0) {
+      fprintf(stderr, "Failed to create worker thread\n");
+      pool_destroy(pool);
+      return NULL;
+    }
+  }
+
+  return pool;
+}
+
+void pool_run(ThreadPool *pool, size_t num_tasks,
+              void (*run)(void *arg, size_t task), void *arg) {
+  if (num_tasks == 0) {
+    return;
+  }
+  if (num_tasks == 1 || pool->num_threads == 0) {
+    for (size_t i = 0; i < num_tasks; i++) {
+      run(arg, i);
+    }
+    return;
+  }
+
+  PoolBatch batch = {num_tasks, 0, 0, run, arg, NULL};
+
+  pthread_mutex_lock(&pool->lock);
+  if (pool->tail != NULL) {
+    pool->tail->next = &batch;
+  } else {
+    pool->head = &batch;
+  }
+  pool->tail = &batch;
+  pthread_cond_broadcast(&pool->work);
+
+  // Helps with its own batch, then waits for the tasks taken by workers
+  while (batch.next_task < batch.num_tasks) {
+    // The batch is in the queue until its last task is claimed, but it may
+    // not be at the head, so its tasks are claimed directly
+    size_t task = batch.next_task++;
+    if (batch.next_task == batch.num_tasks) {
+      PoolBatch **link = &pool->head;
+      PoolBatch *prev = NULL;
+      while (*link != &batch) {
+        prev = *link;
+        link = &(*link)->next;
+      }
+      *link = batch.next;
+      if (pool->tail == &batch) {
+        pool->tail = prev;
+      }
+    }
+    run_task(pool, &batch, task);
+  }
+  while (batch.done < batch.num_tasks) {
+    pthread_cond_wait(&pool->done, &pool->lock);
+  }
+  pthread_mutex_unlock(&pool->lock);
+}
+
+void pool_destroy(ThreadPool *pool) {
+  pthread_mutex_lock(&pool->lock);
+  pool->stop = 1;
+  pthread_cond_broadcast(&pool->work);
+  pthread_mutex_unlock(&pool->lock);
+
+  for (size_t i = 0; i < pool->num_threads; i++) {
+    pthread_join(pool->threads[i], NULL);
+  }
+
+  pthread_cond_destroy(&pool->work);
+  pthread_cond_destroy(&pool->done);
+  pthread_mutex_destroy(&pool->lock);
+  free(pool);
+}
@@ -0,0 +1,41 @@
+#ifndef KVS_POOL_H
+#define KVS_POOL_H
+
+#include <pthread.h>
+#include <stddef.h>
+
+// Pool of worker threads that run the parts of a large batch in parallel.
+// The thread that submits a batch runs its tasks too, so a batch always
+// completes even if every worker is busy with other batches.
+
+typedef struct PoolBatch PoolBatch;
+
+typedef struct ThreadPool {
+  pthread_mutex_t lock;
+  pthread_cond_t work; // Signaled when a batch is submitted
+  pthread_cond_t done; // Signaled when the last task of a batch completes
+  PoolBatch *head;     // Batches with tasks not claimed yet, oldest first
+  PoolBatch *tail;
+  int stop;
+  size_t num_threads;
+  pthread_t threads[];
+} ThreadPool;
+
+/// Creates a pool of worker threads.
+/// @param num_threads Number of workers, may be 0 (tasks run in the caller).
+/// @return The pool, NULL on failure.
+ThreadPool *pool_create(size_t num_threads);
+
+/// Runs the tasks of a batch in parallel and waits for all of them.
+/// @param pool The pool.
+/// @param num_tasks Number of tasks.
+/// @param run Function called once for each task, with its index.
+/// @param arg Argument given to run.
+void pool_run(ThreadPool *pool, size_t num_tasks,
+              void (*run)(void *arg, size_t task), void *arg);
+
+/// Stops the workers and frees the pool. No batch may be running.
+/// @param pool The pool.
+void pool_destroy(ThreadPool *pool);
+
+#endif // KVS_POOL_H
@@ -0,0 +1,105 @@
+#include "ring.h"
+
+int ring_init(CommandRing *ring) {
+  atomic_init(&ring->head, 0);
+  atomic_init(&ring->tail, 0);
+  atomic_init(&ring->sleeping, 0);
+  atomic_init(&ring->stop, 0);
+  for (size_t i = 0; i < RING_CAPACITY; i++) {
+    if (args_init(&ring->slots[i].args) != 0) {
+      while (i-- > 0) {
+        args_destroy(&ring->slots[i].args);
+      }
+      return 1;
+    }
+  }
+  pthread_mutex_init(&ring->lock, NULL);
+  pthread_cond_init(&ring->changed, NULL);
+  return 0;
+}
+
+void ring_destroy(CommandRing *ring) {
+  for (size_t i = 0; i < RING_CAPACITY; i++) {
+    args_destroy(&ring->slots[i].args);
+  }
+  pthread_cond_destroy(&ring->changed);
+  pthread_mutex_destroy(&ring->lock);
+}
+
+// Whether the parser has a free slot, or was stopped.
+static int parser_ready(CommandRing *ring) {
+  return atomic_load(&ring->tail) - atomic_load(&ring->head) <
+             RING_CAPACITY ||
+         atomic_load(&ring->stop);
+}
+
+// Whether the executor has a command.
+static int executor_ready(CommandRing *ring) {
+  return atomic_load(&ring->tail) != atomic_load(&ring->head);
+}
+
+// Waits until a side can go on. Announcing the sleep and checking again are
+// both sequentially consistent, as are the changes of the other side and its
+// check of sleeping: either this side sees the change, or the other side
+// sees it asleep and signals it (under the lock, so not before it waits).
+static void wait_until(CommandRing *ring, int (*ready)(CommandRing *)) {
+  for (int spin = 0; spin < RING_SPINS; spin++) {
+    if (ready(ring)) {
+      return;
+    }
+  }
+  pthread_mutex_lock(&ring->lock);
+  atomic_fetch_add(&ring->sleeping, 1);
+  while (!ready(ring)) {
+    pthread_cond_wait(&ring->changed, &ring->lock);
+  }
+  atomic_fetch_sub(&ring->sleeping, 1);
+  pthread_mutex_unlock(&ring->lock);
+}
+
+// Wakes the other side if it is asleep, after a change of the ring.
+static void wake(CommandRing *ring) {
+  if (atomic_load(&ring->sleeping) > 0) {
+    pthread_mutex_lock(&ring->lock);
+    pthread_cond_broadcast(&ring->changed);
+    pthread_mutex_unlock(&ring->lock);
+  }
+}
+
+CommandSlot *ring_claim(CommandRing *ring) {
+  wait_until(ring, parser_ready);
+  if (atomic_load(&ring->stop)) {
+    return NULL;
+  }
+  size_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+  return &ring->slots[tail % RING_CAPACITY];
+}
+
+void ring_publish(CommandRing *ring) {
+  atomic_fetch_add(&ring->tail, 1);
+  wake(ring);
+}
+
+CommandSlot *ring_front(CommandRing *ring) {
+  wait_until(ring, executor_ready);
+  size_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+  return &ring->slots[head % RING_CAPACITY];
+}
+
+CommandSlot *ring_peek(CommandRing *ring, size_t i) {
+  size_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+  if (atomic_load(&ring->tail) - head <= i) {
+    return NULL;
+  }
+  return &ring->slots[(head + i) % RING_CAPACITY];
+}
+
+void ring_release(CommandRing *ring, size_t n) {
+  atomic_fetch_add(&ring->head, n);
+  wake(ring);
+}
+
+void ring_stop(CommandRing *ring) {
+  atomic_store(&ring->stop, 1);
+  wake(ring);
+}
@@ -0,0 +1,81 @@
+#ifndef KVS_RING_H
+#define KVS_RING_H
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stddef.h>
+
+#include "kvs.h"
+#include "parser.h"
+
+// Bounded ring of parsed commands between the two stages of a pipelined
+// job: the parser fills slots, the executor takes them in order. Single
+// producer, single consumer, so the slots are handed over with two atomic
+// counters and no lock. A side only blocks when the ring is empty (the
+// executor) or full (the parser): it spins a little first, then sleeps on
+// a condition the other side signals only if it is asleep.
+
+// Commands parsed ahead of the one running
+#define RING_CAPACITY 8
+// Times a side checks the ring again before going to sleep
+#define RING_SPINS 256
+
+// A parsed command along with the arguments it points to, which are only
+// reused once the executor released the slot
+typedef struct CommandSlot {
+  JobCommand command;
+  Args args;
+} CommandSlot;
+
+typedef struct CommandRing {
+  CommandSlot slots[RING_CAPACITY];
+  // Slots taken by the executor, and filled by the parser, since the start.
+  // In their own cache lines, each is only written by one side.
+  _Alignas(CACHE_LINE_SIZE) _Atomic size_t head;
+  _Alignas(CACHE_LINE_SIZE) _Atomic size_t tail;
+  _Alignas(CACHE_LINE_SIZE) pthread_mutex_t lock;
+  pthread_cond_t changed; // Signaled for a side that is asleep
+  _Atomic int sleeping;   // Number of sides asleep (or about to be)
+  _Atomic int stop;       // Set by the executor to stop the parser
+} CommandRing;
+
+/// Initializes an empty ring, allocating the arguments of its slots.
+/// @param ring Ring to initialize.
+/// @return 0 if successful, 1 otherwise.
+int ring_init(CommandRing *ring);
+
+/// Frees the arguments of the slots of a ring.
+/// @param ring The ring, neither side may be using it.
+void ring_destroy(CommandRing *ring);
+
+/// Parser side: waits for a free slot to parse the next command in.
+/// @param ring The ring.
+/// @return The slot, NULL if the executor stopped the ring.
+CommandSlot *ring_claim(CommandRing *ring);
+
+/// Parser side: hands the slot claimed to the executor.
+/// @param ring The ring.
+void ring_publish(CommandRing *ring);
+
+/// Executor side: waits for the next command.
+/// @param ring The ring.
+/// @return Its slot, valid until it is released.
+CommandSlot *ring_front(CommandRing *ring);
+
+/// Executor side: gets a command after the next one, if it was parsed
+/// already, without waiting.
+/// @param ring The ring.
+/// @param i Position of the command, 0 for the next one.
+/// @return Its slot, NULL if it was not parsed yet.
+CommandSlot *ring_peek(CommandRing *ring, size_t i);
+
+/// Executor side: gives back the slots of the next commands, once run.
+/// @param ring The ring.
+/// @param n Number of slots.
+void ring_release(CommandRing *ring, size_t n);
+
+/// Executor side: stops the parser, which may be waiting for a free slot.
+/// @param ring The ring.
+void ring_stop(CommandRing *ring);
+
+#endif // KVS_RING_H
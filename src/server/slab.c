@@ -0,0 +1,149 @@
+// MAP_ANONYMOUS, MAP_HUGETLB and MADV_HUGEPAGE are not part of POSIX
+#define _DEFAULT_SOURCE
+
+#include "slab.h"
+
+#include <stdint.h>
+#include <sys/mman.h>
+
+// Header at the start of every chunk. Chunks are aligned to their size, so
+// the header of an object is found by masking its address.
+struct SlabChunk {
+  Slab *slab;
+  size_t size_class;
+  SlabChunk *next;
+};
+
+static int use_huge_pages = 0;
+
+void slab_set_huge_pages(int enabled) { use_huge_pages = enabled; }
+
+static size_t class_size(size_t size_class) {
+  return (size_t)SLAB_MIN_SIZE << size_class;
+}
+
+static size_t class_of(size_t size) {
+  size_t size_class = 0;
+  while (class_size(size_class) < size) {
+    size_class++;
+  }
+  return size_class;
+}
+
+static SlabChunk *chunk_of(const void *ptr) {
+  return (SlabChunk *)((uintptr_t)ptr & ~(uintptr_t)(SLAB_CHUNK_SIZE - 1));
+}
+
+// Maps a chunk aligned to its size.
+// @return the chunk, NULL on failure.
+static void *map_chunk(void) {
+#ifdef MAP_HUGETLB
+  if (use_huge_pages) {
+    // Huge pages are aligned to their size, which is the chunk size
+    void *ptr = mmap(NULL, SLAB_CHUNK_SIZE, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    if (ptr != MAP_FAILED) {
+      return ptr;
+    }
+  }
+#endif
+
+  // Maps twice the size and unmaps what is outside the aligned chunk
+  char *raw = mmap(NULL, 2 * SLAB_CHUNK_SIZE, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (raw == MAP_FAILED) {
+    return NULL;
+  }
+  char *chunk = (char *)(((uintptr_t)raw + SLAB_CHUNK_SIZE - 1) &
+                         ~(uintptr_t)(SLAB_CHUNK_SIZE - 1));
+  if (chunk != raw) {
+    munmap(raw, (size_t)(chunk - raw));
+  }
+  munmap(chunk + SLAB_CHUNK_SIZE, SLAB_CHUNK_SIZE - (size_t)(chunk - raw));
+
+#ifdef MADV_HUGEPAGE
+  if (use_huge_pages) {
+    // No huge pages reserved, ask for transparent huge pages instead
+    madvise(chunk, SLAB_CHUNK_SIZE, MADV_HUGEPAGE);
+  }
+#endif
+  return chunk;
+}
+
+void slab_init(Slab *slab) {
+  pthread_mutex_init(&slab->lock, NULL);
+  for (size_t i = 0; i < SLAB_NUM_CLASSES; i++) {
+    slab->classes[i].free_list = NULL;
+    slab->classes[i].next = NULL;
+    slab->classes[i].end = NULL;
+  }
+  slab->chunks = NULL;
+  slab->allocated = 0;
+}
+
+void *slab_alloc(Slab *slab, size_t size) {
+  if (size > SLAB_MAX_SIZE) {
+    return NULL;
+  }
+
+  size_t size_class = class_of(size);
+  size_t object_size = class_size(size_class);
+  SlabClass *objects = &slab->classes[size_class];
+  void *ptr = NULL;
+
+  pthread_mutex_lock(&slab->lock);
+  if (objects->free_list != NULL) {
+    ptr = objects->free_list;
+    objects->free_list = *(void **)ptr;
+  } else {
+    if (objects->next == objects->end) {
+      SlabChunk *chunk = map_chunk();
+      if (chunk == NULL) {
+        pthread_mutex_unlock(&slab->lock);
+        return NULL;
+      }
+      chunk->slab = slab;
+      chunk->size_class = size_class;
+      chunk->next = slab->chunks;
+      slab->chunks = chunk;
+
+      // The first object slot holds the header (every class is larger than
+      // it), so the objects keep their natural alignment
+      objects->next = (char *)chunk + object_size;
+      objects->end = (char *)chunk + SLAB_CHUNK_SIZE;
+    }
+    ptr = objects->next;
+    objects->next += object_size;
+  }
+  slab->allocated += object_size;
+  pthread_mutex_unlock(&slab->lock);
+
+  return ptr;
+}
+
+void slab_free(void *ptr) {
+  SlabChunk *chunk = chunk_of(ptr);
+  Slab *slab = chunk->slab;
+  SlabClass *objects = &slab->classes[chunk->size_class];
+
+  pthread_mutex_lock(&slab->lock);
+  *(void **)ptr = objects->free_list;
+  objects->free_list = ptr;
+  slab->allocated -= class_size(chunk->size_class);
+  pthread_mutex_unlock(&slab->lock);
+}
+
+size_t slab_size(const void *ptr) {
+  return class_size(chunk_of(ptr)->size_class);
+}
+
+void slab_destroy(Slab *slab) {
+  SlabChunk *chunk = slab->chunks;
+  while (chunk != NULL) {
+    SlabChunk *next = chunk->next;
+    munmap(chunk, SLAB_CHUNK_SIZE);
+    chunk = next;
+  }
+  slab->chunks = NULL;
+  pthread_mutex_destroy(&slab->lock);
+}
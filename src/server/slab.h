@@ -0,0 +1,59 @@
+#ifndef KVS_SLAB_H
+#define KVS_SLAB_H
+
+#include <pthread.h>
+#include <stddef.h>
+
+// Size-class slab allocator. Objects are carved from large chunks, one size
+// class per chunk, and freed objects are kept in a free list of their class.
+// Objects never cross a boundary of their own size, so objects up to a cache
+// line never straddle two.
+
+#define SLAB_MIN_SIZE 32
+#define SLAB_NUM_CLASSES 12 // 32 bytes to 64 KB, powers of two
+#define SLAB_MAX_SIZE ((size_t)SLAB_MIN_SIZE << (SLAB_NUM_CLASSES - 1))
+#define SLAB_CHUNK_SIZE ((size_t)2 << 20) // Size of a huge page
+
+typedef struct SlabChunk SlabChunk;
+
+typedef struct SlabClass {
+  void *free_list; // Freed objects, linked through their first word
+  char *next;      // Next never used object of the current chunk
+  char *end;       // End of the current chunk
+} SlabClass;
+
+typedef struct Slab {
+  pthread_mutex_t lock;
+  SlabClass classes[SLAB_NUM_CLASSES];
+  SlabChunk *chunks; // Every chunk, freed by slab_destroy
+  size_t allocated;  // Bytes of the objects currently allocated
+} Slab;
+
+/// Enables huge pages for the chunks of every slab created afterwards.
+/// @param enabled 1 to back chunks with huge pages, 0 otherwise.
+void slab_set_huge_pages(int enabled);
+
+/// Initializes an empty slab.
+/// @param slab Slab to initialize.
+void slab_init(Slab *slab);
+
+/// Allocates an object of the smallest size class that fits size bytes.
+/// @param slab Slab to allocate from.
+/// @param size Size of the object, at most SLAB_MAX_SIZE.
+/// @return The object, NULL on failure.
+void *slab_alloc(Slab *slab, size_t size);
+
+/// Returns an object to the slab it was allocated from.
+/// @param ptr Object returned by slab_alloc.
+void slab_free(void *ptr);
+
+/// Gets the usable size of an object (the size of its class).
+/// @param ptr Object returned by slab_alloc.
+/// @return Size of the object.
+size_t slab_size(const void *ptr);
+
+/// Frees every chunk of a slab, including objects still allocated.
+/// @param slab Slab to destroy.
+void slab_destroy(Slab *slab);
+
+#endif // KVS_SLAB_H
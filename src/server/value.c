@@ -0,0 +1,51 @@
+#include "value.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+Blob *blob_create(size_t len) {
+  Blob *blob = malloc(sizeof(Blob) + len + 1);
+  if (blob == NULL) {
+    return NULL;
+  }
+  atomic_init(&blob->refs, 1);
+  blob->len = len;
+  blob->data[len] = '\0';
+  return blob;
+}
+
+Blob *blob_retain(Blob *blob) {
+  atomic_fetch_add_explicit(&blob->refs, 1, memory_order_relaxed);
+  return blob;
+}
+
+void blob_release(Blob *blob) {
+  // The last owner must see the writes of every other one before freeing
+  if (blob != NULL &&
+      atomic_fetch_sub_explicit(&blob->refs, 1, memory_order_acq_rel) == 1) {
+    free(blob);
+  }
+}
+
+size_t blob_bytes(const Blob *blob) { return sizeof(Blob) + blob->len + 1; }
+
+int parse_integer(const char *data, size_t len, long long *n) {
+  // Long enough for any long long, anything longer is not one
+  char digits[24];
+  if (len == 0 || len >= sizeof(digits)) {
+    return 1;
+  }
+  memcpy(digits, data, len);
+  digits[len] = '\0';
+
+  // strtoll would also skip leading spaces
+  size_t start = digits[0] == '-' || digits[0] == '+';
+  if (digits[start] < '0' || digits[start] > '9') {
+    return 1;
+  }
+  char *end;
+  errno = 0;
+  *n = strtoll(digits, &end, 10);
+  return errno != 0 || end != digits + len;
+}
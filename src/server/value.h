@@ -0,0 +1,53 @@
+#ifndef KVS_VALUE_H
+#define KVS_VALUE_H
+
+#include <stdatomic.h>
+#include <stddef.h>
+
+// Values are strings of up to MAX_VALUE_SIZE bytes, of any byte (their
+// length is always kept next to them). Values of LARGE_VALUE_SIZE bytes or
+// more are kept out of line in a reference counted blob: the blob a large
+// value is read into by the parser is the one the table stores and the one
+// readers output, it is never copied.
+
+#define LARGE_VALUE_SIZE 256
+
+typedef struct Blob {
+  _Atomic size_t refs;
+  size_t len;
+  char data[]; // len bytes, followed by a terminator
+} Blob;
+
+typedef struct Value {
+  const char *data;
+  size_t len;
+  Blob *blob; // Blob holding data, NULL if data is not in one
+} Value;
+
+/// Allocates a blob with a single reference.
+/// @param len Length of the value it will hold (filled in by the caller).
+/// @return The blob, NULL on failure.
+Blob *blob_create(size_t len);
+
+/// Takes a reference to a blob.
+/// @param blob The blob.
+/// @return The blob.
+Blob *blob_retain(Blob *blob);
+
+/// Drops a reference to a blob, freeing it with the last one.
+/// @param blob The blob, may be NULL.
+void blob_release(Blob *blob);
+
+/// Number of bytes of memory used by a blob.
+/// @param blob The blob.
+size_t blob_bytes(const Blob *blob);
+
+/// Parses a value holding a decimal integer, with an optional sign and
+/// nothing else.
+/// @param data The value.
+/// @param len Length of the value.
+/// @param n Pointer to store the integer in.
+/// @return 0 if successful, 1 if it is not an integer or does not fit.
+int parse_integer(const char *data, size_t len, long long *n);
+
+#endif // KVS_VALUE_H
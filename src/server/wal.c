@@ -0,0 +1,657 @@
+#include "wal.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <nmmintrin.h>
+#endif
+
+#include "constants.h"
+#include "src/common/constants.h"
+
+// Initial size of the buffers of a log
+#define WAL_BUFFER_SIZE (64 * 1024)
+// Unless the log is synced always, records are written out early once this
+// many bytes are waiting, so the buffer stays small
+#define WAL_FLUSH_SIZE (1024 * 1024)
+// Batches wait before their locks are taken while this many bytes are still
+// to be written, so a slow disk holds the writers back instead of the buffer
+// growing without a limit
+#define WAL_MAX_PENDING (32 * 1024 * 1024)
+// Length and CRC32C of the payload of a record
+#define WAL_HEADER_SIZE 8
+// Type, time, TTL and number of keys
+#define WAL_FIXED_SIZE 17
+// Largest payload a record can have, anything larger is corrupt
+#define WAL_MAX_PAYLOAD                                                        \
+  (WAL_FIXED_SIZE +                                                            \
+   MAX_WRITE_SIZE * (4 + MAX_KEY_SIZE + 2 * (4 + (size_t)MAX_VALUE_SIZE)))
+
+// CRC32C, with the instruction of SSE 4.2 on x86 CPUs that have it, with a
+// table elsewhere
+static uint32_t crc_table[256];
+#if defined(__x86_64__) || defined(__i386__)
+static int crc_hardware;
+#endif
+static pthread_once_t crc_once = PTHREAD_ONCE_INIT;
+
+static void crc_init(void) {
+  for (uint32_t i = 0; i < 256; i++) {
+    uint32_t c = i;
+    for (int k = 0; k < 8; k++) {
+      c = c & 1 ? 0x82F63B78u ^ (c >> 1) : c >> 1;
+    }
+    crc_table[i] = c;
+  }
+#if defined(__x86_64__) || defined(__i386__)
+  crc_hardware = __builtin_cpu_supports("sse4.2");
+#endif
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("sse4.2"))) static uint32_t
+crc32c_hardware(uint32_t c, const char *data, size_t len) {
+#if defined(__x86_64__)
+  for (; len >= 8; data += 8, len -= 8) {
+    uint64_t word;
+    memcpy(&word, data, sizeof(word));
+    c = (uint32_t)_mm_crc32_u64(c, word);
+  }
+#else
+  for (; len >= 4; data += 4, len -= 4) {
+    uint32_t word;
+    memcpy(&word, data, sizeof(word));
+    c = _mm_crc32_u32(c, word);
+  }
+#endif
+  for (; len > 0; data++, len--) {
+    c = _mm_crc32_u8(c, (unsigned char)*data);
+  }
+  return c;
+}
+#endif
+
+static uint32_t crc32c(const char *data, size_t len) {
+  uint32_t c = 0xFFFFFFFFu;
+#if defined(__x86_64__) || defined(__i386__)
+  if (crc_hardware) {
+    return crc32c_hardware(c, data, len) ^ 0xFFFFFFFFu;
+  }
+#endif
+  for (size_t i = 0; i < len; i++) {
+    c = crc_table[(c ^ (unsigned char)data[i]) & 0xFF] ^ (c >> 8);
+  }
+  return c ^ 0xFFFFFFFFu;
+}
+
+size_t wal_values_per_key(WalType type) {
+  switch (type) {
+  case WAL_DELETE:
+    return 0;
+  case WAL_CAS:
+    return 2;
+  case WAL_WRITE:
+  case WAL_INCR:
+  case WAL_APPEND:
+  default:
+    return 1;
+  }
+}
+
+// Writes len bytes, retrying partial writes.
+// @return 0 if successful, 1 otherwise.
+static int write_all(int fd, const char *data, size_t len) {
+  while (len > 0) {
+    ssize_t written = write(fd, data, len);
+    if (written < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return 1;
+    }
+    data += written;
+    len -= (size_t)written;
+  }
+  return 0;
+}
+
+static void put_u32(char **dest, uint32_t n) {
+  memcpy(*dest, &n, sizeof(n));
+  *dest += sizeof(n);
+}
+
+static void put_bytes(char **dest, const char *data, size_t len) {
+  put_u32(dest, (uint32_t)len);
+  memcpy(*dest, data, len);
+  *dest += len;
+}
+
+char *wal_encode(const WalRecord *record, size_t *len) {
+  size_t width = wal_values_per_key(record->type);
+  size_t size = WAL_HEADER_SIZE + WAL_FIXED_SIZE;
+  for (size_t i = 0; i < record->num_keys; i++) {
+    size += 4 + strlen(record->keys[i]) + 1;
+    for (size_t j = 0; j < width; j++) {
+      size += 4 + record->values[i * width + j].len;
+    }
+  }
+
+  char *data = malloc(size);
+  if (data == NULL) {
+    return NULL;
+  }
+  struct timespec now;
+  clock_gettime(CLOCK_REALTIME, &now);
+  uint64_t time = (uint64_t)now.tv_sec * 1000 + (uint64_t)now.tv_nsec / 1000000;
+
+  char *dest = data + WAL_HEADER_SIZE;
+  *dest++ = (char)record->type;
+  memcpy(dest, &time, sizeof(time));
+  dest += sizeof(time);
+  put_u32(&dest, record->ttl_ms);
+  put_u32(&dest, (uint32_t)record->num_keys);
+  for (size_t i = 0; i < record->num_keys; i++) {
+    // Keys keep their terminator, so they are used in place on replay
+    put_bytes(&dest, record->keys[i], strlen(record->keys[i]) + 1);
+    for (size_t j = 0; j < width; j++) {
+      const Value *value = &record->values[i * width + j];
+      put_bytes(&dest, value->data, value->len);
+    }
+  }
+
+  pthread_once(&crc_once, crc_init);
+  char *header = data;
+  put_u32(&header, (uint32_t)(size - WAL_HEADER_SIZE));
+  put_u32(&header, crc32c(data + WAL_HEADER_SIZE, size - WAL_HEADER_SIZE));
+  *len = size;
+  return data;
+}
+
+// Reads a length prefixed string of a payload.
+// @return 0 if successful, 1 if it does not fit in the payload.
+static int get_bytes(const char **src, const char *end, const char **data,
+                     size_t *len) {
+  uint32_t n;
+  if ((size_t)(end - *src) < sizeof(n)) {
+    return 1;
+  }
+  memcpy(&n, *src, sizeof(n));
+  *src += sizeof(n);
+  if ((size_t)(end - *src) < n) {
+    return 1;
+  }
+  *data = *src;
+  *len = n;
+  *src += n;
+  return 0;
+}
+
+// Decodes the payload of a record.
+// @param keys Array of MAX_WRITE_SIZE keys.
+// @param values Array of 2 * MAX_WRITE_SIZE values.
+// @return 0 if successful, 1 if the payload is not a valid record.
+static int decode(char *payload, size_t len, WalRecord *record, char **keys,
+                  Value *values) {
+  const char *src = payload, *end = payload + len;
+  uint32_t num_keys;
+  if (len < WAL_FIXED_SIZE) {
+    return 1;
+  }
+  uint32_t ttl_ms;
+  record->type = (WalType)(unsigned char)*src++;
+  memcpy(&record->time, src, sizeof(record->time));
+  src += sizeof(record->time);
+  memcpy(&ttl_ms, src, sizeof(ttl_ms));
+  src += sizeof(ttl_ms);
+  record->ttl_ms = ttl_ms;
+  memcpy(&num_keys, src, sizeof(num_keys));
+  src += sizeof(num_keys);
+  if (record->type < WAL_WRITE || record->type > WAL_CAS || num_keys == 0 ||
+      num_keys > MAX_WRITE_SIZE) {
+    return 1;
+  }
+
+  size_t width = wal_values_per_key(record->type);
+  for (size_t i = 0; i < num_keys; i++) {
+    const char *key;
+    size_t key_len;
+    if (get_bytes(&src, end, &key, &key_len) || key_len == 0 ||
+        key[key_len - 1] != '\0') {
+      return 1;
+    }
+    keys[i] = (char *)key;
+    for (size_t j = 0; j < width; j++) {
+      Value *value = &values[i * width + j];
+      if (get_bytes(&src, end, &value->data, &value->len) ||
+          value->len > MAX_VALUE_SIZE) {
+        return 1;
+      }
+      value->blob = NULL;
+    }
+  }
+  record->num_keys = num_keys;
+  record->keys = keys;
+  record->values = values;
+  return src == end ? 0 : 1;
+}
+
+int wal_replay(const char *path, void (*apply)(const WalRecord *, void *),
+               void *arg) {
+  FILE *file = fopen(path, "r+");
+  if (file == NULL) {
+    if (errno == ENOENT) {
+      return 0;
+    }
+    fprintf(stderr, "Failed to open log %s: %s\n", path, strerror(errno));
+    return 1;
+  }
+  pthread_once(&crc_once, crc_init);
+
+  char *keys[MAX_WRITE_SIZE];
+  Value values[2 * MAX_WRITE_SIZE];
+  char *payload = NULL;
+  size_t capacity = 0;
+  uint64_t offset = 0, records = 0;
+  int result = 0;
+  while (1) {
+    char header[WAL_HEADER_SIZE];
+    size_t got = fread(header, 1, sizeof(header), file);
+    if (got == 0 && feof(file)) {
+      break;
+    }
+    uint32_t len, crc;
+    memcpy(&len, header, sizeof(len));
+    memcpy(&crc, header + sizeof(len), sizeof(crc));
+    if (got < sizeof(header) || len > WAL_MAX_PAYLOAD) {
+      result = 2;
+      break;
+    }
+    if (len > capacity) {
+      char *grown = realloc(payload, len);
+      if (grown == NULL) {
+        result = 1;
+        break;
+      }
+      payload = grown;
+      capacity = len;
+    }
+
+    WalRecord record;
+    if (fread(payload, 1, len, file) != len || crc32c(payload, len) != crc ||
+        decode(payload, len, &record, keys, values) != 0) {
+      result = 2;
+      break;
+    }
+    apply(&record, arg);
+    offset += WAL_HEADER_SIZE + len;
+    records++;
+  }
+
+  if (ferror(file)) {
+    fprintf(stderr, "Failed to read log %s\n", path);
+    result = 1;
+  } else if (result == 2) {
+    // Whatever follows the last good record was being written in a crash
+    fprintf(stderr, "Dropping the torn end of log %s after %llu records\n",
+            path, (unsigned long long)records);
+    result = ftruncate(fileno(file), (off_t)offset) != 0;
+    if (result) {
+      perror("Failed to truncate log");
+    }
+  }
+  free(payload);
+  fclose(file);
+  return result;
+}
+
+// Adds milliseconds to a time.
+static struct timespec add_ms(struct timespec t, unsigned int ms) {
+  t.tv_sec += ms / 1000;
+  t.tv_nsec += (long)(ms % 1000) * 1000000;
+  if (t.tv_nsec >= 1000000000) {
+    t.tv_sec++;
+    t.tv_nsec -= 1000000000;
+  }
+  return t;
+}
+
+static int time_reached(const struct timespec *t) {
+  struct timespec now;
+  clock_gettime(CLOCK_REALTIME, &now);
+  return now.tv_sec > t->tv_sec ||
+         (now.tv_sec == t->tv_sec && now.tv_nsec >= t->tv_nsec);
+}
+
+// Writes out the records appended, swapping buffers so appends go on
+// meanwhile, and syncs them as the policy says.
+static void *wal_thread(void *arg) {
+  Wal *wal = arg;
+  struct timespec next_sync;
+  clock_gettime(CLOCK_REALTIME, &next_sync);
+
+  pthread_mutex_lock(&wal->lock);
+  while (1) {
+    if (wal->used == 0) {
+      if (wal->stop) {
+        break;
+      }
+      pthread_cond_wait(&wal->work, &wal->lock);
+      continue;
+    }
+    // The records of an interval pile up, unless each batch waits for a sync
+    // or a rewrite waits for them
+    if (wal->sync != WAL_SYNC_ALWAYS && !wal->stop && !wal->paused &&
+        wal->used < WAL_FLUSH_SIZE && !time_reached(&next_sync)) {
+      pthread_cond_timedwait(&wal->work, &wal->lock, &next_sync);
+      continue;
+    }
+
+    char *data = wal->buffer;
+    size_t len = wal->used, capacity = wal->capacity;
+    uint64_t end = wal->appended;
+    wal->buffer = wal->spare;
+    wal->capacity = wal->spare_capacity;
+    wal->used = 0;
+    pthread_mutex_unlock(&wal->lock);
+
+    off_t size = lseek(wal->fd, 0, SEEK_END);
+    int failed = size < 0 || write_all(wal->fd, data, len) ||
+                 (wal->sync != WAL_SYNC_NONE && fdatasync(wal->fd) != 0);
+    if (failed) {
+      perror("Failed to write log");
+      // Whatever part of the records made it is cut, so a replay ends at the
+      // last record written whole
+      if (size >= 0 && ftruncate(wal->fd, size) != 0) {
+        perror("Failed to truncate log");
+      }
+    }
+    clock_gettime(CLOCK_REALTIME, &next_sync);
+    next_sync = add_ms(next_sync, wal->interval_ms);
+
+    pthread_mutex_lock(&wal->lock);
+    wal->spare = data;
+    wal->spare_capacity = capacity;
+    wal->failed |= failed;
+    if (!failed) {
+      wal->durable = end;
+    }
+    pthread_cond_broadcast(&wal->synced);
+  }
+  pthread_mutex_unlock(&wal->lock);
+
+  return NULL;
+}
+
+Wal *wal_open(const char *path, WalSync sync, unsigned int interval_ms) {
+  Wal *wal = malloc(sizeof(Wal));
+  if (wal == NULL) {
+    return NULL;
+  }
+  wal->fd = open(path, O_WRONLY | O_CREAT | O_APPEND, 0644);
+  wal->path = strdup(path);
+  wal->buffer = malloc(WAL_BUFFER_SIZE);
+  wal->spare = malloc(WAL_BUFFER_SIZE);
+  off_t size = wal->fd >= 0 ? lseek(wal->fd, 0, SEEK_END) : -1;
+  if (size < 0 || wal->path == NULL || wal->buffer == NULL ||
+      wal->spare == NULL) {
+    fprintf(stderr, "Failed to open log %s: %s\n", path, strerror(errno));
+    if (wal->fd >= 0) {
+      close(wal->fd);
+    }
+    free(wal->path);
+    free(wal->buffer);
+    free(wal->spare);
+    free(wal);
+    return NULL;
+  }
+
+  wal->sync = sync;
+  wal->interval_ms = interval_ms;
+  pthread_mutex_init(&wal->lock, NULL);
+  pthread_cond_init(&wal->work, NULL);
+  pthread_cond_init(&wal->synced, NULL);
+  wal->used = 0;
+  wal->capacity = WAL_BUFFER_SIZE;
+  wal->spare_capacity = WAL_BUFFER_SIZE;
+  wal->appended = 0;
+  wal->durable = 0;
+  wal->failed = 0;
+  wal->start = (uint64_t)size;
+  wal->rewrite_at = WAL_REWRITE_SIZE;
+  atomic_init(&wal->rewrite_due, 0);
+  wal->paused = 0;
+  wal->stop = 0;
+
+  if (pthread_create(&wal->thread, NULL, wal_thread, wal) != 0) {
+    fprintf(stderr, "Failed to create log thread\n");
+    pthread_cond_destroy(&wal->work);
+    pthread_cond_destroy(&wal->synced);
+    pthread_mutex_destroy(&wal->lock);
+    close(wal->fd);
+    free(wal->path);
+    free(wal->buffer);
+    free(wal->spare);
+    free(wal);
+    return NULL;
+  }
+  return wal;
+}
+
+void wal_throttle(Wal *wal) {
+  pthread_mutex_lock(&wal->lock);
+  while (wal->used >= WAL_MAX_PENDING && !wal->failed) {
+    pthread_cond_wait(&wal->synced, &wal->lock);
+  }
+  pthread_mutex_unlock(&wal->lock);
+}
+
+int wal_append(Wal *wal, const char *data, size_t len, uint64_t *position) {
+  pthread_mutex_lock(&wal->lock);
+  while (wal->paused) {
+    pthread_cond_wait(&wal->synced, &wal->lock);
+  }
+  // Nothing is appended after a record that could not be written, the replay
+  // would skip it and the records after it would not apply as they did
+  if (wal->failed) {
+    pthread_mutex_unlock(&wal->lock);
+    return 1;
+  }
+  if (wal->used + len > wal->capacity) {
+    size_t capacity = wal->capacity;
+    while (wal->used + len > capacity) {
+      capacity *= 2;
+    }
+    char *buffer = realloc(wal->buffer, capacity);
+    if (buffer == NULL) {
+      fprintf(stderr, "Failed to append to log\n");
+      pthread_mutex_unlock(&wal->lock);
+      return 1;
+    }
+    wal->buffer = buffer;
+    wal->capacity = capacity;
+  }
+
+  // The log thread only waits for work with the buffer empty, or for a large
+  // buffer to be written out early
+  if (wal->used == 0 || (wal->sync != WAL_SYNC_ALWAYS &&
+                         wal->used < WAL_FLUSH_SIZE &&
+                         wal->used + len >= WAL_FLUSH_SIZE)) {
+    pthread_cond_signal(&wal->work);
+  }
+  memcpy(wal->buffer + wal->used, data, len);
+  wal->used += len;
+  wal->appended += len;
+  *position = wal->appended;
+  if (wal->start + wal->appended >= wal->rewrite_at) {
+    // Not again until the rewrite sets the next size
+    wal->rewrite_at = UINT64_MAX;
+    atomic_store(&wal->rewrite_due, 1);
+  }
+  pthread_mutex_unlock(&wal->lock);
+  return 0;
+}
+
+int wal_commit(Wal *wal, uint64_t position) {
+  pthread_mutex_lock(&wal->lock);
+  if (wal->sync == WAL_SYNC_ALWAYS) {
+    while (wal->durable < position && !wal->failed) {
+      pthread_cond_wait(&wal->synced, &wal->lock);
+    }
+  }
+  // Records written before the log failed are still there
+  int failed = wal->failed && wal->durable < position;
+  pthread_mutex_unlock(&wal->lock);
+  return failed;
+}
+
+int wal_rewrite_due(Wal *wal) {
+  return atomic_load_explicit(&wal->rewrite_due, memory_order_relaxed) &&
+         atomic_exchange(&wal->rewrite_due, 0);
+}
+
+uint64_t wal_position(Wal *wal) {
+  pthread_mutex_lock(&wal->lock);
+  uint64_t position = wal->appended;
+  pthread_mutex_unlock(&wal->lock);
+  return position;
+}
+
+int wal_write_record(int fd, const WalRecord *record) {
+  size_t len;
+  char *data = wal_encode(record, &len);
+  if (data == NULL) {
+    return 1;
+  }
+  int failed = write_all(fd, data, len);
+  free(data);
+  return failed;
+}
+
+// Copies the bytes of a file from one offset up to another to the end of
+// another file.
+// @return 0 if successful, 1 otherwise.
+static int copy_range(int in, uint64_t from, uint64_t to, int out) {
+  char buffer[WAL_BUFFER_SIZE];
+  while (from < to) {
+    size_t len = to - from < sizeof(buffer) ? (size_t)(to - from)
+                                            : sizeof(buffer);
+    ssize_t got = pread(in, buffer, len, (off_t)from);
+    if (got < 0 && errno == EINTR) {
+      continue;
+    }
+    if (got <= 0 || write_all(out, buffer, (size_t)got) != 0) {
+      return 1;
+    }
+    from += (uint64_t)got;
+  }
+  return 0;
+}
+
+// Syncs the directory of a file, so a rename into it is durable.
+// @return 0 if successful, 1 otherwise.
+static int sync_directory(const char *path) {
+  const char *slash = strrchr(path, '/');
+  char *dir = slash != NULL ? strndup(path, (size_t)(slash - path + 1))
+                            : strdup(".");
+  if (dir == NULL) {
+    return 1;
+  }
+  int fd = open(dir, O_RDONLY);
+  free(dir);
+  if (fd < 0) {
+    return 1;
+  }
+  int failed = fsync(fd) != 0;
+  close(fd);
+  return failed;
+}
+
+int wal_rewrite(Wal *wal, uint64_t position, int (*write_state)(int, void *),
+                void *arg) {
+  size_t path_len = strlen(wal->path);
+  char *tmp_path = malloc(path_len + 5);
+  if (tmp_path == NULL) {
+    return 1;
+  }
+  memcpy(tmp_path, wal->path, path_len);
+  strcpy(tmp_path + path_len, ".tmp");
+  int fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, 0644);
+  int in = open(wal->path, O_RDONLY);
+  int failed = fd < 0 || in < 0 || write_state(fd, arg) != 0;
+
+  // Most records appended since the state are copied while appends go on,
+  // only the last ones with them paused. The log thread is the only one to
+  // write the file, and start only changes here.
+  pthread_mutex_lock(&wal->lock);
+  uint64_t start = wal->start, written = wal->durable;
+  pthread_mutex_unlock(&wal->lock);
+  failed = failed || copy_range(in, start + position, start + written, fd);
+
+  pthread_mutex_lock(&wal->lock);
+  wal->paused = 1;
+  pthread_cond_signal(&wal->work);
+  while (!failed && wal->durable < wal->appended && !wal->failed) {
+    pthread_cond_wait(&wal->synced, &wal->lock);
+  }
+  failed = failed || wal->failed ||
+           copy_range(in, start + written, start + wal->durable, fd) ||
+           fdatasync(fd) != 0 || rename(tmp_path, wal->path) != 0;
+  off_t size = failed ? -1 : lseek(fd, 0, SEEK_END);
+  if (size >= 0) {
+    // The rename is done, the new log is the one even if this fails
+    if (sync_directory(wal->path) != 0) {
+      perror("Failed to sync the directory of the log");
+    }
+    close(wal->fd);
+    wal->fd = fd;
+    wal->start = (uint64_t)size - wal->appended;
+  } else {
+    failed = 1;
+    size = (off_t)(start + wal->appended);
+    if (fd >= 0) {
+      close(fd);
+    }
+    unlink(tmp_path);
+  }
+  wal->rewrite_at = (uint64_t)size * 2 > WAL_REWRITE_SIZE
+                        ? (uint64_t)size * 2
+                        : WAL_REWRITE_SIZE;
+  wal->paused = 0;
+  pthread_cond_broadcast(&wal->synced);
+  pthread_mutex_unlock(&wal->lock);
+
+  if (in >= 0) {
+    close(in);
+  }
+  free(tmp_path);
+  return failed;
+}
+
+int wal_close(Wal *wal) {
+  pthread_mutex_lock(&wal->lock);
+  wal->stop = 1;
+  pthread_cond_signal(&wal->work);
+  pthread_mutex_unlock(&wal->lock);
+
+  // The thread only stops once everything appended is written
+  pthread_join(wal->thread, NULL);
+
+  int failed = wal->failed;
+  if (fdatasync(wal->fd) != 0 || close(wal->fd) != 0) {
+    perror("Failed to close log");
+    failed = 1;
+  }
+  pthread_cond_destroy(&wal->work);
+  pthread_cond_destroy(&wal->synced);
+  pthread_mutex_destroy(&wal->lock);
+  free(wal->path);
+  free(wal->buffer);
+  free(wal->spare);
+  free(wal);
+  return failed;
+}
@@ -0,0 +1,181 @@
+#ifndef KVS_WAL_H
+#define KVS_WAL_H
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "value.h"
+
+// Write-ahead log of the batches that change the table, replayed on startup
+// to get back the state the server had. Each record is framed by its length
+// and a CRC32C, so a record torn by a crash is detected and dropped.
+//
+// Records are appended to a buffer in memory by the job threads, and a log
+// thread writes the buffer out and syncs it. Every batch appended while a
+// sync is in progress goes in the next one, so many concurrent batches share
+// a single fdatasync (group commit).
+//
+// Once the log has grown to twice its size after the last rewrite (and to
+// WAL_REWRITE_SIZE at least), it is rewritten: the pairs of a snapshot of the
+// table as WAL_WRITE records, followed by the records appended after the
+// snapshot, so replaying it takes as long as the table is large, not as the
+// server has been up.
+
+// Default time between writes of the log, unless it is synced always. The
+// periodic policy is the default: a crash loses at most this much of the
+// batches answered.
+#define WAL_INTERVAL_MS 10
+// Smallest size of the log at which it is rewritten
+#define WAL_REWRITE_SIZE (64 * 1024 * 1024)
+
+// How the log is synced to disk. WAL_SYNC_ALWAYS is opt-in: a batch is not
+// answered before its record is on disk, but every batch then waits for a
+// fdatasync, which cuts the throughput of small batches by about 80% (see
+// wal_bench), even with group commit.
+typedef enum WalSync {
+  WAL_SYNC_ALWAYS,   // Each batch waits for its record to be synced
+  WAL_SYNC_PERIODIC, // Written and synced every interval
+  WAL_SYNC_NONE,     // Written every interval, synced when the OS sees fit
+} WalSync;
+
+typedef enum WalType {
+  WAL_WRITE = 1,
+  WAL_DELETE,
+  WAL_INCR,
+  WAL_APPEND,
+  WAL_CAS,
+} WalType;
+
+// A batch as it is logged. The batches are replayed as they were run, so
+// the ones whose result depends on the table (INCR, APPEND, CAS) are logged
+// with their arguments, not their results, along with when they were run.
+typedef struct WalRecord {
+  WalType type;
+  uint64_t time;       // Wall clock ms when logged, set by wal_encode
+  unsigned int ttl_ms; // WAL_WRITE: TTL of the pairs, 0 if they have none
+  size_t num_keys;
+  char **keys;
+  const Value *values; // wal_values_per_key(type) values per key, in order
+} WalRecord;
+
+typedef struct Wal {
+  int fd;
+  char *path;
+  WalSync sync;
+  unsigned int interval_ms; // Time between writes, unless WAL_SYNC_ALWAYS
+  pthread_mutex_t lock;
+  pthread_cond_t work;   // Signaled when there is data to write
+  pthread_cond_t synced; // Signaled when data was written (and synced)
+  char *buffer;          // Records appended, not written out yet
+  size_t used;
+  size_t capacity;
+  char *spare; // Second buffer, written out by the log thread
+  size_t spare_capacity;
+  uint64_t appended; // Bytes appended since the log was opened
+  uint64_t durable;  // Bytes written (and synced, if the policy does)
+  int failed;        // The log could not be written, no record is appended
+                     // after that
+  uint64_t start;         // Offset in the file of position 0 of the log
+  uint64_t rewrite_at;    // Size of the file at which the log is rewritten
+  atomic_int rewrite_due; // Set by the append that reached rewrite_at
+  int paused;             // Appends wait while a rewrite switches files
+  int stop;
+  pthread_t thread;
+} Wal;
+
+/// Number of values each key of a record has.
+/// @param type Type of the record.
+size_t wal_values_per_key(WalType type);
+
+/// Replays a log. A torn or corrupt record ends it: the log is truncated
+/// before it, so the records appended next follow the last good one. A
+/// missing log is empty.
+/// @param path Path of the log.
+/// @param apply Function run on each record, in order. The record is only
+/// valid during the call.
+/// @param arg Argument given to apply.
+/// @return 0 if successful, 1 otherwise.
+int wal_replay(const char *path, void (*apply)(const WalRecord *, void *),
+               void *arg);
+
+/// Opens a log to append records to it, creating it if needed, and starts its
+/// log thread.
+/// @param path Path of the log.
+/// @param sync How the log is synced.
+/// @param interval_ms Time between writes (and syncs) of the log, unless it
+/// is synced always.
+/// @return The log, NULL on failure.
+Wal *wal_open(const char *path, WalSync sync, unsigned int interval_ms);
+
+/// Frames a record the way it is stored in the log, stamped with the current
+/// time. Done before the locks of the batch are taken, only the copy into the
+/// log happens with them held.
+/// @param record The record, its time is ignored.
+/// @param len Pointer to store the number of bytes in.
+/// @return The framed record, to be freed by the caller, NULL on failure.
+char *wal_encode(const WalRecord *record, size_t *len);
+
+/// Waits while too much of the log is still to be written, so writers are
+/// held back by a slow disk. Called before the locks of a batch are taken.
+/// @param wal The log.
+void wal_throttle(Wal *wal);
+
+/// Appends a framed record to the log. Called with the locks of the keys of
+/// the batch held, so the log has the changes to each key in the order they
+/// were made. A batch whose record could not be appended must not be run.
+/// @param wal The log.
+/// @param data The framed record.
+/// @param len Number of bytes of the framed record.
+/// @param position Set to the position of the log right after the record.
+/// @return 0 if successful, 1 if the record could not be appended, or the
+/// log failed to be written before.
+int wal_append(Wal *wal, const char *data, size_t len, uint64_t *position);
+
+/// Waits for the log to be durable up to a position, as far as the policy
+/// makes it so: synced with WAL_SYNC_ALWAYS, the others do not wait.
+/// @param wal The log.
+/// @param position Position returned by wal_append.
+/// @return 0 if successful, 1 if the record could not be written.
+int wal_commit(Wal *wal, uint64_t position);
+
+/// Checks whether a log is due to be rewritten, and clears it: only one of
+/// the callers gets 1 each time the log reaches the size to be rewritten at.
+/// @param wal The log.
+/// @return 1 if the log is to be rewritten, 0 otherwise.
+int wal_rewrite_due(Wal *wal);
+
+/// Gets the position of the end of the log. Called with the table in a state
+/// that no batch is changing, so every record before the position and none
+/// after it is in the table.
+/// @param wal The log.
+/// @return The position.
+uint64_t wal_position(Wal *wal);
+
+/// Frames a record and writes it to a file.
+/// @param fd The file.
+/// @param record The record, stamped with the current time.
+/// @return 0 if successful, 1 otherwise.
+int wal_write_record(int fd, const WalRecord *record);
+
+/// Rewrites a log as a state of the table and the records appended after it,
+/// while records go on being appended. The new log replaces the old one once
+/// it is synced, appends only wait for the records appended meanwhile to be
+/// copied.
+/// @param wal The log.
+/// @param position Position of the log the state is at (see wal_position).
+/// @param write_state Function writing the state with wal_write_record,
+/// returns 0 if successful.
+/// @param arg Argument given to write_state.
+/// @return 0 if successful, 1 otherwise (the old log is kept).
+int wal_rewrite(Wal *wal, uint64_t position, int (*write_state)(int, void *),
+                void *arg);
+
+/// Writes out and syncs what is left of a log, stops its thread and closes
+/// it.
+/// @param wal The log.
+/// @return 0 if successful, 1 if the log could not be written.
+int wal_close(Wal *wal);
+
+#endif // KVS_WAL_H
@@ -0,0 +1,99 @@
+#include "wheel.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+void wheel_init(TimingWheel *wheel, uint32_t now) {
+  pthread_mutex_init(&wheel->lock, NULL);
+  wheel->now = now;
+  memset(wheel->slots, 0, sizeof(wheel->slots));
+}
+
+// Puts a timer in the slot of the lowest level that covers its tick. Called
+// with the lock held.
+// @param earliest First tick the timer may fire at, if it is already past.
+static void insert(TimingWheel *wheel, Timer *timer, uint32_t earliest) {
+  // Ticks are compared by difference, so they may wrap around
+  uint32_t tick = timer->expires;
+  if (tick - earliest > UINT32_MAX / 2) {
+    tick = earliest;
+  }
+
+  uint32_t delta = tick - wheel->now;
+  if (delta >= (uint32_t)1 << (WHEEL_BITS * WHEEL_LEVELS)) {
+    // Beyond the last level, waits in its farthest slot and is placed again
+    // when that slot is cascaded
+    delta = ((uint32_t)1 << (WHEEL_BITS * WHEEL_LEVELS)) - 1;
+    tick = wheel->now + delta;
+  }
+
+  size_t level = 0;
+  while (level < WHEEL_LEVELS - 1 &&
+         delta >= (uint32_t)1 << (WHEEL_BITS * (level + 1))) {
+    level++;
+  }
+
+  Timer **slot =
+      &wheel->slots[level][(tick >> (WHEEL_BITS * level)) & (WHEEL_SLOTS - 1)];
+  timer->next = *slot;
+  *slot = timer;
+}
+
+int wheel_add(TimingWheel *wheel, const char *key, uint32_t expires) {
+  size_t key_size = strlen(key) + 1;
+  Timer *timer = malloc(sizeof(Timer) + key_size);
+  if (timer == NULL) {
+    return 1;
+  }
+  timer->expires = expires;
+  memcpy(timer->key, key, key_size);
+
+  pthread_mutex_lock(&wheel->lock);
+  // The current tick was already processed
+  insert(wheel, timer, wheel->now + 1);
+  pthread_mutex_unlock(&wheel->lock);
+  return 0;
+}
+
+Timer *wheel_advance(TimingWheel *wheel) {
+  pthread_mutex_lock(&wheel->lock);
+  uint32_t now = ++wheel->now;
+
+  // When a level wraps around, the next slot of the level above is spread
+  // over the levels below
+  for (size_t level = 1; level < WHEEL_LEVELS; level++) {
+    if ((now >> (WHEEL_BITS * (level - 1))) & (WHEEL_SLOTS - 1)) {
+      break;
+    }
+    Timer **slot =
+        &wheel->slots[level][(now >> (WHEEL_BITS * level)) & (WHEEL_SLOTS - 1)];
+    Timer *timer = *slot;
+    *slot = NULL;
+    while (timer != NULL) {
+      Timer *next = timer->next;
+      insert(wheel, timer, now);
+      timer = next;
+    }
+  }
+
+  Timer **slot = &wheel->slots[0][now & (WHEEL_SLOTS - 1)];
+  Timer *fired = *slot;
+  *slot = NULL;
+  pthread_mutex_unlock(&wheel->lock);
+
+  return fired;
+}
+
+void wheel_destroy(TimingWheel *wheel) {
+  for (size_t level = 0; level < WHEEL_LEVELS; level++) {
+    for (size_t i = 0; i < WHEEL_SLOTS; i++) {
+      Timer *timer = wheel->slots[level][i];
+      while (timer != NULL) {
+        Timer *next = timer->next;
+        free(timer);
+        timer = next;
+      }
+    }
+  }
+  pthread_mutex_destroy(&wheel->lock);
+}
@@ -0,0 +1,51 @@
+#ifndef KVS_WHEEL_H
+#define KVS_WHEEL_H
+
+#include <pthread.h>
+#include <stdint.h>
+
+// Hierarchical timing wheel. Level 0 has one slot per tick, every slot of a
+// level covers a whole turn of the level below it. Adding a timer and
+// expiring it are O(1); timers in upper levels are moved down (cascaded)
+// once, when the lower level wraps around.
+
+#define WHEEL_BITS 6
+#define WHEEL_SLOTS (1 << WHEEL_BITS)
+#define WHEEL_LEVELS 4 // 2^24 ticks, longer timers wait in the last level
+
+typedef struct Timer {
+  struct Timer *next;
+  uint32_t expires; // Tick when the timer fires
+  char key[];
+} Timer;
+
+typedef struct TimingWheel {
+  pthread_mutex_t lock;
+  uint32_t now; // Last tick processed
+  Timer *slots[WHEEL_LEVELS][WHEEL_SLOTS];
+} TimingWheel;
+
+/// Initializes an empty wheel.
+/// @param wheel Wheel to initialize.
+/// @param now Current tick.
+void wheel_init(TimingWheel *wheel, uint32_t now);
+
+/// Adds a timer for a key.
+/// @param wheel The wheel.
+/// @param key Key the timer is for (copied).
+/// @param expires Tick when the timer fires. Timers already past fire on the
+/// next tick.
+/// @return 0 if successful, 1 otherwise.
+int wheel_add(TimingWheel *wheel, const char *key, uint32_t expires);
+
+/// Advances the wheel by one tick.
+/// @param wheel The wheel.
+/// @return List of the timers that fired (to be freed by the caller), linked
+/// through next.
+Timer *wheel_advance(TimingWheel *wheel);
+
+/// Frees every timer of the wheel.
+/// @param wheel Wheel to destroy.
+void wheel_destroy(TimingWheel *wheel);
+
+#endif // KVS_WHEEL_H
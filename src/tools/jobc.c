@@ -0,0 +1,111 @@
+// Compiles a job into the binary format the server runs without parsing
+// (see src/server/jobc.h), for jobs replayed many times. The job is parsed
+// by the parser of the server, so the compiled job runs exactly like the
+// text one, invalid commands included, and writes the same output.
+//
+// Usage: kvs-jobc <job> [output]
+//
+// The output defaults to the job with the .jobc extension. The server runs
+// the compiled job in place of the text one next to it.
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "src/server/jobc.h"
+
+// Compiles every command of a job.
+// @return 0 if successful, 1 otherwise.
+static int compile(JobReader *reader, FILE *out) {
+  Args args;
+  if (args_init(&args) != 0) {
+    fprintf(stderr, "Failed to allocate the arguments\n");
+    return 1;
+  }
+  char *record = NULL;
+  size_t capacity = 0;
+  int failed = fwrite(JOBC_MAGIC, 1, JOBC_MAGIC_SIZE, out) != JOBC_MAGIC_SIZE;
+  JobCommand command;
+  while (!failed) {
+    parse_command(reader, &args, &command);
+    if (command.command == EOC) {
+      break;
+    }
+    if (command.command == CMD_EMPTY) {
+      continue;
+    }
+    size_t size = jobc_size(&command);
+    if (size > capacity) {
+      char *grown = realloc(record, size);
+      if (grown == NULL) {
+        fprintf(stderr, "Failed to allocate a record\n");
+        failed = 1;
+        break;
+      }
+      record = grown;
+      capacity = size;
+    }
+    jobc_encode(&command, record);
+    failed = fwrite(record, 1, size, out) != size;
+  }
+  free(record);
+  args_destroy(&args);
+  return failed;
+}
+
+int main(int argc, char *argv[]) {
+  if (argc < 2 || argc > 3) {
+    fprintf(stderr, "Usage: %s <job> [output]\n", argv[0]);
+    return 1;
+  }
+
+  char *output = argc == 3 ? strdup(argv[2]) : malloc(strlen(argv[1]) + 6);
+  if (output == NULL) {
+    return 1;
+  }
+  if (argc == 2) {
+    strcpy(output, argv[1]);
+    char *dot = strrchr(output, '.');
+    if (dot != NULL && strcmp(dot, ".job") == 0) {
+      *dot = '\0';
+    }
+    strcat(output, ".jobc");
+  }
+
+  int fd = open(argv[1], O_RDONLY);
+  if (fd < 0) {
+    fprintf(stderr, "Failed to open %s: %s\n", argv[1], strerror(errno));
+    free(output);
+    return 1;
+  }
+  JobReader reader;
+  if (reader_init(&reader, fd) != 0) {
+    fprintf(stderr, "Failed to read %s\n", argv[1]);
+    close(fd);
+    free(output);
+    return 1;
+  }
+
+  int failed = 1;
+  FILE *out = fopen(output, "w");
+  if (out == NULL) {
+    fprintf(stderr, "Failed to open %s: %s\n", output, strerror(errno));
+  } else {
+    failed = compile(&reader, out);
+    if (fclose(out) != 0) {
+      failed = 1;
+    }
+    if (failed) {
+      fprintf(stderr, "Failed to write %s\n", output);
+      unlink(output);
+    }
+  }
+
+  reader_destroy(&reader);
+  close(fd);
+  free(output);
+  return failed;
+}
@@ -0,0 +1,167 @@
+// Rebuilds the full backup a delta backup stands for: follows the chain of
+// "DELTA <base>" headers back to a full backup, and replays the deltas on it
+// in order. The result is written in the format of a full backup.
+//
+// Usage: kvs-restore <backup> [output]
+//
+// Every backup has its keys in order, so each delta is applied with a single
+// merge. The backups are read the way the server reads them to start from
+// one (see src/server/load.h).
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "src/server/load.h"
+
+typedef struct Entry {
+  const char *key;
+  size_t key_len;
+  const char *line; // The whole line, as it is in the backup
+  size_t line_len;
+  int removed; // 1 for a key removed by a delta
+} Entry;
+
+typedef struct Backup {
+  Entry *entries;
+  size_t count;
+} Backup;
+
+// Parses the lines of a backup mapped by backup_chain_map.
+// @return 0 if successful, 1 otherwise.
+static int parse_entries(Backup *backup, const BackupFile *file,
+                         const char *path) {
+  size_t capacity = 64;
+  backup->count = 0;
+  backup->entries = malloc(capacity * sizeof(Entry));
+  if (backup->entries == NULL) {
+    return 1;
+  }
+
+  for (size_t pos = file->start; pos < file->size;) {
+    if (backup->count == capacity) {
+      capacity *= 2;
+      Entry *entries = realloc(backup->entries, capacity * sizeof(Entry));
+      if (entries == NULL) {
+        return 1;
+      }
+      backup->entries = entries;
+    }
+    BackupLine line;
+    size_t next = backup_file_parse(file, pos, &line);
+    if (next == 0) {
+      fprintf(stderr, "Invalid line %zu of %s\n", backup->count + 1, path);
+      return 1;
+    }
+    Entry *entry = &backup->entries[backup->count++];
+    entry->key = line.key;
+    entry->key_len = line.key_len;
+    entry->line = file->data + pos;
+    entry->line_len = next - pos;
+    entry->removed = line.value == NULL;
+    pos = next;
+  }
+  return 0;
+}
+
+// Orders keys like the server does (strcmp, keys have no null bytes).
+static int compare_keys(const Entry *a, const Entry *b) {
+  size_t len = a->key_len < b->key_len ? a->key_len : b->key_len;
+  int cmp = memcmp(a->key, b->key, len);
+  if (cmp != 0) {
+    return cmp;
+  }
+  return (a->key_len > b->key_len) - (a->key_len < b->key_len);
+}
+
+// Applies a delta to the pairs of a full backup.
+// @param pairs Pairs in order, replaced by the result.
+// @return 0 if successful, 1 otherwise.
+static int apply_delta(Entry **pairs, size_t *count, const Backup *delta) {
+  Entry *result = malloc((*count + delta->count + 1) * sizeof(Entry));
+  if (result == NULL) {
+    return 1;
+  }
+
+  size_t i = 0, j = 0, n = 0;
+  while (i < *count || j < delta->count) {
+    int cmp = i == *count         ? 1
+              : j == delta->count ? -1
+                                  : compare_keys(&(*pairs)[i],
+                                                 &delta->entries[j]);
+    if (cmp < 0) {
+      result[n++] = (*pairs)[i++];
+      continue;
+    }
+    if (cmp == 0) {
+      i++; // Replaced or removed by the delta
+    }
+    if (!delta->entries[j].removed) {
+      result[n++] = delta->entries[j];
+    }
+    j++;
+  }
+
+  free(*pairs);
+  *pairs = result;
+  *count = n;
+  return 0;
+}
+
+int main(int argc, char *argv[]) {
+  if (argc < 2 || argc > 3) {
+    fprintf(stderr, "Usage: %s <backup> [output]\n", argv[0]);
+    return 1;
+  }
+
+  BackupChain chain;
+  if (backup_chain_map(argv[1], &chain) != 0) {
+    return 1;
+  }
+  size_t length = chain.length;
+  Backup *backups = calloc(length, sizeof(Backup));
+  int failed = backups == NULL;
+  for (size_t i = 0; i < length && !failed; i++) {
+    failed = parse_entries(&backups[i], &chain.files[i],
+                           i > 0 ? chain.files[i - 1].base : argv[1]);
+  }
+
+  Entry *pairs = NULL;
+  size_t count = 0;
+  if (!failed) {
+    pairs = malloc((backups[length - 1].count + 1) * sizeof(Entry));
+    failed = pairs == NULL;
+  }
+  if (!failed) {
+    count = backups[length - 1].count;
+    memcpy(pairs, backups[length - 1].entries, count * sizeof(Entry));
+    for (size_t i = length - 1; i > 0 && !failed; i--) {
+      failed = apply_delta(&pairs, &count, &backups[i - 1]);
+    }
+  }
+
+  if (!failed) {
+    FILE *out = argc == 3 ? fopen(argv[2], "w") : stdout;
+    if (out == NULL) {
+      fprintf(stderr, "Failed to open %s: %s\n", argv[2], strerror(errno));
+      failed = 1;
+    } else {
+      for (size_t i = 0; i < count; i++) {
+        fwrite(pairs[i].line, 1, pairs[i].line_len, out);
+      }
+      if ((out != stdout && fclose(out) != 0) || fflush(stdout) != 0) {
+        fprintf(stderr, "Failed to write the backup\n");
+        failed = 1;
+      }
+    }
+  }
+
+  free(pairs);
+  for (size_t i = 0; backups != NULL && i < length; i++) {
+    free(backups[i].entries);
+  }
+  free(backups);
+  backup_chain_unmap(&chain);
+  return failed;
+}